@@ -0,0 +1,516 @@
+#define _GNU_SOURCE
+
+#include "compress.h"
+#include "hist.h"
+#include "pool.h"
+#include "record.h"
+#include "timecodec.h"
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Offline fleet report over archives copied from many stations.
+ *
+ * usage: analyzer [-j THREADS] [-o SUMMARY] [-m DIR] ARCHIVES
+ *
+ * ARCHIVES holds one directory per station, each with the station's
+ * record.bin (and its segments and cold .z files) and *_hist.bin files;
+ * ARCHIVES itself may be a station too.  The files are read in place in
+ * the layouts of record.h, compress.h and hist.h.
+ *
+ * Work is split into one task per hist file, per cold segment and per
+ * range of ANALYZE_RANGE records of a hot segment, run on a work-stealing
+ * pool (pool.h) with one worker per core by default.  Each task folds its
+ * share into a private partial, which is merged into its station under
+ * the station's lock once at the end of the task.
+ *
+ * The summary has a line per station and one for the whole fleet; -m
+ * also writes the fleet's merged histograms to DIR as hist files the
+ * host can map.  A station without a hist file gets one rebuilt from its
+ * records.
+ */
+#define ANALYZE_RANGE 65536
+#define NCHANNELS 3
+#define HIST_NCOUNTS (NROWS * NBUCKETS)
+
+const char *channel_names[NCHANNELS] = {"tmp", "prs", "hmd"};
+const char *hist_names[NCHANNELS] = {"tmp_hist.bin", "prs_hist.bin", "hmd_hist.bin"};
+
+// what a task found, merged into its station when it finishes
+typedef struct {
+  uint64_t records;
+  uint64_t rained;
+  uint32_t first_minute;
+  uint32_t last_minute;
+  uint64_t sum[NCHANNELS];
+  unsigned char min[NCHANNELS];
+  unsigned char max[NCHANNELS];
+  // counted from the records
+  uint64_t rebuilt[NCHANNELS][HIST_NCOUNTS];
+  // read from the station's hist files
+  uint64_t hist[NCHANNELS][HIST_NCOUNTS];
+  int have_hist[NCHANNELS];
+  uint64_t bytes;
+  uint32_t errors;
+} partial_t;
+
+typedef struct {
+  char dir[512];
+  pthread_mutex_t lock;
+  partial_t total;
+} station_t;
+
+typedef struct {
+  station_t *station;
+  uint32_t seq;
+  uint32_t first;
+  uint32_t count;
+  int channel;
+} job_t;
+
+void partial_init(partial_t *p) {
+  memset(p, 0, sizeof(*p));
+  p->first_minute = UINT32_MAX;
+  memset(p->min, 0xff, sizeof(p->min));
+}
+
+void partial_merge(partial_t *dst, const partial_t *src) {
+  if (src->records) {
+    for (int c = 0; c < NCHANNELS; c++) {
+      dst->sum[c] += src->sum[c];
+      dst->min[c] = src->min[c] < dst->min[c] ? src->min[c] : dst->min[c];
+      dst->max[c] = src->max[c] > dst->max[c] ? src->max[c] : dst->max[c];
+      for (int i = 0; i < HIST_NCOUNTS; i++) {
+        dst->rebuilt[c][i] += src->rebuilt[c][i];
+      }
+    }
+    dst->first_minute = src->first_minute < dst->first_minute ? src->first_minute : dst->first_minute;
+    dst->last_minute = src->last_minute > dst->last_minute ? src->last_minute : dst->last_minute;
+  }
+  for (int c = 0; c < NCHANNELS; c++) {
+    if (src->have_hist[c]) {
+      for (int i = 0; i < HIST_NCOUNTS; i++) {
+        dst->hist[c][i] += src->hist[c][i];
+      }
+      dst->have_hist[c] = 1;
+    }
+  }
+  dst->records += src->records;
+  dst->rained += src->rained;
+  dst->bytes += src->bytes;
+  dst->errors += src->errors;
+}
+
+// hands a task's partial to its station and frees the task
+void finish_job(job_t *job, partial_t *p) {
+  station_t *s = job->station;
+  pthread_mutex_lock(&s->lock);
+  partial_merge(&s->total, p);
+  pthread_mutex_unlock(&s->lock);
+  free(p);
+  free(job);
+}
+
+int add_record(const record_t *r, void *arg) {
+  partial_t *p = arg;
+  unsigned char values[NCHANNELS] = {r->tmp, r->prs, r->hmd};
+  int row = HIST_IMPL(_row)(r->minute);
+
+  for (int c = 0; c < NCHANNELS; c++) {
+    p->sum[c] += values[c];
+    p->min[c] = values[c] < p->min[c] ? values[c] : p->min[c];
+    p->max[c] = values[c] > p->max[c] ? values[c] : p->max[c];
+    p->rebuilt[c][row * NBUCKETS + (values[c] >> BUCKET_SHIFT)]++;
+  }
+  p->first_minute = r->minute < p->first_minute ? r->minute : p->first_minute;
+  p->last_minute = r->minute > p->last_minute ? r->minute : p->last_minute;
+  p->rained += r->rained != 0;
+  p->records++;
+  return 0;
+}
+
+partial_t *new_partial(void) {
+  partial_t *p = malloc(sizeof(partial_t));
+  if (p) {
+    partial_init(p);
+  }
+  return p;
+}
+
+// records first..first+count of hot segment seq
+void range_task(pool_t *pool, int worker, void *arg) {
+  job_t *job = arg;
+  partial_t *p = new_partial();
+  char name[600];
+  (void)pool;
+  (void)worker;
+  if (p == NULL) {
+    free(job);
+    return;
+  }
+
+  snprintf(name, sizeof(name), "%s/record.bin.%06u", job->station->dir, job->seq);
+  int fd = open(name, O_RDONLY);
+  size_t len = ((size_t)job->first + job->count) * sizeof(record_t);
+  record_t *seg = fd == -1 ? MAP_FAILED : mmap(0, len, PROT_READ, MAP_SHARED, fd, 0);
+  if (seg == MAP_FAILED) {
+    fprintf(stderr, "Error mapping %s\n", name);
+    p->errors++;
+  } else {
+    madvise(seg, len, MADV_SEQUENTIAL);
+    for (uint32_t i = job->first; i < job->first + job->count; i++) {
+      add_record(&seg[i], p);
+    }
+    p->bytes += (uint64_t)job->count * sizeof(record_t);
+    munmap(seg, len);
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+  finish_job(job, p);
+}
+
+// a whole cold segment, they can only be decoded from the start
+void cold_task(pool_t *pool, int worker, void *arg) {
+  job_t *job = arg;
+  partial_t *p = new_partial();
+  char base[600];
+  (void)pool;
+  (void)worker;
+  if (p == NULL) {
+    free(job);
+    return;
+  }
+
+  snprintf(base, sizeof(base), "%s/record.bin", job->station->dir);
+  if (scan_cold_segment(base, job->seq, add_record, p, NULL, &p->bytes) < 0) {
+    fprintf(stderr, "Error decoding %s.%06u.z\n", base, job->seq);
+    p->errors++;
+  }
+  finish_job(job, p);
+}
+
+// one hist file, in any counter width construct_hist accepts
+void hist_task(pool_t *pool, int worker, void *arg) {
+  job_t *job = arg;
+  partial_t *p = new_partial();
+  char name[600];
+  struct stat st;
+  (void)pool;
+  (void)worker;
+  if (p == NULL) {
+    free(job);
+    return;
+  }
+
+  snprintf(name, sizeof(name), "%s/%s", job->station->dir, hist_names[job->channel]);
+  int fd = open(name, O_RDONLY);
+  if (fd == -1) {
+    // no hist file, the one rebuilt from the records stands in
+    finish_job(job, p);
+    return;
+  }
+  char *map = fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(hist_header_t)
+                  ? MAP_FAILED
+                  : mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Error mapping %s\n", name);
+    p->errors++;
+    finish_job(job, p);
+    return;
+  }
+
+  const hist_header_t *hdr = (const hist_header_t *)map;
+  if (hdr->magic != HIST_MAGIC || hdr->nbuckets != NBUCKETS || hdr->nrows != NROWS ||
+      hdr->bucket_shift != BUCKET_SHIFT ||
+      st.st_size < (off_t)(sizeof(hist_header_t) + (size_t)HIST_NCOUNTS * hdr->counter_bytes)) {
+    fprintf(stderr, "%s is not a %dx%d hist file\n", name, NROWS, NBUCKETS);
+    p->errors++;
+  } else {
+    for (int i = 0; i < HIST_NCOUNTS; i++) {
+      p->hist[job->channel][i] = hist_counter_at(map + sizeof(hist_header_t), hdr->counter_bytes, i);
+    }
+    p->have_hist[job->channel] = 1;
+    p->bytes += st.st_size;
+  }
+  munmap(map, st.st_size);
+  finish_job(job, p);
+}
+
+int submit_job(pool_t *pool, int worker, void (*fn)(pool_t *, int, void *), station_t *s, uint32_t seq,
+               uint32_t first, uint32_t count, int channel) {
+  job_t *job = malloc(sizeof(job_t));
+  if (job == NULL) {
+    return -1;
+  }
+  *job = (job_t){s, seq, first, count, channel};
+  if (pool_submit(pool, worker, fn, job)) {
+    free(job);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Reads a station's record header and spawns the tasks for its files
+ * onto this worker's deque, for idle workers to steal
+ */
+void station_task(pool_t *pool, int worker, void *arg) {
+  station_t *s = arg;
+  record_meta_t meta;
+  char name[600];
+  int failed = 0;
+
+  for (int c = 0; c < NCHANNELS; c++) {
+    failed |= submit_job(pool, worker, hist_task, s, 0, 0, 0, c);
+  }
+
+  snprintf(name, sizeof(name), "%s/record.bin", s->dir);
+  int fd = open(name, O_RDONLY);
+  if (fd == -1 || pread(fd, &meta, sizeof(meta), 0) != sizeof(meta) || meta.magic != RECORD_MAGIC ||
+      meta.version != RECORD_VERSION || meta.head_seg < meta.first_seg) {
+    fprintf(stderr, "%s is not a version %d record archive\n", name, RECORD_VERSION);
+    failed = 1;
+  } else {
+    // hot segments, in ranges
+    for (uint32_t seq = meta.first_seg; seq <= meta.head_seg; seq++) {
+      uint32_t count = seq == meta.head_seg ? meta.head_count : meta.seg_records;
+      for (uint32_t first = 0; first < count; first += ANALYZE_RANGE) {
+        uint32_t n = count - first < ANALYZE_RANGE ? count - first : ANALYZE_RANGE;
+        failed |= submit_job(pool, worker, range_task, s, seq, first, n, 0);
+      }
+    }
+
+    // cold segments older than the hot ring, the others are still hot
+    DIR *dir = opendir(s->dir);
+    struct dirent *e;
+    while (dir && (e = readdir(dir)) != NULL) {
+      unsigned seq;
+      char z;
+      if (sscanf(e->d_name, "record.bin.%6u.%c", &seq, &z) == 2 && z == 'z' &&
+          strlen(e->d_name) == strlen("record.bin.000000.z") && seq < meta.first_seg) {
+        failed |= submit_job(pool, worker, cold_task, s, seq, 0, 0, 0);
+      }
+    }
+    if (dir) {
+      closedir(dir);
+    }
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+  if (failed) {
+    pthread_mutex_lock(&s->lock);
+    s->total.errors++;
+    pthread_mutex_unlock(&s->lock);
+  }
+}
+
+// the station's histogram of channel c: its hist file, else rebuilt from its records
+const uint64_t *station_hist(const partial_t *p, int c) { return p->have_hist[c] ? p->hist[c] : p->rebuilt[c]; }
+
+void print_summary(FILE *out, const char *name, const partial_t *p, const uint64_t (*hist)[HIST_NCOUNTS]) {
+  char first[STAMPLEN], last[STAMPLEN];
+  format_stamp(p->records ? p->first_minute : 0, first);
+  format_stamp(p->records ? p->last_minute : 0, last);
+  fprintf(out, "%-24s %10llu %.12s %.12s %6.2f", name, (unsigned long long)p->records, first, last,
+          p->records ? 100.0 * p->rained / p->records : 0.0);
+  for (int c = 0; c < NCHANNELS; c++) {
+    uint64_t observations = 0;
+    for (int i = 0; i < HIST_NCOUNTS; i++) {
+      observations += hist[c][i];
+    }
+    if (p->records) {
+      fprintf(out, "  %3u %6.2f %3u", p->min[c], (double)p->sum[c] / p->records, p->max[c]);
+    } else {
+      fprintf(out, "  %3s %6s %3s", "-", "-", "-");
+    }
+    fprintf(out, " %10llu", (unsigned long long)observations);
+  }
+  fprintf(out, "%s\n", p->errors ? "  (errors)" : "");
+}
+
+// writes the merged histograms as hist files in dir
+int write_hists(const char *dir, const uint64_t (*hist)[HIST_NCOUNTS]) {
+  char name[600];
+  for (int c = 0; c < NCHANNELS; c++) {
+    hist_t h;
+    snprintf(name, sizeof(name), "%s/%s", dir, hist_names[c]);
+    unlink(name);
+    if (construct_hist(name, &h)) {
+      return -1;
+    }
+    h.hdr->observations = 0;
+    for (int i = 0; i < HIST_NCOUNTS; i++) {
+      HIST_IMPL(_set)(h.counts, i / NBUCKETS, i % NBUCKETS, hist[c][i]);
+      h.hdr->observations += hist[c][i];
+    }
+    deconstruct_hist(&h);
+  }
+  return 0;
+}
+
+int add_station(station_t **stations, int *n, int *cap, const char *dir) {
+  char name[600];
+  snprintf(name, sizeof(name), "%s/record.bin", dir);
+  if (access(name, R_OK) != 0) {
+    return 0;
+  }
+  if (*n == *cap) {
+    *cap = *cap ? *cap * 2 : 64;
+    station_t *grown = realloc(*stations, *cap * sizeof(station_t));
+    if (grown == NULL) {
+      return -1;
+    }
+    *stations = grown;
+  }
+  station_t *s = &(*stations)[(*n)++];
+  snprintf(s->dir, sizeof(s->dir), "%s", dir);
+  return 0;
+}
+
+int compare_stations(const void *a, const void *b) {
+  return strcmp(((const station_t *)a)->dir, ((const station_t *)b)->dir);
+}
+
+double seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  int nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+  const char *summary = NULL;
+  const char *merged_dir = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "j:o:m:")) != -1) {
+    switch (opt) {
+    case 'j':
+      nworkers = atoi(optarg);
+      break;
+    case 'o':
+      summary = optarg;
+      break;
+    case 'm':
+      merged_dir = optarg;
+      break;
+    default:
+      nworkers = 0;
+      break;
+    }
+  }
+  if (nworkers < 1 || optind != argc - 1) {
+    fprintf(stderr, "usage: %s [-j THREADS] [-o SUMMARY] [-m DIR] ARCHIVES\n", argv[0]);
+    return 1;
+  }
+
+  // every directory with a record.bin is a station
+  const char *root = argv[optind];
+  station_t *stations = NULL;
+  int nstations = 0, cap = 0;
+  char path[512];
+  if (add_station(&stations, &nstations, &cap, root)) {
+    return 1;
+  }
+  DIR *dir = opendir(root);
+  if (dir == NULL) {
+    perror("Error opening archive directory");
+    return 1;
+  }
+  struct dirent *e;
+  while ((e = readdir(dir)) != NULL) {
+    if (e->d_name[0] != '.') {
+      snprintf(path, sizeof(path), "%s/%s", root, e->d_name);
+      if (add_station(&stations, &nstations, &cap, path)) {
+        return 1;
+      }
+    }
+  }
+  closedir(dir);
+  if (nstations == 0) {
+    fprintf(stderr, "No record.bin under %s\n", root);
+    return 1;
+  }
+  qsort(stations, nstations, sizeof(station_t), compare_stations);
+
+  pool_t pool;
+  if (pool_init(&pool, nworkers)) {
+    return 1;
+  }
+  for (int i = 0; i < nstations; i++) {
+    pthread_mutex_init(&stations[i].lock, NULL);
+    partial_init(&stations[i].total);
+    if (pool_submit(&pool, -1, station_task, &stations[i])) {
+      return 1;
+    }
+  }
+  double start = seconds();
+  if (pool_run(&pool)) {
+    return 1;
+  }
+  double elapsed = seconds() - start;
+
+  // merge the stations, each with its best histogram
+  partial_t *fleet = malloc(sizeof(partial_t));
+  uint64_t(*hist)[HIST_NCOUNTS] = calloc(NCHANNELS, sizeof(*hist));
+  uint64_t(*station)[HIST_NCOUNTS] = calloc(NCHANNELS, sizeof(*station));
+  if (fleet == NULL || hist == NULL || station == NULL) {
+    return 1;
+  }
+  partial_init(fleet);
+
+  FILE *out = summary ? fopen(summary, "w") : stdout;
+  if (out == NULL) {
+    perror("Error opening summary");
+    return 1;
+  }
+  fprintf(out, "%-24s %10s %-12s %-12s %6s", "station", "records", "first", "last", "rain%");
+  for (int c = 0; c < NCHANNELS; c++) {
+    fprintf(out, "  %3s %3s avg %3s %10s", "", channel_names[c], "max", "hist obs");
+  }
+  fprintf(out, "\n");
+  for (int i = 0; i < nstations; i++) {
+    partial_t *p = &stations[i].total;
+    for (int c = 0; c < NCHANNELS; c++) {
+      memcpy(station[c], station_hist(p, c), sizeof(station[c]));
+      for (int b = 0; b < HIST_NCOUNTS; b++) {
+        hist[c][b] += station[c][b];
+      }
+    }
+    print_summary(out, stations[i].dir, p, (const uint64_t(*)[HIST_NCOUNTS])station);
+    partial_merge(fleet, p);
+  }
+  print_summary(out, "fleet", fleet, (const uint64_t(*)[HIST_NCOUNTS])hist);
+  if (out != stdout) {
+    fclose(out);
+  }
+
+  if (merged_dir && write_hists(merged_dir, (const uint64_t(*)[HIST_NCOUNTS])hist)) {
+    return 1;
+  }
+
+  uint64_t tasks = 0, stolen = 0;
+  for (int w = 0; w < nworkers; w++) {
+    tasks += pool.deques[w].executed;
+    stolen += pool.deques[w].stolen;
+  }
+  fprintf(stderr, "%d stations, %llu records (%.1f MB of files) in %.3f s, %.1f M records/s on %d workers, %llu tasks, "
+          "%llu stolen\n",
+          nstations, (unsigned long long)fleet->records, fleet->bytes / 1e6, elapsed, fleet->records / 1e6 / elapsed,
+          nworkers, (unsigned long long)tasks, (unsigned long long)stolen);
+
+  int failed = fleet->errors != 0;
+  pool_destroy(&pool);
+  free(fleet);
+  free(hist);
+  free(station);
+  free(stations);
+  return failed ? 2 : 0;
+}
@@ -0,0 +1,433 @@
+#ifndef archive_h_
+#define archive_h_
+#include <stdint.h>
+
+#include "compress.h"
+#include "durability.h"
+#include "metrics.h"
+#include "hist.h"
+#include "histwindow.h"
+#include "quantile.h"
+#include "record.h"
+#include "rollup.h"
+#include "stats.h"
+#include "timecodec.h"
+
+char *hist_file_names[3] = {"tmp_hist.bin", "prs_hist.bin", "hmd_hist.bin"};
+char *quantile_file_names[3] = {"tmp_quantile.bin", "prs_quantile.bin", "hmd_quantile.bin"};
+
+#define ARCHIVE_WAL "archive.wal"
+// longest path of an archive file, as record.h keeps it
+#define ARCHIVE_PATHLEN 256
+/*
+ * counters the write-ahead log is based on: 3 hists, 3 quantiles, records,
+ * rollups (every tier counts every reading, so they share one), windows;
+ * logs written before the last two existed have fewer
+ */
+#define ARCHIVE_NCOUNTERS 9
+#define ARCHIVE_V1_NCOUNTERS 7
+// readings a full log batch holds (a reading plus its crc per entry)
+#define ARCHIVE_PENDING (WAL_BATCH / (sizeof(record_t) + 2))
+
+/*
+ * Everything a reading is folded into, mapped before the fork
+ * so both processes see the same files
+ */
+typedef struct {
+  record_store_t record;
+  // Three histograms, Temp, Pressure, Humidity
+  hist_t hists[3];
+  // and a quantile sketch for each of them
+  quantile_t quantiles[3];
+  // hourly, daily and monthly buckets
+  rollup_t rollups[NTIERS];
+  // recent and decayed hists of all three channels
+  hist_window_t window;
+  // rolling aggregates, in shared memory only
+  stats_t *stats;
+  // when and how the files are flushed
+  durability_t durability;
+  // turns sealed record segments into the cold tier
+  compressor_t compressor;
+  // readings in the log batch that are not applied yet (archive_flush)
+  record_t pending[ARCHIVE_PENDING];
+  uint32_t npending;
+} archive_t;
+
+// descriptors of every file a reading can land in, returns how many
+int archive_fds(archive_t *archive, int *fds) {
+  int n = 0;
+  for (int i = 0; i < 3; i++) {
+    fds[n++] = archive->hists[i].fd;
+    fds[n++] = archive->quantiles[i].fd;
+  }
+  for (int t = 0; t < NTIERS; t++) {
+    fds[n++] = archive->rollups[t].fd;
+  }
+  fds[n++] = archive->window.fd;
+  fds[n++] = archive->record.meta_fd;
+  fds[n++] = archive->record.index_fd;
+  for (int i = 0; i < SEGMENT_SLOTS; i++) {
+    if (archive->record.segs[i]) {
+      fds[n++] = archive->record.seg_fds[i];
+    }
+  }
+  return n;
+}
+
+// how many readings each file has applied, in write-ahead log order
+void archive_counters(archive_t *archive, uint64_t *counters) {
+  for (int i = 0; i < 3; i++) {
+    counters[i] = archive->hists[i].hdr->observations;
+    counters[3 + i] = archive->quantiles[i].hdr->observations;
+  }
+  counters[6] = archive->record.meta->total;
+  counters[7] = archive->rollups[TIER_HOUR].hdr->observations;
+  counters[8] = archive->window.hdr->observations;
+}
+
+/*
+ * Folds one reading into the files whose counter is at most pos (every
+ * file when pos is NULL) and into the rolling stats.
+ * The record goes first, so when the process dies every other file can
+ * only be behind the records, which archive_catch_up makes good.  That
+ * holds for a crash of the process only: on a power cut or a kernel
+ * crash the pages of the mapped files reach the disk in no particular
+ * order, and only the write-ahead log (-d wal) puts them back in step.
+ */
+void apply_reading(archive_t *archive, const record_t *reading, const uint64_t *pos) {
+  uint64_t counters[ARCHIVE_NCOUNTERS] = {0};
+  unsigned char values[3] = {reading->tmp, reading->prs, reading->hmd};
+
+  if (pos) {
+    archive_counters(archive, counters);
+  }
+  uint64_t t = metric_start_sampled();
+  if (!pos || pos[6] >= counters[6]) {
+    update_record(&archive->record, reading);
+  }
+  t = metric_lap(STAGE_RECORD, t);
+  // hist and quantile pick their row from the minute of the day
+  for (int i = 0; i < 3; i++) {
+    if (!pos || pos[i] >= counters[i]) {
+      update_hist(&archive->hists[i], values[i], reading->minute);
+    }
+    if (!pos || pos[3 + i] >= counters[3 + i]) {
+      update_quantile(&archive->quantiles[i], values[i], reading->minute);
+    }
+  }
+  if (!pos || pos[8] >= counters[8]) {
+    update_hist_window(&archive->window, values, reading->minute);
+  }
+  t = metric_lap(STAGE_HIST, t);
+  for (int i = 0; i < NTIERS; i++) {
+    if (!pos || pos[7] >= archive->rollups[i].hdr->observations) {
+      update_rollup(&archive->rollups[i], reading);
+    }
+  }
+  t = metric_lap(STAGE_ROLLUP, t);
+  update_stats(archive->stats, reading->minute, reading->tmp, reading->prs, reading->hmd, reading->rained);
+  metric_lap(STAGE_STATS, t);
+}
+
+void replay_reading(const void *entry, const uint64_t *pos, int ncounters, void *arg) {
+  uint64_t at[ARCHIVE_NCOUNTERS];
+  record_t reading;
+  memcpy(&reading, entry, sizeof(reading));
+  if (ncounters == ARCHIVE_NCOUNTERS) {
+    apply_reading(arg, &reading, pos);
+  } else if (ncounters >= ARCHIVE_V1_NCOUNTERS && ncounters < ARCHIVE_NCOUNTERS) {
+    // files that did not exist yet cannot have the reading
+    for (int i = 0; i < ARCHIVE_NCOUNTERS; i++) {
+      at[i] = i < ncounters ? pos[i] : UINT64_MAX;
+    }
+    apply_reading(arg, &reading, at);
+  }
+}
+
+/*
+ * Writes out the log batch and only then applies the readings in it, so
+ * no mapped file can reach the disk with a reading the log never saw.
+ * returns how many readings were applied
+ */
+uint32_t archive_apply_pending(archive_t *archive) {
+  uint32_t n = archive->npending;
+  if (n == 0) {
+    return 0;
+  }
+  if (wal_flush(&archive->durability)) {
+    fprintf(stderr, "Applying %u readings the write-ahead log does not have\n", n);
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    apply_reading(archive, &archive->pending[i], NULL);
+  }
+  metric_add(COUNTER_READINGS, n);
+  archive->npending = 0;
+  return n;
+}
+
+/*
+ * Hands the current files to the durability engine.  A commit may start
+ * a new log generation based on the files' counters, so readings already
+ * in the log have to be applied first or the new base falls behind them.
+ */
+void archive_commit(archive_t *archive) {
+  int fds[DURABILITY_MAXFDS];
+  uint64_t counters[ARCHIVE_NCOUNTERS];
+  archive_apply_pending(archive);
+  int n = archive_fds(archive, fds);
+  archive_counters(archive, counters);
+  durability_commit(&archive->durability, fds, n, counters, ARCHIVE_NCOUNTERS);
+}
+
+// applies and commits (when due) one reading
+void archive_apply(archive_t *archive, const record_t *reading) {
+  apply_reading(archive, reading, NULL);
+  metric_add(COUNTER_READINGS, 1);
+  if (durability_due(&archive->durability, 1)) {
+    uint64_t t = metric_start();
+    archive_commit(archive);
+    metric_lap(STAGE_COMMIT, t);
+  }
+}
+
+/*
+ * Writes out the log batch, applies the readings in it and then commits
+ * once if that is due, never partway through the batch.
+ * The data loop calls it once per wakeup; without a log readings are
+ * applied as they come and there is nothing to do.
+ */
+void archive_flush(archive_t *archive) {
+  uint32_t n = archive_apply_pending(archive);
+  if (n && durability_due(&archive->durability, n)) {
+    uint64_t t = metric_start();
+    archive_commit(archive);
+    metric_lap(STAGE_COMMIT, t);
+  }
+}
+
+/*
+ * Logs and applies one reading, with a write-ahead log it is applied by
+ * the next archive_flush
+ */
+void ingest_reading(archive_t *archive, const record_t *reading) {
+  durability_t *d = &archive->durability;
+  if (d->mode != DURABILITY_WAL) {
+    archive_apply(archive, reading);
+    return;
+  }
+  if (archive->npending == ARCHIVE_PENDING) {
+    archive_flush(archive);
+  }
+  uint64_t t = metric_start_sampled();
+  wal_append(d, reading);
+  metric_lap(STAGE_WAL, t);
+  archive->pending[archive->npending++] = *reading;
+}
+
+/*
+ * After a crash of the process, replays into every file the readings it
+ * missed that the records still hold, going by the counters marked in
+ * the record header when the archive was last opened (record_meta_t).
+ * A file ahead of the records, which only a power cut without the
+ * write-ahead log leaves behind, is left as it is.
+ * returns how many records were replayed
+ */
+uint64_t archive_catch_up(archive_t *archive) {
+  record_store_t *rs = &archive->record;
+  const record_meta_t *meta = rs->meta;
+  uint64_t counters[ARCHIVE_NCOUNTERS];
+  uint64_t pos[ARCHIVE_NCOUNTERS];
+
+  if (meta->nmarks != ARCHIVE_NCOUNTERS) {
+    return 0;
+  }
+  archive_counters(archive, counters);
+  // every rollup tier counts on its own but shares a counter in the log
+  uint64_t rollups = UINT64_MAX;
+  for (int t = 0; t < NTIERS; t++) {
+    rollups = archive->rollups[t].hdr->observations < rollups ? archive->rollups[t].hdr->observations : rollups;
+  }
+  counters[7] = rollups;
+
+  uint64_t from = meta->total;
+  for (int i = 0; i < ARCHIVE_NCOUNTERS; i++) {
+    uint64_t due = meta->marks[i] + (meta->total - meta->marked);
+    uint64_t missed = counters[i] < due ? due - counters[i] : 0;
+    uint64_t start = missed < meta->total ? meta->total - missed : 0;
+    from = start < from ? start : from;
+  }
+  uint64_t oldest = (uint64_t)meta->first_seg * rs->seg_records;
+  if (from < oldest) {
+    fprintf(stderr, "%llu readings are no longer in the records, some files stay short of them\n",
+            (unsigned long long)(oldest - from));
+    from = oldest;
+  }
+
+  for (uint64_t n = from; n < meta->total; n++) {
+    record_t *seg = map_segment(rs, n / rs->seg_records, 0);
+    if (seg == NULL) {
+      break;
+    }
+    for (int i = 0; i < ARCHIVE_NCOUNTERS; i++) {
+      pos[i] = meta->marks[i] + (n - meta->marked);
+    }
+    apply_reading(archive, &seg[n % rs->seg_records], pos);
+  }
+  return meta->total - from;
+}
+
+// name inside dir, or name itself (in the working directory) when dir is NULL
+void archive_path(const char *dir, const char *name, char *path) {
+  if (dir == NULL) {
+    snprintf(path, ARCHIVE_PATHLEN, "%s", name);
+  } else {
+    snprintf(path, ARCHIVE_PATHLEN, "%s/%s", dir, name);
+  }
+}
+
+/*
+ * Opens and maps every archive file in dir (created if missing; NULL
+ * for the working directory), replaying the write-ahead log if
+ * mode is DURABILITY_WAL, and then the tail of the records into files
+ * that missed it.  Returns 0 on success; on failure everything
+ * opened so far is closed again.
+ */
+int construct_archive(archive_t *archive, const char *dir, enum durability_mode mode, uint32_t every_n,
+                      uint32_t every_ms, const record_capacity_t *capacity) {
+  char path[ARCHIVE_PATHLEN];
+  int nhists = 0;
+  int nquantiles = 0;
+  int have_record = 0;
+  int nrollups = 0;
+  int have_window = 0;
+
+  if (dir != NULL && mkdir(dir, 0700) == -1 && errno != EEXIST) {
+    perror("Error creating archive directory");
+    return -1;
+  }
+  for (nhists = 0; nhists < 3; nhists++) {
+    /*
+     * construct_hist is responsible for opening the file and mmaping the file
+     * reports the file descriptor and mapped region by filling a user
+     * provided hist_t
+     * return value is 0 on success
+     */
+    archive_path(dir, hist_file_names[nhists], path);
+    if (construct_hist(path, &archive->hists[nhists])) {
+      goto fail;
+    }
+  }
+  for (nquantiles = 0; nquantiles < 3; nquantiles++) {
+    archive_path(dir, quantile_file_names[nquantiles], path);
+    if (construct_quantile(path, &archive->quantiles[nquantiles])) {
+      goto fail;
+    }
+  }
+  /*
+   * construct_record is responsible for opening the header file and mmaping
+   * it along with the head segment, resuming an existing archive or
+   * creating one sized to capacity
+   * the state is loaded into a user provided record_store_t
+   * return value is 0 on success
+   */
+  archive_path(dir, "record.bin", path);
+  if (construct_record(path, &archive->record, capacity)) {
+    goto fail;
+  }
+  have_record = 1;
+
+  archive_path(dir, WINDOW_FILE, path);
+  if (construct_hist_window(path, &archive->window)) {
+    goto fail;
+  }
+  have_window = 1;
+
+  // a tier that is new misses whatever the records already hold
+  for (nrollups = 0; nrollups < NTIERS; nrollups++) {
+    archive_path(dir, rollup_file_names[nrollups], path);
+    if (construct_rollup(path, nrollups, &archive->rollups[nrollups], archive->record.meta->total)) {
+      goto fail;
+    }
+  }
+
+  if ((archive->stats = construct_stats()) == NULL) {
+    goto fail;
+  }
+
+  memset(&archive->compressor, 0, sizeof(archive->compressor));
+  archive->npending = 0;
+  archive_path(dir, ARCHIVE_WAL, path);
+  durability_init(&archive->durability, mode, every_n, every_ms, path, sizeof(record_t));
+  if (mode == DURABILITY_WAL) {
+    wal_replay(&archive->durability, replay_reading, archive);
+  }
+  uint64_t replayed = archive_catch_up(archive);
+  if (replayed) {
+    fprintf(stderr, "Replayed the last %llu records into the files that missed them\n",
+            (unsigned long long)replayed);
+  }
+  uint64_t counters[ARCHIVE_NCOUNTERS];
+  archive_counters(archive, counters);
+  mark_record(&archive->record, counters, ARCHIVE_NCOUNTERS);
+  if (mode == DURABILITY_WAL) {
+    int fds[DURABILITY_MAXFDS];
+    if (wal_open(&archive->durability, fds, archive_fds(archive, fds), counters, ARCHIVE_NCOUNTERS)) {
+      goto fail;
+    }
+  }
+  return 0;
+
+fail:
+  for (int i = 0; i < nhists; i++) {
+    deconstruct_hist(&archive->hists[i]);
+  }
+  for (int i = 0; i < nquantiles; i++) {
+    deconstruct_quantile(&archive->quantiles[i]);
+  }
+  if (have_record) {
+    deconstruct_record(&archive->record);
+  }
+  if (have_window) {
+    deconstruct_hist_window(&archive->window);
+  }
+  for (int i = 0; i < nrollups; i++) {
+    deconstruct_rollup(&archive->rollups[i]);
+  }
+  return -1;
+}
+
+/*
+ * Starts the archive's background threads (the syncer and the segment
+ * compressor); call it in the process that ingests, after any fork.
+ * Returns 0 on success.
+ */
+int archive_start(archive_t *archive) {
+  if (durability_start(&archive->durability)) {
+    return -1;
+  }
+  return compressor_start(&archive->compressor, &archive->record);
+}
+
+/*
+ * Flushes (per the durability mode) and un-maps everything
+ */
+int deconstruct_archive(archive_t *archive) {
+  int fds[DURABILITY_MAXFDS];
+  archive_flush(archive);
+  compressor_stop(&archive->compressor, &archive->record);
+  durability_stop(&archive->durability, fds, archive_fds(archive, fds));
+  for (int i = 0; i < 3; i++) {
+    deconstruct_hist(&archive->hists[i]);
+    deconstruct_quantile(&archive->quantiles[i]);
+  }
+  deconstruct_record(&archive->record);
+  deconstruct_hist_window(&archive->window);
+  for (int t = 0; t < NTIERS; t++) {
+    deconstruct_rollup(&archive->rollups[t]);
+  }
+  munmap(archive->stats, sizeof(stats_t));
+  return 0;
+}
+
+#endif
@@ -1,9 +1,13 @@
 #ifndef arduinocom_h_
 #define arduinocom_h_
 
+#include "protocol.h"
+#include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <string.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 enum message {
@@ -12,33 +16,218 @@ enum message {
   PAUSE = '3',
   RESUME = '4',
   EXIT = '5',
+  DATA = 'D',
+  HELLO = 'H',
+  BAUD = 'B',
 };
 
+// the sketch always boots at this rate, faster rates are negotiated
+#define BOOT_BAUD 9600
+#define PROTOCOL_VERSION 1
+// how long to wait for the sketch to answer before giving up
+#define HANDSHAKE_TIMEOUT_MS 5000
+// how often to repeat the HELLO while the sketch is still booting
+#define HELLO_RETRY_MS 100
+// how long a write may wait for room in a full tty output buffer
+#define WRITE_TIMEOUT_MS 1000
 
-// blocking write
-int send_msg(const char *msg, int len, int fd) {
+/*
+ * Every reading the Arduino sends back is exactly 16 bytes
+ * (see the reply table in handle_reply), carried in a DATA frame
+ */
+#define REPLYLEN 16
+#define MAXDEVICES 16
+
+/*
+ * Per-device state machine used by the event loop.
+ * A device is IDLE until a REQUEST(n) frame is written to it, then
+ * AWAITING until all n DATA frames have come back, FAILED once its
+ * serial port has gone away.  Received bytes are
+ * kept in the frame parser across wakeups so the loop never blocks on
+ * a single device.
+ */
+enum dev_state {
+  DEV_IDLE,
+  DEV_AWAITING,
+  DEV_FAILED,
+};
+
+struct device {
+  int fd;
+  enum dev_state state;
+  frame_parser_t parser;
+  char reply[REPLYLEN + 1];
+  int pending;       // readings still expected for the current request
+  long requested_ms; // when the current request was written (now_ms)
+  int num_readings;
+  int want_reply;    // forward the next reply to the CLI
+  uint64_t short_reads; // reads shorter than one DATA frame
+};
+
+long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+void dev_init(struct device *dev, int fd) {
+  memset(dev, 0, sizeof(*dev));
+  dev->fd = fd;
+  dev->state = DEV_IDLE;
+}
+
+/*
+ * Writes raw bytes to the device without discarding its pending input.
+ * The tty is non-blocking, so when its output buffer is full this sleeps
+ * in poll until there is room again, for WRITE_TIMEOUT_MS at most
+ * returns the bytes written (short if the line stayed full), -1 on error
+ */
+int dev_write(struct device *dev, const void *buf, int len) {
+  struct pollfd pfd = {dev->fd, POLLOUT, 0};
   int quantity = 0;
   while (len - quantity) {
-    int res = write(fd, msg + quantity, len - quantity);
+    int res = write(dev->fd, (const char *)buf + quantity, len - quantity);
     if (res >= 0) {
       quantity += res;
-    } else {
+    } else if (errno == EAGAIN) {
+      res = poll(&pfd, 1, WRITE_TIMEOUT_MS);
+      if (res == 0) {
+        return quantity;
+      }
+      if (res == -1 && errno != EINTR) {
+        return -1;
+      }
+    } else if (errno != EINTR) {
       return res;
     }
   }
-  tcflush(fd, TCIOFLUSH);
   return quantity;
 }
 
-// non blocking read
-int recv_msg(char *buf, int max_len, int fd) { return read(fd, buf, max_len); }
+// frame a command with an optional one byte argument and send it
+int dev_send(struct device *dev, enum message type, const char *arg, int arglen) {
+  unsigned char frame[FRAME_MAXLEN];
+  int len = frame_encode(type, arg, arglen, frame);
+  if (len < 0) {
+    return -1;
+  }
+  return dev_write(dev, frame, len) == len ? 0 : -1;
+}
+
+// dev waits for a batch of n readings now that it has been asked for them
+void dev_expect(struct device *dev, int n) {
+  dev->state = DEV_AWAITING;
+  dev->pending = n;
+  dev->requested_ms = now_ms();
+}
+
+// ask the device for a batch of n readings and start waiting for them
+int dev_request(struct device *dev, int n) {
+  char count = (char)n;
+  if (dev_send(dev, REQUEST, &count, 1)) {
+    return -1;
+  }
+  dev_expect(dev, n);
+  return 0;
+}
+
+/*
+ * Takes the next DATA frame out of what the parser has buffered
+ * returns 1 once it is copied into reply, 0 if none is complete yet
+ */
+int dev_next(struct device *dev) {
+  unsigned char payload[FRAME_MAXPAYLOAD];
+  unsigned char type;
+  int len;
+
+  while (frame_next(&dev->parser, &type, payload, &len)) {
+    if (type != DATA || len != REPLYLEN) {
+      continue;
+    }
+    memcpy(dev->reply, payload, REPLYLEN);
+    dev->reply[REPLYLEN] = '\0';
+    dev->num_readings++;
+    if (dev->pending > 0 && --dev->pending == 0) {
+      dev->state = DEV_IDLE;
+    }
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Hands bytes read elsewhere (io_uring) to the parser, as many as fit
+ * returns how many it took; take the frames out with dev_next and feed
+ * the rest
+ */
+int dev_feed(struct device *dev, const unsigned char *buf, int n) {
+  frame_parser_t *p = &dev->parser;
+  int room = sizeof(p->buf) - p->len;
+  n = n < room ? n : room;
+  memcpy(p->buf + p->len, buf, n);
+  p->len += n;
+  return n;
+}
+
+/*
+ * Drains whatever the device has ready through its frame parser.
+ * Returns 1 each time a DATA frame has been copied into reply (call it
+ * again for the next one), 0 once nothing complete is buffered and -1 if
+ * the device failed.
+ * Note that with VMIN = VTIME = 0 an empty tty reads as 0 bytes,
+ * so a hangup has to be detected by the caller (EPOLLHUP).
+ */
+int dev_recv(struct device *dev) {
+  frame_parser_t *p = &dev->parser;
+
+  while (1) {
+    if (dev_next(dev)) {
+      return 1;
+    }
+
+    int res = read(dev->fd, p->buf + p->len, sizeof(p->buf) - p->len);
+    if (res == 0) {
+      return 0;
+    }
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return (errno == EAGAIN) ? 0 : -1;
+    }
+    p->len += res;
+    if (res < FRAME_HEADER + REPLYLEN + FRAME_TRAILER) {
+      dev->short_reads++;
+    }
+  }
+}
+
+// maps a baud rate to its termios constant, 0 if unsupported
+speed_t baud_to_speed(long baud) {
+  switch (baud) {
+  case 9600:
+    return B9600;
+  case 19200:
+    return B19200;
+  case 38400:
+    return B38400;
+  case 57600:
+    return B57600;
+  case 115200:
+    return B115200;
+  case 230400:
+    return B230400;
+  default:
+    return 0;
+  }
+}
 
-int init_tty(int fd) {
+int init_tty(int fd, speed_t speed) {
   struct termios tty;
   /*
    * Configure the serial port.
    * First, get a reference to options for the tty
-   * Then, set the baud rate to 9600 (same as on Arduino)
+   * Then, set the baud rate (BOOT_BAUD unless one was negotiated)
    */
   memset(&tty, 0, sizeof(tty));
   if (tcgetattr(fd, &tty) == -1) {
@@ -46,11 +235,11 @@ int init_tty(int fd) {
     return -1;
   }
 
-  if (cfsetospeed(&tty, (speed_t)B9600) == -1) {
+  if (cfsetospeed(&tty, speed) == -1) {
     perror("ctsetospeed");
     return -1;
   }
-  if (cfsetispeed(&tty, (speed_t)B9600) == -1) {
+  if (cfsetispeed(&tty, speed) == -1) {
     perror("ctsetispeed");
     return -1;
   }
@@ -83,8 +272,108 @@ int init_tty(int fd) {
     perror("tcsetattr");
     return -1;
   }
-  sleep(4);
   return 0;
 }
 
+/*
+ * Waits up to timeout_ms for a frame of the given type from dev,
+ * discarding any other frames that arrive first.  If resend is not
+ * NULL that frame is written again every HELLO_RETRY_MS while waiting.
+ * Returns the payload length, or -1 on timeout or error.
+ */
+int dev_wait_frame(struct device *dev, enum message type, unsigned char *payload, long timeout_ms,
+                   const unsigned char *resend, int resend_len) {
+  frame_parser_t *p = &dev->parser;
+  long deadline = now_ms() + timeout_ms;
+  long next_send = 0;
+  unsigned char got;
+  int len;
+
+  while (1) {
+    while (frame_next(p, &got, payload, &len)) {
+      if (got == type) {
+        return len;
+      }
+    }
+
+    long now = now_ms();
+    if (now >= deadline) {
+      return -1;
+    }
+    if (resend && now >= next_send) {
+      dev_write(dev, resend, resend_len);
+      next_send = now + HELLO_RETRY_MS;
+    }
+
+    long wait = deadline - now;
+    if (resend && next_send - now < wait) {
+      wait = next_send - now;
+    }
+    struct pollfd pfd = {dev->fd, POLLIN, 0};
+    if (poll(&pfd, 1, (int)wait) < 0 && errno != EINTR) {
+      return -1;
+    }
+    if (pfd.revents & POLLIN) {
+      int res = read(dev->fd, p->buf + p->len, sizeof(p->buf) - p->len);
+      if (res > 0) {
+        p->len += res;
+      }
+    }
+  }
+}
+
+/*
+ * Readiness handshake: keep sending HELLO until the sketch answers with
+ * its own HELLO (version, baud).  The sketch also sends one unprompted
+ * right after Serial.begin, so a device that is still booting is picked
+ * up the moment it is ready and one that is already up answers at once.
+ * Returns 0 on success.
+ */
+int dev_handshake(struct device *dev, long timeout_ms) {
+  unsigned char hello[FRAME_MAXLEN];
+  unsigned char payload[FRAME_MAXPAYLOAD];
+  int hello_len = frame_encode(HELLO, NULL, 0, hello);
+
+  int len = dev_wait_frame(dev, HELLO, payload, timeout_ms, hello, hello_len);
+  if (len < 1) {
+    fprintf(stderr, "No HELLO from the Arduino\n");
+    return -1;
+  }
+  if (payload[0] != PROTOCOL_VERSION) {
+    fprintf(stderr, "Arduino speaks protocol version %d, expected %d\n", payload[0], PROTOCOL_VERSION);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Moves an already handshaken device from BOOT_BAUD to baud: the sketch
+ * acknowledges the BAUD frame at the old rate and then switches, the host
+ * waits for the ack to finish, switches too and handshakes again.
+ * Returns 0 on success.
+ */
+int dev_set_baud(struct device *dev, long baud, long timeout_ms) {
+  unsigned char payload[FRAME_MAXPAYLOAD];
+  unsigned char rate[4] = {(baud >> 24) & 0xFF, (baud >> 16) & 0xFF, (baud >> 8) & 0xFF, baud & 0xFF};
+  speed_t speed = baud_to_speed(baud);
+
+  if (speed == 0) {
+    fprintf(stderr, "Unsupported baud rate %ld\n", baud);
+    return -1;
+  }
+  if (baud == BOOT_BAUD) {
+    return 0;
+  }
+  if (dev_send(dev, BAUD, (const char *)rate, 4) ||
+      dev_wait_frame(dev, BAUD, payload, timeout_ms, NULL, 0) != 4 || memcmp(payload, rate, 4)) {
+    fprintf(stderr, "Arduino did not accept baud rate %ld\n", baud);
+    return -1;
+  }
+  tcdrain(dev->fd);
+  if (init_tty(dev->fd, speed)) {
+    return -1;
+  }
+  return dev_handshake(dev, timeout_ms);
+}
+
 #endif
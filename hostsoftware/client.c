@@ -0,0 +1,101 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "server.h"
+
+/*
+ * Client of the host's query server (server.h).
+ *
+ * usage: client [-s SOCKET] [COMMAND ...]
+ *
+ * With a command (e.g. client hist t, or client select count group by day)
+ * it prints the answer and exits; without one it reads commands from
+ * stdin, one per line, and prints each answer in turn.
+ * Every command goes over a connection of its own, which the server
+ * closes once it has answered, so an answer needs no terminator.
+ * With several stations a command reads station 0 unless it is put
+ * as e.g. client station 1 hist t.
+ */
+
+/*
+ * Sends one command and copies the answer to stdout
+ * returns 0 on success
+ */
+int ask(const char *path, const char *command) {
+  struct sockaddr_un addr;
+  char buf[4096];
+  ssize_t n;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    perror("Error connecting to the host");
+    if (fd != -1) {
+      close(fd);
+    }
+    return -1;
+  }
+
+  size_t len = strlen(command);
+  if (write(fd, command, len) != (ssize_t)len || (command[len - 1] != '\n' && write(fd, "\n", 1) != 1) ||
+      shutdown(fd, SHUT_WR) == -1) {
+    perror("Error sending the command");
+    close(fd);
+    return -1;
+  }
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    fwrite(buf, 1, n, stdout);
+  }
+  fflush(stdout);
+  close(fd);
+  return n < 0 ? -1 : 0;
+}
+
+int main(int argc, char **argv) {
+  const char *path = SERVER_SOCKET;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:")) != -1) {
+    if (opt == 's') {
+      path = optarg;
+    } else {
+      fprintf(stderr, "Usage: %s [-s socket] [command ...]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if (optind < argc) {
+    char command[1024] = "";
+    size_t used = 0;
+    for (int i = optind; i < argc; i++) {
+      used += snprintf(command + used, used < sizeof(command) ? sizeof(command) - used : 0, "%s%s",
+                       i > optind ? " " : "", argv[i]);
+    }
+    if (used >= sizeof(command)) {
+      fprintf(stderr, "Command too long\n");
+      return 1;
+    }
+    return ask(path, command) ? 1 : 0;
+  }
+
+  char *line = NULL;
+  size_t len = 0;
+  int res = 0;
+  while (getline(&line, &len, stdin) > 0) {
+    if (line[0] != '\n' && ask(path, line)) {
+      res = 1;
+      break;
+    }
+  }
+  free(line);
+  return res;
+}
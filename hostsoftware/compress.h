@@ -0,0 +1,546 @@
+#ifndef compress_h_
+#define compress_h_
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "protocol.h"
+#include "record.h"
+
+/*
+ * Cold tier of the record archive.  Once a segment is sealed (the head
+ * moved past it) a background thread compresses it into
+ * <segment name>.z, which outlives the raw segment when that drops out
+ * of the ring, for the last cold_segments segments (record_capacity_t).
+ * On start the thread first compresses the sealed segments still in the
+ * ring that have no cold file, such as one sealed just before a crash.
+ *
+ * The records are stored column by column after a cseg_header_t:
+ *   minute     delta-of-delta, zig-zag, bit-packed in blocks of 64
+ *   tmp/prs/hmd  delta from the previous record, zig-zag, bit-packed
+ *   rained     run-length encoded: (value, varint run length) pairs
+ * A bit-packed block is one byte holding the bit width w of its largest
+ * value, then its values in w bits each, padded to a byte.  Hourly
+ * readings have a delta-of-delta of 0, so their timestamps cost one
+ * byte per block, and slowly varying channels a few bits per reading.
+ */
+#define CSEG_MAGIC 0x5a434552 // "RECZ"
+#define CSEG_VERSION 1
+#define CSEG_BLOCK 64
+// upper bound of an encoded segment of n records
+#define CSEG_MAXBYTES(n) (sizeof(cseg_header_t) + 4 * ((n) / CSEG_BLOCK + 1) * (1 + 8 * CSEG_BLOCK) + 6 * (n))
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t seq;
+  uint32_t count;
+  uint32_t first_minute;
+  unsigned char first[3];
+  unsigned char pad;
+  uint32_t body_bytes;
+  // CRC16-CCITT of the body
+  uint32_t crc;
+} cseg_header_t;
+
+typedef struct {
+  unsigned char *p;
+  uint64_t acc;
+  int bits;
+} bitwriter_t;
+
+typedef struct {
+  const unsigned char *p;
+  const unsigned char *end;
+  uint64_t acc;
+  int bits;
+} bitreader_t;
+
+uint64_t zigzag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+int64_t unzigzag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+// appends the low n (<= 32) bits of v
+void bw_put(bitwriter_t *w, uint64_t v, int n) {
+  w->acc |= v << w->bits;
+  w->bits += n;
+  while (w->bits >= 8) {
+    *w->p++ = (unsigned char)w->acc;
+    w->acc >>= 8;
+    w->bits -= 8;
+  }
+}
+
+void bw_flush(bitwriter_t *w) {
+  if (w->bits > 0) {
+    *w->p++ = (unsigned char)w->acc;
+  }
+  w->acc = 0;
+  w->bits = 0;
+}
+
+// reads n (<= 32) bits; past the end reads zeros
+uint64_t br_get(bitreader_t *r, int n) {
+  while (r->bits < n) {
+    r->acc |= (uint64_t)(r->p < r->end ? *r->p++ : 0) << r->bits;
+    r->bits += 8;
+  }
+  uint64_t v = r->acc & ((1ULL << n) - 1);
+  r->acc >>= n;
+  r->bits -= n;
+  return v;
+}
+
+void br_align(bitreader_t *r) {
+  r->acc = 0;
+  r->bits = 0;
+}
+
+// bit-packs values (width up to 64) in blocks of CSEG_BLOCK
+unsigned char *pack_column(unsigned char *out, const uint64_t *values, uint32_t n) {
+  bitwriter_t w = {out, 0, 0};
+  for (uint32_t b = 0; b < n; b += CSEG_BLOCK) {
+    uint32_t end = b + CSEG_BLOCK < n ? b + CSEG_BLOCK : n;
+    uint64_t all = 0;
+    for (uint32_t i = b; i < end; i++) {
+      all |= values[i];
+    }
+    int width = all ? 64 - __builtin_clzll(all) : 0;
+    *w.p++ = (unsigned char)width;
+    for (uint32_t i = b; i < end; i++) {
+      if (width > 32) {
+        bw_put(&w, values[i] & 0xFFFFFFFFULL, 32);
+        bw_put(&w, values[i] >> 32, width - 32);
+      } else {
+        bw_put(&w, values[i], width);
+      }
+    }
+    bw_flush(&w);
+  }
+  return w.p;
+}
+
+/*
+ * Unpacks N values written by pack_column, running BODY with each value
+ * v at index i, and advances IN past them (NULL on a corrupt block)
+ */
+#define UNPACK_COLUMN(IN, END, N, BODY)                                                                              \
+  do {                                                                                                               \
+    bitreader_t r_ = {(IN), (END), 0, 0};                                                                            \
+    for (uint32_t b_ = 0; b_ < (N) && r_.p; b_ += CSEG_BLOCK) {                                                      \
+      uint32_t e_ = b_ + CSEG_BLOCK < (N) ? b_ + CSEG_BLOCK : (N);                                                   \
+      int width_ = r_.p < r_.end ? *r_.p++ : 65;                                                                     \
+      if (width_ > 64) {                                                                                             \
+        r_.p = NULL;                                                                                                 \
+        break;                                                                                                       \
+      }                                                                                                              \
+      for (uint32_t i = b_; i < e_; i++) {                                                                           \
+        uint64_t v = width_ > 32 ? br_get(&r_, 32) | (br_get(&r_, width_ - 32) << 32) : br_get(&r_, width_);        \
+        BODY;                                                                                                        \
+      }                                                                                                              \
+      br_align(&r_);                                                                                                 \
+    }                                                                                                                \
+    (IN) = r_.p;                                                                                                     \
+  } while (0)
+
+/*
+ * Encodes count records into out (at least CSEG_MAXBYTES(count) bytes)
+ * returns the encoded size
+ */
+size_t cseg_encode(const record_t *recs, uint32_t count, uint32_t seq, unsigned char *out) {
+  cseg_header_t *hdr = (cseg_header_t *)out;
+  unsigned char *p = out + sizeof(cseg_header_t);
+  uint64_t *values = malloc((count ? count : 1) * sizeof(uint64_t));
+
+  memset(hdr, 0, sizeof(*hdr));
+  hdr->magic = CSEG_MAGIC;
+  hdr->version = CSEG_VERSION;
+  hdr->seq = seq;
+  hdr->count = count;
+  if (count) {
+    hdr->first_minute = recs[0].minute;
+    hdr->first[0] = recs[0].tmp;
+    hdr->first[1] = recs[0].prs;
+    hdr->first[2] = recs[0].hmd;
+  }
+
+  int64_t prev_delta = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    int64_t delta = i ? (int64_t)recs[i].minute - recs[i - 1].minute : 0;
+    values[i] = zigzag(delta - prev_delta);
+    prev_delta = delta;
+  }
+  p = pack_column(p, values, count);
+
+  for (int c = 0; c < 3; c++) {
+    for (uint32_t i = 0; i < count; i++) {
+      const unsigned char *cur = &recs[i].tmp;
+      const unsigned char *prev = &recs[i ? i - 1 : 0].tmp;
+      values[i] = zigzag((signed char)(cur[c] - prev[c]));
+    }
+    p = pack_column(p, values, count);
+  }
+
+  for (uint32_t i = 0; i < count;) {
+    uint32_t run = 1;
+    while (i + run < count && recs[i + run].rained == recs[i].rained) {
+      run++;
+    }
+    *p++ = recs[i].rained;
+    for (uint32_t v = run; ; v >>= 7) {
+      *p++ = (v > 0x7F ? 0x80 : 0) | (v & 0x7F);
+      if (v <= 0x7F) {
+        break;
+      }
+    }
+    i += run;
+  }
+  free(values);
+
+  hdr->body_bytes = p - (out + sizeof(cseg_header_t));
+  hdr->crc = crc16(out + sizeof(cseg_header_t), hdr->body_bytes);
+  return p - out;
+}
+
+/*
+ * Decodes an encoded segment into out (room for the header's count)
+ * returns the number of records, or -1 if the data is corrupt
+ */
+int64_t cseg_decode(const unsigned char *in, size_t len, record_t *out) {
+  const cseg_header_t *hdr = (const cseg_header_t *)in;
+  if (len < sizeof(*hdr) || hdr->magic != CSEG_MAGIC || hdr->version != CSEG_VERSION ||
+      len < sizeof(*hdr) + hdr->body_bytes || crc16(in + sizeof(*hdr), hdr->body_bytes) != hdr->crc) {
+    return -1;
+  }
+  const unsigned char *p = in + sizeof(*hdr);
+  const unsigned char *end = p + hdr->body_bytes;
+  uint32_t count = hdr->count;
+
+  uint32_t minute = hdr->first_minute;
+  int64_t delta = 0;
+  UNPACK_COLUMN(p, end, count, {
+    delta += unzigzag(v);
+    minute += (uint32_t)delta;
+    out[i].minute = minute;
+  });
+
+  for (int c = 0; c < 3 && p; c++) {
+    unsigned char value = hdr->first[c];
+    UNPACK_COLUMN(p, end, count, {
+      value += (unsigned char)unzigzag(v);
+      (&out[i].tmp)[c] = value;
+    });
+  }
+  if (p == NULL) {
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < count;) {
+    if (p >= end) {
+      return -1;
+    }
+    unsigned char rained = *p++;
+    uint32_t run = 0;
+    for (int shift = 0; p < end && shift < 35; shift += 7) {
+      run |= (uint32_t)(*p & 0x7F) << shift;
+      if (!(*p++ & 0x80)) {
+        break;
+      }
+    }
+    if (run == 0 || run > count - i) {
+      return -1;
+    }
+    for (uint32_t j = 0; j < run; j++) {
+      out[i++].rained = rained;
+    }
+  }
+  return count;
+}
+
+void cold_segment_name(const char *base, uint32_t seq, char *out, size_t len) {
+  snprintf(out, len, "%s.%06u.z", base, seq);
+}
+
+/*
+ * Compresses count records of the segment open on fd into its cold file
+ * written under a temporary name and renamed into place once synced
+ * returns the compressed size, or -1 on error
+ */
+int64_t compress_segment(const char *base, uint32_t seq, int fd, uint32_t count) {
+  char name[300], tmp[310];
+  size_t raw = count * sizeof(record_t);
+
+  record_t *recs = mmap(0, raw, PROT_READ, MAP_SHARED, fd, 0);
+  if (recs == MAP_FAILED) {
+    perror("Error mapping segment to compress");
+    return -1;
+  }
+  unsigned char *buf = malloc(CSEG_MAXBYTES(count));
+  if (buf == NULL) {
+    munmap(recs, raw);
+    return -1;
+  }
+  size_t len = cseg_encode(recs, count, seq, buf);
+  munmap(recs, raw);
+
+  cold_segment_name(base, seq, name, sizeof(name));
+  snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+  int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, (mode_t)0600);
+  if (out == -1 || write(out, buf, len) != (ssize_t)len || fdatasync(out) == -1 || rename(tmp, name) == -1) {
+    perror("Error writing compressed segment");
+    if (out != -1) {
+      close(out);
+      unlink(tmp);
+    }
+    free(buf);
+    return -1;
+  }
+  close(out);
+  free(buf);
+  return len;
+}
+
+/*
+ * Decodes the cold file of segment seq and calls fn on its records, in
+ * order, until fn returns nonzero.  Returns the number of records visited
+ * or -1 if the file is missing or corrupt.  raw_bytes and cold_bytes, if
+ * not NULL, are increased by the decoded and the on-disk size.
+ */
+int64_t scan_cold_segment(const char *base, uint32_t seq, int (*fn)(const record_t *, void *), void *arg,
+                          uint64_t *raw_bytes, uint64_t *cold_bytes) {
+  char name[300];
+  struct stat st;
+
+  cold_segment_name(base, seq, name, sizeof(name));
+  int fd = open(name, O_RDONLY);
+  if (fd == -1) {
+    return -1;
+  }
+  if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(cseg_header_t)) {
+    close(fd);
+    return -1;
+  }
+  unsigned char *in = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (in == MAP_FAILED) {
+    return -1;
+  }
+  uint32_t count = ((cseg_header_t *)in)->count;
+  record_t *recs = malloc((count ? count : 1) * sizeof(record_t));
+  int64_t n = recs ? cseg_decode(in, st.st_size, recs) : -1;
+  munmap(in, st.st_size);
+
+  int64_t visited = 0;
+  for (int64_t i = 0; i < n; i++) {
+    visited++;
+    if (fn(&recs[i], arg)) {
+      break;
+    }
+  }
+  free(recs);
+  if (n >= 0) {
+    if (raw_bytes) {
+      *raw_bytes += (uint64_t)n * sizeof(record_t);
+    }
+    if (cold_bytes) {
+      *cold_bytes += st.st_size;
+    }
+  }
+  return n < 0 ? -1 : visited;
+}
+
+/*
+ * Prints every compressed segment sealed so far the way 'record' prints
+ * records, followed by a one line summary
+ */
+int print_cold(record_store_t *rs, FILE *out) {
+  uint64_t raw = 0, cold = 0, records = 0;
+  uint32_t segments = 0;
+  uint32_t head_seg = __atomic_load_n(&rs->meta->head_seg, __ATOMIC_ACQUIRE);
+  for (uint32_t seq = 0; seq < head_seg; seq++) {
+    int64_t n = scan_cold_segment(rs->fname, seq, format_record, out, &raw, &cold);
+    if (n >= 0) {
+      records += n;
+      segments++;
+    }
+  }
+  fprintf(out, "%llu records in %u compressed segments, %llu bytes (%llu packed, %llu as text)\n",
+          (unsigned long long)records, segments, (unsigned long long)cold, (unsigned long long)raw,
+          (unsigned long long)records * RECORD_TEXTLEN);
+  return 0;
+}
+
+/*
+ * Background thread compressing sealed segments, fed by the record
+ * store's on_seal hook with a dup of the segment's descriptor, so the
+ * segment can be dropped from the ring before its turn comes
+ */
+#define COMPRESS_QUEUE 16
+
+typedef struct {
+  int fd;
+  uint32_t seq;
+  uint32_t count;
+} sealed_segment_t;
+
+typedef struct {
+  char base[256];
+  // the store, for the catch-up pass at start
+  record_store_t *rs;
+  // cold files to keep, 0 for all of them
+  uint32_t keep;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  sealed_segment_t queue[COMPRESS_QUEUE];
+  uint32_t head, tail;
+  int running;
+  int stop;
+} compressor_t;
+
+/*
+ * Deletes the cold files of the segments before seq (retention), found
+ * by listing the directory so that gaps do not stop it
+ */
+void prune_cold(const char *base, uint32_t below) {
+  char dir[256], prefix[256];
+  const char *slash = strrchr(base, '/');
+  if (slash) {
+    snprintf(dir, sizeof(dir), "%.*s", (int)(slash - base), base);
+  } else {
+    snprintf(dir, sizeof(dir), ".");
+  }
+  snprintf(prefix, sizeof(prefix), "%s.", slash ? slash + 1 : base);
+  size_t plen = strlen(prefix);
+
+  DIR *d = opendir(dir);
+  if (d == NULL) {
+    return;
+  }
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    uint32_t seq;
+    int n = 0;
+    if (strncmp(e->d_name, prefix, plen) == 0 && sscanf(e->d_name + plen, "%6u.z%n", &seq, &n) == 1 &&
+        e->d_name[plen + n] == '\0' && n == 8 && seq < below) {
+      char name[600];
+      snprintf(name, sizeof(name), "%s/%s", dir, e->d_name);
+      unlink(name);
+    }
+  }
+  closedir(d);
+}
+
+/*
+ * Compresses the sealed segments of the ring that have no cold file yet,
+ * then applies the retention to what is already there
+ */
+void compressor_catch_up(compressor_t *c) {
+  uint32_t first, head, count;
+  char name[300];
+  record_bounds(c->rs, &first, &head, &count);
+  for (uint32_t seq = first; seq < head; seq++) {
+    cold_segment_name(c->base, seq, name, sizeof(name));
+    if (access(name, F_OK) == 0) {
+      continue;
+    }
+    segment_name(c->rs, seq, name, sizeof(name));
+    int fd = open(name, O_RDONLY);
+    // gone if the ring dropped it meanwhile
+    if (fd != -1) {
+      compress_segment(c->base, seq, fd, c->rs->seg_records);
+      close(fd);
+    }
+  }
+  if (c->keep && head > c->keep) {
+    prune_cold(c->base, head - c->keep);
+  }
+}
+
+void *compressor_main(void *arg) {
+  compressor_t *c = arg;
+  char name[300];
+  compressor_catch_up(c);
+  pthread_mutex_lock(&c->lock);
+  while (1) {
+    while (c->head == c->tail && !c->stop) {
+      pthread_cond_wait(&c->cond, &c->lock);
+    }
+    if (c->head == c->tail) {
+      break;
+    }
+    sealed_segment_t s = c->queue[c->head++ % COMPRESS_QUEUE];
+    pthread_mutex_unlock(&c->lock);
+    compress_segment(c->base, s.seq, s.fd, s.count);
+    close(s.fd);
+    if (c->keep && s.seq >= c->keep) {
+      cold_segment_name(c->base, s.seq - c->keep, name, sizeof(name));
+      unlink(name);
+    }
+    pthread_mutex_lock(&c->lock);
+  }
+  pthread_mutex_unlock(&c->lock);
+  return NULL;
+}
+
+// on_seal hook of the record store
+void compressor_seal(void *arg, uint32_t seq, int fd, uint32_t count) {
+  compressor_t *c = arg;
+  int dupfd = dup(fd);
+  if (dupfd == -1) {
+    return;
+  }
+  pthread_mutex_lock(&c->lock);
+  if (c->tail - c->head < COMPRESS_QUEUE) {
+    c->queue[c->tail++ % COMPRESS_QUEUE] = (sealed_segment_t){dupfd, seq, count};
+    pthread_cond_signal(&c->cond);
+  } else {
+    fprintf(stderr, "Compression is falling behind, segment %u stays uncompressed\n", seq);
+    close(dupfd);
+  }
+  pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * Starts compressing the segments rs seals from now on, and those it
+ * sealed before without compressing them
+ * returns 0 on success
+ */
+int compressor_start(compressor_t *c, record_store_t *rs) {
+  memset(c, 0, sizeof(*c));
+  snprintf(c->base, sizeof(c->base), "%s", rs->fname);
+  c->rs = rs;
+  c->keep = rs->cold_segments;
+  pthread_mutex_init(&c->lock, NULL);
+  pthread_cond_init(&c->cond, NULL);
+  if (pthread_create(&c->thread, NULL, compressor_main, c)) {
+    fprintf(stderr, "Error starting the compressor thread\n");
+    return -1;
+  }
+  c->running = 1;
+  rs->on_seal = compressor_seal;
+  rs->seal_arg = c;
+  return 0;
+}
+
+// finishes the queued segments and stops the thread
+void compressor_stop(compressor_t *c, record_store_t *rs) {
+  if (!c->running) {
+    return;
+  }
+  rs->on_seal = NULL;
+  pthread_mutex_lock(&c->lock);
+  c->stop = 1;
+  pthread_cond_signal(&c->cond);
+  pthread_mutex_unlock(&c->lock);
+  pthread_join(c->thread, NULL);
+  c->running = 0;
+}
+
+#endif
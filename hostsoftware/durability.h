@@ -0,0 +1,508 @@
+#ifndef durability_h_
+#define durability_h_
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "protocol.h"
+
+/*
+ * How hard the archive tries to survive a power cut.  The hist, quantile
+ * and record files are MAP_SHARED, so a crash of the process loses
+ * nothing, but without a flush the kernel decides when pages reach disk.
+ *
+ * DURABILITY_NONE   never flush, leave it to writeback
+ * DURABILITY_GROUP  every every_n readings or every_ms milliseconds hand
+ *                   the archive's files to a syncer thread that
+ *                   fdatasyncs them, so at most one group is lost
+ * DURABILITY_WAL    append each reading to a small write-ahead log before
+ *                   it is applied; groups only fdatasync the log, the
+ *                   files themselves are synced at checkpoints, and the
+ *                   log is replayed on startup
+ *
+ * The ingest thread only counts readings, dups file descriptors and
+ * appends to the log; every fdatasync happens on the syncer thread.
+ * Log entries are batched in memory and written with one write(2) per
+ * wal_flush, before any commit and whenever the batch is full.  The
+ * readings of a batch are held back until it is written (archive_flush
+ * in archive.h, once per wakeup of the data loop), so the log is still
+ * ahead of every file; a reading still in the batch is lost with the
+ * process, but then it reached no file either.
+ */
+enum durability_mode { DURABILITY_NONE, DURABILITY_GROUP, DURABILITY_WAL };
+
+#define DURABILITY_MAXFDS 64
+// log entries between checkpoints (data files synced, log rotated)
+#define WAL_CHECKPOINT 4096
+#define WAL_MAXCOUNTERS 16
+// version 1 logs had room for this many counters
+#define WAL_V1_COUNTERS 8
+#define WAL_MAXENTRY 64
+// bytes of log entries written together
+#define WAL_BATCH 4096
+#define WAL_MAGIC 0x314c4157 // "WAL1"
+#define WAL_VERSION 2
+
+/*
+ * Every log file starts with this header.  base holds, for each file a
+ * reading lands in, how many readings that file had applied when the log
+ * was started; entry k of the log is reading number base[i] + k of file i,
+ * so replay can skip whatever already reached each file.
+ * The log alternates between two files, name.0 and name.1, by generation.
+ * Version 1 headers are the same with WAL_V1_COUNTERS bases.
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t entry_size;
+  uint32_t ncounters;
+  uint64_t generation;
+  uint64_t base[WAL_MAXCOUNTERS];
+} wal_header_t;
+
+// work handed to the syncer thread
+typedef struct {
+  int fds[DURABILITY_MAXFDS];
+  int nfds;
+  // log file to delete once fds are synced (a finished checkpoint)
+  char unlink_name[300];
+} sync_job_t;
+
+typedef struct {
+  enum durability_mode mode;
+  uint32_t every_n;
+  uint32_t every_ms;
+  uint32_t pending;
+  long last_commit_ms;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int running;
+  int stop;
+  int has_job;
+  sync_job_t job;
+  int checkpointing;
+  uint64_t commits;
+  // fdatasync calls made, on the syncer or the ingest thread
+  uint64_t syncs;
+  uint64_t sync_errors;
+
+  char wal_name[256];
+  int wal_fd;
+  uint32_t entry_size;
+  uint64_t generation;
+  uint32_t wal_entries;
+  unsigned char wal_batch[WAL_BATCH];
+  uint32_t wal_batched;
+} durability_t;
+
+// called by wal_replay for every intact entry; pos[i] = base[i] + k
+typedef void (*wal_apply_fn)(const void *entry, const uint64_t *pos, int ncounters, void *arg);
+
+long durability_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+const char *durability_name(enum durability_mode mode) {
+  switch (mode) {
+  case DURABILITY_GROUP:
+    return "group";
+  case DURABILITY_WAL:
+    return "wal";
+  default:
+    return "none";
+  }
+}
+
+// parses none/group/wal, returns -1 for anything else
+int durability_parse(const char *s) {
+  if (strcmp(s, "none") == 0) {
+    return DURABILITY_NONE;
+  }
+  if (strcmp(s, "group") == 0) {
+    return DURABILITY_GROUP;
+  }
+  if (strcmp(s, "wal") == 0) {
+    return DURABILITY_WAL;
+  }
+  return -1;
+}
+
+void wal_file_name(const durability_t *d, uint64_t generation, char *out, size_t len) {
+  snprintf(out, len, "%s.%u", d->wal_name, (unsigned)(generation % 2));
+}
+
+void sync_job_release(sync_job_t *job) {
+  for (int i = 0; i < job->nfds; i++) {
+    close(job->fds[i]);
+  }
+  job->nfds = 0;
+  job->unlink_name[0] = '\0';
+}
+
+// fdatasync that counts towards d->syncs
+int durability_sync(durability_t *d, int fd) {
+  __atomic_add_fetch(&d->syncs, 1, __ATOMIC_RELAXED);
+  return fdatasync(fd);
+}
+
+void *durability_syncer(void *arg) {
+  durability_t *d = arg;
+  sync_job_t job;
+
+  pthread_mutex_lock(&d->lock);
+  while (1) {
+    while (!d->has_job && !d->stop) {
+      pthread_cond_wait(&d->cond, &d->lock);
+    }
+    if (!d->has_job) {
+      break;
+    }
+    job = d->job;
+    d->job.nfds = 0;
+    d->job.unlink_name[0] = '\0';
+    d->has_job = 0;
+    pthread_mutex_unlock(&d->lock);
+
+    int errors = 0;
+    for (int i = 0; i < job.nfds; i++) {
+      if (durability_sync(d, job.fds[i]) == -1 && errno != EINVAL) {
+        errors++;
+      }
+    }
+    // the checkpoint is only done once everything it covers is on disk
+    int checkpoint = job.unlink_name[0] != '\0';
+    if (checkpoint && errors == 0) {
+      unlink(job.unlink_name);
+    }
+    sync_job_release(&job);
+
+    pthread_mutex_lock(&d->lock);
+    if (checkpoint || errors) {
+      d->checkpointing = 0;
+    }
+    d->commits++;
+    d->sync_errors += errors;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return NULL;
+}
+
+/*
+ * Sets up d for mode; wal_name and entry_size are only used by DURABILITY_WAL.
+ * The log is not opened until wal_begin, so it can be replayed first.
+ */
+void durability_init(durability_t *d, enum durability_mode mode, uint32_t every_n, uint32_t every_ms,
+                     const char *wal_name, uint32_t entry_size) {
+  memset(d, 0, sizeof(*d));
+  d->mode = mode;
+  d->every_n = every_n ? every_n : 1;
+  d->every_ms = every_ms;
+  d->wal_fd = -1;
+  d->entry_size = entry_size;
+  snprintf(d->wal_name, sizeof(d->wal_name), "%s", wal_name);
+  d->last_commit_ms = durability_now_ms();
+  pthread_mutex_init(&d->lock, NULL);
+  pthread_cond_init(&d->cond, NULL);
+}
+
+/*
+ * Starts the syncer thread; call it in the process that ingests, after
+ * any fork.  Returns 0 on success.
+ */
+int durability_start(durability_t *d) {
+  if (d->mode == DURABILITY_NONE) {
+    return 0;
+  }
+  if (pthread_create(&d->thread, NULL, durability_syncer, d)) {
+    fprintf(stderr, "Error starting the syncer thread\n");
+    return -1;
+  }
+  d->running = 1;
+  return 0;
+}
+
+/*
+ * Reads one log file, calling fn on its intact entries in order
+ * returns the generation of the file, or -1 if it is missing or not a log
+ */
+int64_t wal_replay_file(durability_t *d, const char *name, wal_apply_fn fn, void *arg, int dry) {
+  wal_header_t hdr;
+  unsigned char entry[WAL_MAXENTRY + 2];
+  uint64_t pos[WAL_MAXCOUNTERS];
+
+  int fd = open(name, O_RDONLY);
+  if (fd == -1) {
+    return -1;
+  }
+  memset(&hdr, 0, sizeof(hdr));
+  size_t v1_size = offsetof(wal_header_t, base) + WAL_V1_COUNTERS * sizeof(uint64_t);
+  if (read(fd, &hdr, v1_size) != (ssize_t)v1_size || hdr.magic != WAL_MAGIC ||
+      (hdr.version != WAL_VERSION && hdr.version != 1) || hdr.entry_size != d->entry_size ||
+      hdr.ncounters > (hdr.version == 1 ? WAL_V1_COUNTERS : WAL_MAXCOUNTERS) ||
+      (hdr.version == WAL_VERSION &&
+       read(fd, (char *)&hdr + v1_size, sizeof(hdr) - v1_size) != (ssize_t)(sizeof(hdr) - v1_size))) {
+    close(fd);
+    return -1;
+  }
+  if (!dry) {
+    memcpy(pos, hdr.base, sizeof(pos));
+    // a torn or partial last entry ends the log
+    while (read(fd, entry, d->entry_size + 2) == (ssize_t)(d->entry_size + 2)) {
+      uint16_t crc = (entry[d->entry_size] << 8) | entry[d->entry_size + 1];
+      if (crc16(entry, d->entry_size) != crc) {
+        break;
+      }
+      fn(entry, pos, hdr.ncounters, arg);
+      for (uint32_t i = 0; i < hdr.ncounters; i++) {
+        pos[i]++;
+      }
+    }
+  }
+  close(fd);
+  return (int64_t)hdr.generation;
+}
+
+/*
+ * Replays whatever log files survived, oldest generation first.
+ * Replay is idempotent as long as fn skips entries whose pos a file
+ * already reached.  Returns the newest generation seen, or -1 if none.
+ */
+int64_t wal_replay(durability_t *d, wal_apply_fn fn, void *arg) {
+  char names[2][300];
+  int64_t gens[2];
+
+  for (int i = 0; i < 2; i++) {
+    wal_file_name(d, i, names[i], sizeof(names[i]));
+    gens[i] = wal_replay_file(d, names[i], fn, arg, 1);
+  }
+  int first = (gens[0] != -1 && (gens[1] == -1 || gens[0] < gens[1])) ? 0 : 1;
+  for (int i = first, n = 0; n < 2; i = 1 - i, n++) {
+    if (gens[i] != -1) {
+      wal_replay_file(d, names[i], fn, arg, 0);
+    }
+  }
+  d->generation = (uint64_t)(gens[0] > gens[1] ? gens[0] : gens[1]) + 1;
+  return gens[0] > gens[1] ? gens[0] : gens[1];
+}
+
+/*
+ * Starts the next log generation with the given base counters.
+ * The previous log is left for the syncer to delete once the data files
+ * it covers are synced.  Returns the previous log's descriptor (or -1),
+ * which the caller hands to the syncer; -2 on error.
+ */
+int wal_begin(durability_t *d, const uint64_t *base, uint32_t ncounters) {
+  wal_header_t hdr;
+  char name[300];
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = WAL_MAGIC;
+  hdr.version = WAL_VERSION;
+  hdr.entry_size = d->entry_size;
+  hdr.ncounters = ncounters;
+  hdr.generation = d->generation;
+  memcpy(hdr.base, base, ncounters * sizeof(uint64_t));
+
+  wal_file_name(d, d->generation, name, sizeof(name));
+  int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, (mode_t)0600);
+  if (fd == -1 || write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+    perror("Error starting write-ahead log");
+    if (fd != -1) {
+      close(fd);
+    }
+    return -2;
+  }
+  int old = d->wal_fd;
+  d->wal_fd = fd;
+  d->wal_entries = 0;
+  d->generation++;
+  return old;
+}
+
+/*
+ * Opens the log after wal_replay: syncs the replayed files, starts a
+ * new generation based on their counters and drops the old logs.
+ * Returns 0 on success.
+ */
+int wal_open(durability_t *d, const int *fds, int nfds, const uint64_t *base, uint32_t ncounters) {
+  char old_name[300];
+
+  for (int i = 0; i < nfds; i++) {
+    durability_sync(d, fds[i]);
+  }
+  wal_file_name(d, d->generation + 1, old_name, sizeof(old_name));
+  if (wal_begin(d, base, ncounters) == -2 || durability_sync(d, d->wal_fd) == -1) {
+    return -1;
+  }
+  unlink(old_name);
+  return 0;
+}
+
+/*
+ * Writes the batched log entries out
+ * returns 0 on success
+ */
+int wal_flush(durability_t *d) {
+  uint32_t n = d->wal_batched;
+  if (n == 0) {
+    return 0;
+  }
+  d->wal_batched = 0;
+  if (write(d->wal_fd, d->wal_batch, n) != (ssize_t)n) {
+    perror("Error appending to write-ahead log");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Appends one entry (entry_size bytes) to the log batch; the entry is
+ * only in the log once wal_flush wrote it, apply it to the mapped files
+ * after that.  Returns 0 on success.
+ */
+int wal_append(durability_t *d, const void *entry) {
+  if (d->mode != DURABILITY_WAL) {
+    return 0;
+  }
+  if (d->wal_batched + d->entry_size + 2 > WAL_BATCH && wal_flush(d)) {
+    return -1;
+  }
+  unsigned char *buf = d->wal_batch + d->wal_batched;
+  memcpy(buf, entry, d->entry_size);
+  uint16_t crc = crc16(buf, d->entry_size);
+  buf[d->entry_size] = crc >> 8;
+  buf[d->entry_size + 1] = crc & 0xFF;
+  d->wal_batched += d->entry_size + 2;
+  d->wal_entries++;
+  return 0;
+}
+
+/*
+ * Counts readings applied since the last commit and says whether a
+ * commit is due, by count or by age; readings 0 just checks the age.
+ */
+int durability_due(durability_t *d, uint32_t readings) {
+  if (d->mode == DURABILITY_NONE) {
+    return 0;
+  }
+  d->pending += readings;
+  if (d->pending == 0) {
+    return 0;
+  }
+  return d->pending >= d->every_n || (d->every_ms && durability_now_ms() - d->last_commit_ms >= d->every_ms);
+}
+
+// queues dups of fds for the syncer, merged with a job it has not picked up yet
+void durability_queue(durability_t *d, const int *fds, int nfds, const char *unlink_name) {
+  pthread_mutex_lock(&d->lock);
+  for (int i = 0; i < nfds && d->job.nfds < DURABILITY_MAXFDS; i++) {
+    int fd = dup(fds[i]);
+    if (fd != -1) {
+      d->job.fds[d->job.nfds++] = fd;
+    }
+  }
+  if (unlink_name) {
+    snprintf(d->job.unlink_name, sizeof(d->job.unlink_name), "%s", unlink_name);
+  }
+  d->has_job = 1;
+  pthread_cond_signal(&d->cond);
+  pthread_mutex_unlock(&d->lock);
+}
+
+/*
+ * Commits a group.  fds are the archive's data files; base the counters
+ * of each file, used when the commit turns into a WAL checkpoint.
+ */
+void durability_commit(durability_t *d, const int *fds, int nfds, const uint64_t *base, uint32_t ncounters) {
+  if (d->mode == DURABILITY_NONE) {
+    return;
+  }
+  wal_flush(d);
+  d->pending = 0;
+  d->last_commit_ms = durability_now_ms();
+  if (!d->running) {
+    // no syncer (e.g. during startup), flush in place
+    for (int i = 0; i < nfds; i++) {
+      durability_sync(d, fds[i]);
+    }
+    if (d->wal_fd != -1) {
+      durability_sync(d, d->wal_fd);
+    }
+    return;
+  }
+
+  if (d->mode == DURABILITY_GROUP) {
+    durability_queue(d, fds, nfds, NULL);
+    return;
+  }
+
+  pthread_mutex_lock(&d->lock);
+  int checkpointing = d->checkpointing;
+  pthread_mutex_unlock(&d->lock);
+
+  if (d->wal_entries < WAL_CHECKPOINT || checkpointing) {
+    durability_queue(d, &d->wal_fd, 1, NULL);
+    return;
+  }
+
+  /*
+   * Checkpoint: switch to a new log whose base is the files' current
+   * counters, then let the syncer flush the files and the new header,
+   * and only then delete the old log, which the files now cover
+   */
+  char old_name[300];
+  int batch[DURABILITY_MAXFDS];
+  wal_file_name(d, d->generation - 1, old_name, sizeof(old_name));
+  int old = wal_begin(d, base, ncounters);
+  if (old == -2) {
+    durability_queue(d, &d->wal_fd, 1, NULL);
+    return;
+  }
+  if (old >= 0) {
+    close(old);
+  }
+  int n = nfds < DURABILITY_MAXFDS - 1 ? nfds : DURABILITY_MAXFDS - 1;
+  memcpy(batch, fds, n * sizeof(int));
+  batch[n++] = d->wal_fd;
+  pthread_mutex_lock(&d->lock);
+  d->checkpointing = 1;
+  pthread_mutex_unlock(&d->lock);
+  durability_queue(d, batch, n, old_name);
+}
+
+/*
+ * Flushes what is still pending and stops the syncer thread
+ */
+void durability_stop(durability_t *d, const int *fds, int nfds) {
+  if (d->wal_fd != -1) {
+    wal_flush(d);
+  }
+  if (d->running) {
+    durability_queue(d, fds, nfds, NULL);
+    if (d->wal_fd != -1) {
+      durability_queue(d, &d->wal_fd, 1, NULL);
+    }
+    pthread_mutex_lock(&d->lock);
+    d->stop = 1;
+    pthread_cond_signal(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+    pthread_join(d->thread, NULL);
+    d->running = 0;
+  }
+  if (d->wal_fd != -1) {
+    close(d->wal_fd);
+    d->wal_fd = -1;
+  }
+}
+
+#endif
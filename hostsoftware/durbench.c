@@ -0,0 +1,163 @@
+#define _GNU_SOURCE
+
+#include "archive.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Ingest throughput of the archive under each durability mode.
+ * Every run gets a fresh archive in its own temporary directory and
+ * feeds it synthetic readings through ingest_reading, the same path
+ * host uses; the time includes the final flush in deconstruct_archive.
+ * The last run repeats the first with the stage metrics turned on, to
+ * show what the instrumentation costs.
+ * Before timing anything it checks that the write-ahead log still puts
+ * every reading at its position after checkpoints taken mid batch
+ * (check_wal), and fails if it does not.
+ *
+ * usage: durbench [READINGS [GROUP]]
+ */
+
+double seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// inline skips the syncer thread, so every commit flushes on the ingest path
+int run(enum durability_mode mode, uint32_t every_n, long readings, int inline_sync) {
+  char dir[] = "/tmp/durbenchXXXXXX";
+  char cwd[4096];
+  archive_t archive;
+  record_t reading;
+  record_capacity_t capacity = RECORD_CAPACITY_DEFAULT;
+
+  if (mkdtemp(dir) == NULL || getcwd(cwd, sizeof(cwd)) == NULL || chdir(dir) == -1) {
+    perror("Error setting up scratch directory");
+    return -1;
+  }
+  if (construct_archive(&archive, NULL, mode, every_n, 1000, &capacity) ||
+      (!inline_sync && durability_start(&archive.durability))) {
+    return -1;
+  }
+
+  srand(1);
+  reading.minute = parse_stamp("202001010000");
+  double t0 = seconds();
+  for (long i = 0; i < readings; i++) {
+    reading.tmp = rand() & 0xFF;
+    reading.prs = rand() & 0xFF;
+    reading.hmd = rand() & 0xFF;
+    reading.rained = 1 + (rand() & 1);
+    reading.minute += 60;
+    ingest_reading(&archive, &reading);
+  }
+  deconstruct_archive(&archive);
+  double t = seconds() - t0;
+  // read after the syncer was joined, so every fdatasync it made is counted
+  uint64_t syncs = archive.durability.syncs;
+
+  printf("%-6s %-7s %8u %12.0f %10llu%s\n", durability_name(mode), inline_sync ? "inline" : "thread", every_n,
+         readings / t, (unsigned long long)syncs, metrics ? "  (metrics on)" : "");
+
+  if (chdir(cwd) == -1) {
+    perror("Error leaving scratch directory");
+  }
+  char cmd[128];
+  snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+  return system(cmd);
+}
+
+// what check_wal's replay saw
+typedef struct {
+  uint32_t first_minute;
+  uint64_t entries;
+  uint64_t misplaced;
+} wal_check_t;
+
+// reading k (minute first_minute + 60 k) belongs at position k of every file
+void check_entry(const void *entry, const uint64_t *pos, int ncounters, void *arg) {
+  wal_check_t *c = arg;
+  record_t reading;
+  memcpy(&reading, entry, sizeof(reading));
+  uint64_t k = (reading.minute - c->first_minute) / 60;
+  c->entries++;
+  for (int i = 0; i < ncounters; i++) {
+    if (pos[i] != k) {
+      c->misplaced++;
+      break;
+    }
+  }
+}
+
+/*
+ * Ingests a few checkpoints' worth of readings in full log batches, with
+ * a commit due several times per batch, then replays the logs left on
+ * disk (what a power cut would leave) and checks every entry's position.
+ * returns 0 if all of them are where they belong
+ */
+int check_wal(void) {
+  char dir[] = "/tmp/durbenchXXXXXX";
+  char cwd[4096];
+  archive_t archive;
+  durability_t replay;
+  record_t reading = {0, 0, 0, 0, 1};
+  record_capacity_t capacity = RECORD_CAPACITY_DEFAULT;
+  wal_check_t check = {parse_stamp("202001010000"), 0, 0};
+
+  if (mkdtemp(dir) == NULL || getcwd(cwd, sizeof(cwd)) == NULL || chdir(dir) == -1) {
+    perror("Error setting up scratch directory");
+    return -1;
+  }
+  if (construct_archive(&archive, NULL, DURABILITY_WAL, ARCHIVE_PENDING / 4, 0, &capacity) ||
+      durability_start(&archive.durability)) {
+    return -1;
+  }
+  long readings = 3 * WAL_CHECKPOINT + ARCHIVE_PENDING / 2;
+  for (long i = 0; i < readings; i++) {
+    reading.minute = check.first_minute + 60 * i;
+    ingest_reading(&archive, &reading);
+  }
+  archive_flush(&archive);
+
+  durability_init(&replay, DURABILITY_WAL, 1, 0, ARCHIVE_WAL, sizeof(record_t));
+  wal_replay(&replay, check_entry, &check);
+  deconstruct_archive(&archive);
+
+  int ok = check.entries > 0 && check.misplaced == 0;
+  printf("wal replay after mid batch checkpoints: %llu entries, %llu misplaced, %s\n",
+         (unsigned long long)check.entries, (unsigned long long)check.misplaced, ok ? "ok" : "FAILED");
+  if (chdir(cwd) == -1) {
+    perror("Error leaving scratch directory");
+  }
+  char cmd[128];
+  snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+  if (system(cmd)) {
+    // a leftover scratch directory is harmless
+  }
+  return ok ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+  long readings = (argc > 1) ? atol(argv[1]) : 20000;
+  uint32_t group = (argc > 2) ? atoi(argv[2]) : 64;
+
+  if (check_wal()) {
+    return 1;
+  }
+  printf("%ld readings per run\n", readings);
+  printf("%-6s %-7s %8s %12s %10s\n", "mode", "syncer", "group", "readings/s", "syncs");
+  run(DURABILITY_NONE, group, readings, 0);
+  run(DURABILITY_GROUP, group, readings, 0);
+  run(DURABILITY_WAL, group, readings, 0);
+  // what flushing on the ingest path would cost, per group and per reading
+  run(DURABILITY_GROUP, group, readings, 1);
+  run(DURABILITY_GROUP, 1, readings / 10, 1);
+  if (construct_metrics() == 0) {
+    run(DURABILITY_NONE, group, readings, 0);
+  }
+  return 0;
+}
@@ -1,103 +1,333 @@
 #ifndef hist_h_
 #define hist_h_
 #include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "seqlock.h"
 
 // These defines set the sizes of the histograms!!!
 #define NBUCKETS (256 / 16)
-#define FILESIZE (24 * NBUCKETS)
+#define BUCKET_SHIFT 4
+#define ROW_MINUTES 60
+// rows per day, ROW_MINUTES each (a divisor of 24 * 60)
+#define NROWS (24 * 60 / ROW_MINUTES)
+
+// width of every counter in the hist files: 16, 32 or 64
+#ifndef HIST_COUNTER_BITS
+#define HIST_COUNTER_BITS 32
+#endif
+
+/*
+ * Hist files used to be NROWS * NBUCKETS raw one byte counters (plus the
+ * byte written to extend the file).  They now start with this header so
+ * the geometry and counter width can be checked when the file is mapped.
+ */
+#define HIST_MAGIC 0x54534948 // "HIST"
+#define HIST_VERSION 1
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint16_t counter_bytes;
+  uint16_t bucket_shift;
+  uint16_t nbuckets;
+  uint16_t nrows;
+  uint32_t row_minutes;
+  // seqlock over the counters and observations (seqlock.h), even at rest
+  uint32_t seq;
+  uint64_t observations;
+} hist_header_t;
+
+/*
+ * HIST_SPECIALIZE generates the counting code for one histogram shape:
+ *   NAME          prefix of the generated functions
+ *   CTYPE         counter type
+ *   SHIFT         log2 of the bucket width, so value >> SHIFT is the bucket
+ *   NBUCKETS_     buckets per row
+ *   NROWS_        rows (time slots) per day
+ *   ROW_MINUTES_  minutes covered by a row
+ * Everything but the counters is a compile time constant, so the index
+ * math folds into shifts and adds.
+ */
+#define HIST_SPECIALIZE(NAME, CTYPE, SHIFT, NBUCKETS_, NROWS_, ROW_MINUTES_)      \
+  typedef CTYPE NAME##_count_t;                                                   \
+  enum {                                                                          \
+    NAME##_counter_bytes = sizeof(CTYPE),                                         \
+    NAME##_shift = (SHIFT),                                                       \
+    NAME##_nbuckets = (NBUCKETS_),                                                \
+    NAME##_nrows = (NROWS_),                                                      \
+    NAME##_row_minutes = (ROW_MINUTES_),                                          \
+    NAME##_ncounts = (NBUCKETS_) * (NROWS_)                                       \
+  };                                                                              \
+  /* the row of a reading taken at minute, a minute epoch (timecodec.h) */        \
+  int NAME##_row(uint32_t minute) {                                               \
+    return minute % (24 * 60) / (ROW_MINUTES_);                                   \
+  }                                                                               \
+  void NAME##_update(CTYPE *counts, unsigned char value, int row) {               \
+    counts[(unsigned)row * (NBUCKETS_) + ((unsigned)value >> (SHIFT))] += 1;      \
+  }                                                                               \
+  uint64_t NAME##_get(const CTYPE *counts, int row, int bucket) {                 \
+    return counts[(unsigned)row * (NBUCKETS_) + (unsigned)bucket];                \
+  }                                                                               \
+  void NAME##_set(CTYPE *counts, int row, int bucket, uint64_t count) {           \
+    counts[(unsigned)row * (NBUCKETS_) + (unsigned)bucket] = (CTYPE)count;        \
+  }
+
+HIST_SPECIALIZE(hist16, uint16_t, BUCKET_SHIFT, NBUCKETS, NROWS, ROW_MINUTES)
+HIST_SPECIALIZE(hist32, uint32_t, BUCKET_SHIFT, NBUCKETS, NROWS, ROW_MINUTES)
+HIST_SPECIALIZE(hist64, uint64_t, BUCKET_SHIFT, NBUCKETS, NROWS, ROW_MINUTES)
+
+// picks the specialization matching HIST_COUNTER_BITS
+#define HIST_CAT_(a, b) a##b
+#define HIST_CAT(a, b) HIST_CAT_(a, b)
+#define HIST_IMPL(suffix) HIST_CAT(HIST_CAT(hist, HIST_COUNTER_BITS), suffix)
+
+typedef HIST_IMPL(_count_t) hist_count_t;
+
+#define FILESIZE (sizeof(hist_header_t) + HIST_IMPL(_ncounts) * sizeof(hist_count_t))
+
+/*
+ * A mapped hist file: the header followed by NROWS rows of NBUCKETS counters
+ */
+typedef struct {
+  int fd;
+  hist_header_t *hdr;
+  hist_count_t *counts;
+} hist_t;
+
 char *mymap;
 
 
-int update_hist(char *hist, unsigned char value, int time) {
+int update_hist(hist_t *hist, unsigned char value, uint32_t minute) {
   /*
-   * the hist file is treated as a two dimension array of characters
-   * each of these characters represents how many observations of that bucket have been made
-   * the rows in this two dimensional array represent each hour 0-23, while each byte in the row
-   * represents the number of observations for that bucket.  There are 16 buckets, which store
+   * the counters are treated as a two dimension array
+   * each counter represents how many observations of that bucket have been made
+   * the rows in this two dimensional array represent each ROW_MINUTES of the day
+   * (each hour 0-23 by default) the reading's minute falls in, while each counter
+   * in the row represents the number of observations for that bucket.  There are 16 buckets, which store
    * observation for a range of size 16.  For instance, the 0th bucket stores observation 0-15
    */
+  seq_write_begin(&hist->hdr->seq);
+  HIST_IMPL(_update)(hist->counts, value, HIST_IMPL(_row)(minute));
+  hist->hdr->observations++;
+  seq_write_end(&hist->hdr->seq);
+
+  return 0;
+}
+
+/*
+ * Copies the counters (into NROWS * NBUCKETS counts) and the number of
+ * observations as of one instant, without ever holding up update_hist
+ */
+uint64_t snapshot_hist(const hist_t *hist, hist_count_t *counts) {
+  uint64_t observations;
+  uint32_t s;
+  do {
+    s = seq_read_begin(&hist->hdr->seq);
+    memcpy(counts, hist->counts, HIST_IMPL(_ncounts) * sizeof(hist_count_t));
+    observations = hist->hdr->observations;
+  } while (seq_read_retry(&hist->hdr->seq, s));
+  return observations;
+}
 
-    //increments histogram index by getting the bucket at which the temp/humidity/pressure vale will fall into and
-    //adds it to the time value since the histogram acts as one long array where values at the second hour can be
-    //displayed from hist[17]-->hist[32] and so on.
-    hist[(value/NBUCKETS) + (time * NBUCKETS)] += 1;
+// prints NROWS * NBUCKETS counts laid out like a hist file's
+int print_hist_counts(const hist_count_t *counts, FILE *out) {
+  fprintf(out, "Hour|   16   32   48   64   80   96  112  128  114  160  176  192  208  224  240  256\n");
+  fprintf(out, "-------------------------------------------------------------------------------------\n");
+  for (int t = 0; t < NROWS; t++) {
+    fprintf(out, "% 3d |", t);
+    for (int b = 0; b < NBUCKETS; b++) {
+      fprintf(out, "  %3llu", (unsigned long long)HIST_IMPL(_get)(counts, t, b));
+    }
+    fprintf(out, "\n");
+  }
+  fprintf(out, "    --------------------------------------------------------------------------------\n\n");
 
-    return 0;
+  return 0;
 }
 
 /*
  * Prints out the histogram. Nothing to do here (but study the code!)
  */
-int print_hist(char *hist) {
-  printf("Hour|   16   32   48   64   80   96  112  128  114  160  176  192  208  224  240  256\n");
-  printf("-------------------------------------------------------------------------------------\n");
-  for (int t = 0; t < 24; t++) {
-    printf("% 3d |", t);
-    for (int b = 0; b < NBUCKETS; b++) {
-      printf("  % 3d", (unsigned char)hist[t * NBUCKETS + b]);
+int print_hist(hist_t *hist, FILE *out) {
+  hist_count_t counts[HIST_IMPL(_ncounts)];
+  snapshot_hist(hist, counts);
+  return print_hist_counts(counts, out);
+}
+
+/*
+ * Reads counter i out of a counts array of the given width
+ */
+uint64_t hist_counter_at(const void *counts, int counter_bytes, size_t i) {
+  switch (counter_bytes) {
+  case 1:
+    return ((const uint8_t *)counts)[i];
+  case 2:
+    return ((const uint16_t *)counts)[i];
+  case 4:
+    return ((const uint32_t *)counts)[i];
+  default:
+    return ((const uint64_t *)counts)[i];
+  }
+}
+
+/*
+ * Reads the size bytes of a hist file in any format construct_hist
+ * accepts (the headerless one byte counters, or a header with any counter
+ * width) into NROWS * NBUCKETS counts, leaving the file as it is.
+ * Returns 0 on success.
+ */
+int read_hist_counts(int fd, off_t size, uint64_t *counts) {
+  char *raw = malloc(size + 1);
+  hist_header_t hdr;
+  int counter_bytes = 1;
+  const char *src = raw;
+
+  if (raw == NULL || pread(fd, raw, size, 0) != size) {
+    perror("Error reading hist file");
+    free(raw);
+    return -1;
+  }
+
+  memcpy(&hdr, raw, size >= (off_t)sizeof(hdr) ? sizeof(hdr) : 0);
+  if (size >= (off_t)sizeof(hdr) && hdr.magic == HIST_MAGIC) {
+    if (hdr.nbuckets != NBUCKETS || hdr.nrows != NROWS || hdr.bucket_shift != BUCKET_SHIFT) {
+      fprintf(stderr, "Hist file geometry %ux%u does not match %ux%u\n", hdr.nrows, hdr.nbuckets, NROWS,
+              NBUCKETS);
+      free(raw);
+      return -1;
     }
-    printf("\n");
+    counter_bytes = hdr.counter_bytes;
+    src = raw + sizeof(hdr);
+    size -= sizeof(hdr);
   }
-  printf("    --------------------------------------------------------------------------------\n\n");
 
+  size_t n = size / counter_bytes;
+  if (n > (size_t)HIST_IMPL(_ncounts)) {
+    n = HIST_IMPL(_ncounts);
+  }
+  memset(counts, 0, HIST_IMPL(_ncounts) * sizeof(uint64_t));
+  for (size_t i = 0; i < n; i++) {
+    counts[i] = hist_counter_at(src, counter_bytes, i);
+  }
+  free(raw);
+  return 0;
+}
+
+/*
+ * Rewrites an existing hist file of another format (the headerless one
+ * byte counters, or a header with a different counter width) into the
+ * current format, keeping its counts.  Returns 0 on success.
+ */
+int migrate_hist(int fd, off_t size) {
+  uint64_t *old = calloc(HIST_IMPL(_ncounts), sizeof(uint64_t));
+
+  if (old == NULL || read_hist_counts(fd, size, old)) {
+    free(old);
+    return -1;
+  }
+
+  // write the new layout out through a temporary mapping
+  if (ftruncate(fd, 0) == -1 || ftruncate(fd, FILESIZE) == -1) {
+    perror("Error resizing hist file");
+    free(old);
+    return -1;
+  }
+  char *map = mmap(0, FILESIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    perror("Error mapping hist file to migrate");
+    free(old);
+    return -1;
+  }
+  hist_header_t *nhdr = (hist_header_t *)map;
+  hist_count_t *counts = (hist_count_t *)(map + sizeof(hist_header_t));
+  memset(nhdr, 0, sizeof(*nhdr));
+  nhdr->magic = HIST_MAGIC;
+  nhdr->version = HIST_VERSION;
+  nhdr->counter_bytes = sizeof(hist_count_t);
+  nhdr->bucket_shift = BUCKET_SHIFT;
+  nhdr->nbuckets = NBUCKETS;
+  nhdr->nrows = NROWS;
+  nhdr->row_minutes = ROW_MINUTES;
+  for (size_t i = 0; i < (size_t)HIST_IMPL(_ncounts); i++) {
+    counts[i] = (hist_count_t)old[i];
+    nhdr->observations += old[i];
+  }
+  munmap(map, FILESIZE);
+  free(old);
   return 0;
 }
 
 /*
  * construct_hist is responsible for opening the file and mmaping the file
- * reports a file descriptor (fd) by filling a user provided pointer
- * reports the mapped region address (buffer) by filling another user provided pointer
+ * files in an older format are migrated to the current header first
+ * reports the mapped file through a user provided hist_t
  * return value is 0 on success
  */
-int construct_hist(char *hist_fname, int *fd, char **buffer) {
+int construct_hist(char *hist_fname, hist_t *hist) {
   /*
    * Open a file for reading and writing with permission granted to user and error checks
    */
-   *fd = open(hist_fname, O_RDWR | O_CREAT, (mode_t)0600); //allows you to get address from memory
-       if (*fd == -1) {
-           perror("Error opening mmapped file");
-           return -1;
-       }
+  hist->fd = open(hist_fname, O_RDWR | O_CREAT, (mode_t)0600); //allows you to get address from memory
+  if (hist->fd == -1) {
+    perror("Error opening mmapped file");
+    return -1;
+  }
 
   /*
-   * Seek to the end of the file and write a \0 to extend the file and error checks
+   * A new file gets a fresh header, a file without our exact header and
+   * size is converted in place
    */
-   if(lseek(*fd, FILESIZE, SEEK_SET) == -1) {
-        close(*fd);
-        perror("Error calling lseek()");
-        return -1;
-   }
-   if((write(*fd, "\0", 1)) == -1) {
-            perror("Error calling write");
-            close(*fd);
-            return -1;
-   }
+  struct stat st;
+  hist_header_t hdr;
+  if (fstat(hist->fd, &st) == -1) {
+    perror("Error calling fstat()");
+    close(hist->fd);
+    return -1;
+  }
+  int current = st.st_size == (off_t)FILESIZE && pread(hist->fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+                hdr.magic == HIST_MAGIC && hdr.version == HIST_VERSION &&
+                hdr.counter_bytes == sizeof(hist_count_t) && hdr.nbuckets == NBUCKETS && hdr.nrows == NROWS &&
+                hdr.bucket_shift == BUCKET_SHIFT;
+  if (!current && migrate_hist(hist->fd, st.st_size)) {
+    close(hist->fd);
+    return -1;
+  }
 
   /*
    * Map the proper region of the file into the user's address space and error checks
    */
-  *buffer = (char*)mmap(0, FILESIZE, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
-  if(*buffer == MAP_FAILED) {
-    close(*fd);
+  char *map = (char *)mmap(0, FILESIZE, PROT_READ | PROT_WRITE, MAP_SHARED, hist->fd, 0);
+  if (map == MAP_FAILED) {
+    close(hist->fd);
     perror("Error mapping the file");
     return -1;
   }
+  hist->hdr = (hist_header_t *)map;
+  hist->counts = (hist_count_t *)(map + sizeof(hist_header_t));
+  // a writer that died mid update left the sequence odd
+  hist->hdr->seq &= ~1u;
   return 0;
 }
 
-int deconstruct_hist(int hist_fd, char *hist) {
+int deconstruct_hist(hist_t *hist) {
 
   /*
    * Un-maps and closes
    */
-  if(munmap(hist, FILESIZE) == -1) {
-    close(hist_fd);
+  if (munmap(hist->hdr, FILESIZE) == -1) {
+    close(hist->fd);
     perror("Error un-mapping the file");
     return -1;
   }
 
-  close(hist_fd);
+  close(hist->fd);
   return 0;
 }
 #endif
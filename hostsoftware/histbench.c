@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+
+#include "histops.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * Microbenchmark for the histogram rollup kernels in histops.h.
+ * Builds NHISTS random histograms with the construct_hist layout, then
+ * times every kernel set available on this CPU over all of them and
+ * checks every kernel's results against the scalar loops (densities to
+ * within float rounding); exits non-zero on a mismatch.
+ *
+ * usage: histbench [NHISTS [ROUNDS]]
+ */
+
+// relative error the vector densities may have: they round differently
+#define DENSITY_TOLERANCE 1e-6
+
+double seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+  int nhists = (argc > 1) ? atoi(argv[1]) : 4096;
+  int rounds = (argc > 2) ? atoi(argv[2]) : 20;
+  size_t ncounts = HIST_IMPL(_ncounts);
+
+  hist_count_t *hists = malloc(nhists * ncounts * sizeof(hist_count_t));
+  hist_count_t *sum = malloc(ncounts * sizeof(hist_count_t));
+  hist_count_t *expect = calloc(ncounts, sizeof(hist_count_t));
+  uint64_t *marg = malloc(NROWS * sizeof(uint64_t));
+  uint64_t *expect_marg = malloc(NROWS * sizeof(uint64_t));
+  uint64_t *bmarg = malloc(NBUCKETS * sizeof(uint64_t));
+  uint64_t *expect_bmarg = malloc(NBUCKETS * sizeof(uint64_t));
+  float *dens = malloc(ncounts * sizeof(float));
+  float *expect_dens = malloc(ncounts * sizeof(float));
+  int *modes = malloc(NROWS * sizeof(int));
+  int *expect_modes = malloc(NROWS * sizeof(int));
+  if (!hists || !sum || !expect || !marg || !expect_marg || !bmarg || !expect_bmarg || !dens || !expect_dens ||
+      !modes || !expect_modes) {
+    perror("malloc");
+    return 1;
+  }
+
+  srand(1);
+  for (size_t i = 0; i < nhists * ncounts; i++) {
+    hists[i] = rand() % 1000;
+  }
+  for (int h = 0; h < nhists; h++) {
+    hist_kernels_scalar.add(expect, hists + h * ncounts, ncounts);
+  }
+  hist_kernels_scalar.hour_marginals(expect, expect_marg);
+  hist_kernels_scalar.bucket_marginals(expect, expect_bmarg);
+  hist_kernels_scalar.densities(expect, expect_dens);
+  hist_kernels_scalar.modes(expect, expect_modes);
+
+  const hist_kernels_t *sets[3] = {&hist_kernels_scalar, NULL, NULL};
+  int nsets = 1;
+#ifdef HIST_HAVE_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    sets[nsets++] = &hist_kernels_sse2;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    sets[nsets++] = &hist_kernels_avx2;
+  }
+#endif
+
+  double bytes = (double)nhists * ncounts * sizeof(hist_count_t) * rounds;
+  printf("%d histograms of %dx%d counters, %d rounds, dispatch picks %s\n", nhists, NROWS, NBUCKETS, rounds,
+         hist_kernels()->name);
+  printf("%-8s %12s %12s %12s %12s %12s\n", "kernels", "merge GB/s", "marg GB/s", "bmarg GB/s", "dens GB/s",
+         "mode GB/s");
+  int mismatches = 0;
+
+  for (int s = 0; s < nsets; s++) {
+    const hist_kernels_t *k = sets[s];
+    double t0, t_add, t_marg, t_bmarg, t_dens, t_mode;
+    int ok = 1;
+
+    t0 = seconds();
+    for (int r = 0; r < rounds; r++) {
+      memset(sum, 0, ncounts * sizeof(hist_count_t));
+      for (int h = 0; h < nhists; h++) {
+        k->add(sum, hists + h * ncounts, ncounts);
+      }
+    }
+    t_add = seconds() - t0;
+    ok &= memcmp(sum, expect, ncounts * sizeof(hist_count_t)) == 0;
+
+    t0 = seconds();
+    for (int r = 0; r < rounds; r++) {
+      for (int h = 0; h < nhists; h++) {
+        k->hour_marginals(hists + h * ncounts, marg);
+      }
+    }
+    t_marg = seconds() - t0;
+    k->hour_marginals(expect, marg);
+    ok &= memcmp(marg, expect_marg, NROWS * sizeof(uint64_t)) == 0;
+
+    t0 = seconds();
+    for (int r = 0; r < rounds; r++) {
+      for (int h = 0; h < nhists; h++) {
+        k->bucket_marginals(hists + h * ncounts, bmarg);
+      }
+    }
+    t_bmarg = seconds() - t0;
+    k->bucket_marginals(expect, bmarg);
+    ok &= memcmp(bmarg, expect_bmarg, NBUCKETS * sizeof(uint64_t)) == 0;
+
+    t0 = seconds();
+    for (int r = 0; r < rounds; r++) {
+      for (int h = 0; h < nhists; h++) {
+        k->densities(hists + h * ncounts, dens);
+      }
+    }
+    t_dens = seconds() - t0;
+    k->densities(expect, dens);
+    for (size_t i = 0; i < ncounts; i++) {
+      float scale = expect_dens[i] > 1e-30f ? expect_dens[i] : 1e-30f;
+      ok &= fabsf(dens[i] - expect_dens[i]) <= DENSITY_TOLERANCE * scale;
+    }
+
+    t0 = seconds();
+    for (int r = 0; r < rounds; r++) {
+      for (int h = 0; h < nhists; h++) {
+        k->modes(hists + h * ncounts, modes);
+      }
+    }
+    t_mode = seconds() - t0;
+    k->modes(expect, modes);
+    ok &= memcmp(modes, expect_modes, NROWS * sizeof(int)) == 0;
+
+    printf("%-8s %12.2f %12.2f %12.2f %12.2f %12.2f%s\n", k->name, bytes / t_add / 1e9, bytes / t_marg / 1e9,
+           bytes / t_bmarg / 1e9, bytes / t_dens / 1e9, bytes / t_mode / 1e9, ok ? "" : "  MISMATCH");
+    mismatches += !ok;
+  }
+
+  free(hists);
+  free(sum);
+  free(expect);
+  free(marg);
+  free(expect_marg);
+  free(bmarg);
+  free(expect_bmarg);
+  free(dens);
+  free(expect_dens);
+  free(modes);
+  free(expect_modes);
+  return mismatches ? 1 : 0;
+}
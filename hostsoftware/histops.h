@@ -0,0 +1,313 @@
+#ifndef histops_h_
+#define histops_h_
+#include "hist.h"
+
+/*
+ * Rollup kernels that work directly on the mapped NROWS x NBUCKETS
+ * counters of construct_hist:
+ *   add              dst[i] += src[i] for n counters (merging hist files)
+ *   hour_marginals   total observations per hour (row sums)
+ *   bucket_marginals total observations per bucket over all hours (column sums)
+ *   densities        every row scaled so it sums to 1
+ *   modes            fullest bucket of every row (lowest one on ties)
+ *
+ * There is a scalar version of each, plus SSE2 and AVX2 versions for
+ * 32 bit counters on x86.  hist_kernels() picks the best one the CPU
+ * supports the first time it is called.  The vector versions convert
+ * counters to float and compare them as signed, so they assume fewer
+ * than 2^31 observations per bucket.
+ */
+typedef struct {
+  const char *name;
+  void (*add)(hist_count_t *dst, const hist_count_t *src, size_t n);
+  void (*hour_marginals)(const hist_count_t *counts, uint64_t *out);
+  void (*bucket_marginals)(const hist_count_t *counts, uint64_t *out);
+  void (*densities)(const hist_count_t *counts, float *out);
+  void (*modes)(const hist_count_t *counts, int *out);
+} hist_kernels_t;
+
+void scalar_add(hist_count_t *dst, const hist_count_t *src, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    dst[i] += src[i];
+  }
+}
+
+void scalar_hour_marginals(const hist_count_t *counts, uint64_t *out) {
+  for (int t = 0; t < NROWS; t++) {
+    out[t] = 0;
+    for (int b = 0; b < NBUCKETS; b++) {
+      out[t] += counts[t * NBUCKETS + b];
+    }
+  }
+}
+
+void scalar_bucket_marginals(const hist_count_t *counts, uint64_t *out) {
+  for (int b = 0; b < NBUCKETS; b++) {
+    out[b] = 0;
+  }
+  for (int t = 0; t < NROWS; t++) {
+    for (int b = 0; b < NBUCKETS; b++) {
+      out[b] += counts[t * NBUCKETS + b];
+    }
+  }
+}
+
+void scalar_densities(const hist_count_t *counts, float *out) {
+  for (int t = 0; t < NROWS; t++) {
+    uint64_t total = 0;
+    for (int b = 0; b < NBUCKETS; b++) {
+      total += counts[t * NBUCKETS + b];
+    }
+    float scale = total ? 1.0f / total : 0.0f;
+    for (int b = 0; b < NBUCKETS; b++) {
+      out[t * NBUCKETS + b] = counts[t * NBUCKETS + b] * scale;
+    }
+  }
+}
+
+void scalar_modes(const hist_count_t *counts, int *out) {
+  for (int t = 0; t < NROWS; t++) {
+    int best = 0;
+    for (int b = 1; b < NBUCKETS; b++) {
+      if (counts[t * NBUCKETS + b] > counts[t * NBUCKETS + best]) {
+        best = b;
+      }
+    }
+    out[t] = best;
+  }
+}
+
+hist_kernels_t hist_kernels_scalar = {"scalar", scalar_add, scalar_hour_marginals, scalar_bucket_marginals,
+                                      scalar_densities, scalar_modes};
+
+#if (defined(__x86_64__) || defined(__i386__)) && HIST_COUNTER_BITS == 32 && NBUCKETS % 8 == 0
+#include <immintrin.h>
+#define HIST_HAVE_SIMD 1
+
+/*
+ * SSE2: 4 counters per vector
+ */
+__attribute__((target("sse2"))) void sse2_add(hist_count_t *dst, const hist_count_t *src, size_t n) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    for (int k = 0; k < 16; k += 4) {
+      __m128i a = _mm_loadu_si128((const __m128i *)(dst + i + k));
+      __m128i b = _mm_loadu_si128((const __m128i *)(src + i + k));
+      _mm_storeu_si128((__m128i *)(dst + i + k), _mm_add_epi32(a, b));
+    }
+  }
+  scalar_add(dst + i, src + i, n - i);
+}
+
+// adds the 4 counters of v, widened to 64 bits, into the two lanes of acc
+__attribute__((target("sse2"))) __m128i sse2_widen_add(__m128i acc, __m128i v) {
+  __m128i zero = _mm_setzero_si128();
+  acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+  return _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+}
+
+__attribute__((target("sse2"))) void sse2_hour_marginals(const hist_count_t *counts, uint64_t *out) {
+  for (int t = 0; t < NROWS; t++) {
+    __m128i acc = _mm_setzero_si128();
+    for (int b = 0; b < NBUCKETS; b += 4) {
+      acc = sse2_widen_add(acc, _mm_loadu_si128((const __m128i *)(counts + t * NBUCKETS + b)));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    out[t] = lanes[0] + lanes[1];
+  }
+}
+
+__attribute__((target("sse2"))) void sse2_bucket_marginals(const hist_count_t *counts, uint64_t *out) {
+  for (int b = 0; b < NBUCKETS; b += 4) {
+    __m128i lo = _mm_setzero_si128();
+    __m128i hi = _mm_setzero_si128();
+    __m128i zero = _mm_setzero_si128();
+    for (int t = 0; t < NROWS; t++) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(counts + t * NBUCKETS + b));
+      lo = _mm_add_epi64(lo, _mm_unpacklo_epi32(v, zero));
+      hi = _mm_add_epi64(hi, _mm_unpackhi_epi32(v, zero));
+    }
+    _mm_storeu_si128((__m128i *)(out + b), lo);
+    _mm_storeu_si128((__m128i *)(out + b + 2), hi);
+  }
+}
+
+__attribute__((target("sse2"))) void sse2_densities(const hist_count_t *counts, float *out) {
+  uint64_t totals[NROWS];
+  sse2_hour_marginals(counts, totals);
+  for (int t = 0; t < NROWS; t++) {
+    __m128 scale = _mm_set1_ps(totals[t] ? 1.0f / totals[t] : 0.0f);
+    for (int b = 0; b < NBUCKETS; b += 4) {
+      __m128 v = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(counts + t * NBUCKETS + b)));
+      _mm_storeu_ps(out + t * NBUCKETS + b, _mm_mul_ps(v, scale));
+    }
+  }
+}
+
+__attribute__((target("sse2"))) __m128i sse2_max_epi32(__m128i a, __m128i b) {
+  __m128i gt = _mm_cmpgt_epi32(a, b);
+  return _mm_or_si128(_mm_and_si128(gt, a), _mm_andnot_si128(gt, b));
+}
+
+__attribute__((target("sse2"))) void sse2_modes(const hist_count_t *counts, int *out) {
+  for (int t = 0; t < NROWS; t++) {
+    const hist_count_t *row = counts + t * NBUCKETS;
+    __m128i m = _mm_loadu_si128((const __m128i *)row);
+    for (int b = 4; b < NBUCKETS; b += 4) {
+      m = sse2_max_epi32(m, _mm_loadu_si128((const __m128i *)(row + b)));
+    }
+    // horizontal max, broadcast to every lane
+    m = sse2_max_epi32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = sse2_max_epi32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+    out[t] = 0;
+    for (int b = 0; b < NBUCKETS; b += 4) {
+      int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(m, _mm_loadu_si128((const __m128i *)(row + b)))));
+      if (mask) {
+        out[t] = b + __builtin_ctz(mask);
+        break;
+      }
+    }
+  }
+}
+
+hist_kernels_t hist_kernels_sse2 = {"sse2", sse2_add, sse2_hour_marginals, sse2_bucket_marginals, sse2_densities,
+                                    sse2_modes};
+
+/*
+ * AVX2: 8 counters per vector
+ */
+__attribute__((target("avx2"))) void avx2_add(hist_count_t *dst, const hist_count_t *src, size_t n) {
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    for (int k = 0; k < 32; k += 8) {
+      __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i + k));
+      __m256i b = _mm256_loadu_si256((const __m256i *)(src + i + k));
+      _mm256_storeu_si256((__m256i *)(dst + i + k), _mm256_add_epi32(a, b));
+    }
+  }
+  scalar_add(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2"))) void avx2_hour_marginals(const hist_count_t *counts, uint64_t *out) {
+  for (int t = 0; t < NROWS; t++) {
+    __m256i acc = _mm256_setzero_si256();
+    for (int b = 0; b < NBUCKETS; b += 8) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(counts + t * NBUCKETS + b));
+      acc = _mm256_add_epi64(acc, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(v)));
+      acc = _mm256_add_epi64(acc, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(v, 1)));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    out[t] = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  }
+}
+
+__attribute__((target("avx2"))) void avx2_bucket_marginals(const hist_count_t *counts, uint64_t *out) {
+  for (int b = 0; b < NBUCKETS; b += 8) {
+    __m256i lo = _mm256_setzero_si256();
+    __m256i hi = _mm256_setzero_si256();
+    for (int t = 0; t < NROWS; t++) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(counts + t * NBUCKETS + b));
+      lo = _mm256_add_epi64(lo, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(v)));
+      hi = _mm256_add_epi64(hi, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(v, 1)));
+    }
+    _mm256_storeu_si256((__m256i *)(out + b), lo);
+    _mm256_storeu_si256((__m256i *)(out + b + 4), hi);
+  }
+}
+
+__attribute__((target("avx2"))) void avx2_densities(const hist_count_t *counts, float *out) {
+  uint64_t totals[NROWS];
+  avx2_hour_marginals(counts, totals);
+  for (int t = 0; t < NROWS; t++) {
+    __m256 scale = _mm256_set1_ps(totals[t] ? 1.0f / totals[t] : 0.0f);
+    for (int b = 0; b < NBUCKETS; b += 8) {
+      __m256 v = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)(counts + t * NBUCKETS + b)));
+      _mm256_storeu_ps(out + t * NBUCKETS + b, _mm256_mul_ps(v, scale));
+    }
+  }
+}
+
+__attribute__((target("avx2"))) void avx2_modes(const hist_count_t *counts, int *out) {
+  for (int t = 0; t < NROWS; t++) {
+    const hist_count_t *row = counts + t * NBUCKETS;
+    __m256i m = _mm256_loadu_si256((const __m256i *)row);
+    for (int b = 8; b < NBUCKETS; b += 8) {
+      m = _mm256_max_epu32(m, _mm256_loadu_si256((const __m256i *)(row + b)));
+    }
+    // horizontal max, broadcast to every lane
+    m = _mm256_max_epu32(m, _mm256_permute2x128_si256(m, m, 1));
+    m = _mm256_max_epu32(m, _mm256_shuffle_epi32(m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm256_max_epu32(m, _mm256_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+    out[t] = 0;
+    for (int b = 0; b < NBUCKETS; b += 8) {
+      __m256i eq = _mm256_cmpeq_epi32(m, _mm256_loadu_si256((const __m256i *)(row + b)));
+      int mask = _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+      if (mask) {
+        out[t] = b + __builtin_ctz(mask);
+        break;
+      }
+    }
+  }
+}
+
+hist_kernels_t hist_kernels_avx2 = {"avx2", avx2_add, avx2_hour_marginals, avx2_bucket_marginals, avx2_densities,
+                                    avx2_modes};
+#endif
+
+/*
+ * Best kernels for this CPU, chosen once
+ */
+const hist_kernels_t *hist_kernels(void) {
+  static const hist_kernels_t *best = NULL;
+  if (best == NULL) {
+    best = &hist_kernels_scalar;
+#ifdef HIST_HAVE_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      best = &hist_kernels_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+      best = &hist_kernels_sse2;
+    }
+#endif
+  }
+  return best;
+}
+
+/*
+ * Adds the counts of every file in fnames into dst.  The files are only
+ * read: one in an older format is converted in memory, not rewritten
+ * returns the number of files merged, or -1 if one could not be read
+ */
+int merge_hist_files(hist_t *dst, char **fnames, int nfiles) {
+  const hist_kernels_t *k = hist_kernels();
+  uint64_t wide[HIST_IMPL(_ncounts)];
+  hist_count_t counts[HIST_IMPL(_ncounts)];
+  for (int i = 0; i < nfiles; i++) {
+    struct stat st;
+    int fd = open(fnames[i], O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+      perror("Error opening hist file to merge");
+      if (fd != -1) {
+        close(fd);
+      }
+      return -1;
+    }
+    int res = read_hist_counts(fd, st.st_size, wide);
+    close(fd);
+    if (res) {
+      return -1;
+    }
+    uint64_t observations = 0;
+    for (int j = 0; j < HIST_IMPL(_ncounts); j++) {
+      counts[j] = (hist_count_t)wide[j];
+      observations += wide[j];
+    }
+    k->add(dst->counts, counts, HIST_IMPL(_ncounts));
+    dst->hdr->observations += observations;
+  }
+  return nfiles;
+}
+
+#endif
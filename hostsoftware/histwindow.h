@@ -0,0 +1,283 @@
+#ifndef histwindow_h_
+#define histwindow_h_
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hist.h"
+#include "seqlock.h"
+#include "timecodec.h"
+
+/*
+ * Recent hists, next to the all time ones of hist.h: the same hour by
+ * bucket counters, but only over the last few days, and a copy in
+ * which every reading's weight halves every DECAY_HALF_LIFE minutes.
+ *
+ * Every channel keeps a ring of WINDOW_SLICES slices, one hist per
+ * WINDOW_SLICE_MINUTES, plus a running sum over the last n slices for
+ * every n in WINDOW_SPANS.  A reading is counted into its slice and
+ * every sum it is recent enough for; when a reading opens a new slice,
+ * each sum subtracts the slice that just left it and the oldest slice
+ * is cleared for reuse.  So an update is O(1), a new slice O(buckets)
+ * per span, and any span is there to print without adding slices up.
+ * Windows are measured on the readings' own timestamps, like stats.h,
+ * but a slice is a calendar day (minute / WINDOW_SLICE_MINUTES), not
+ * the 24 h before the newest reading: n slices are that reading's day
+ * since 00:00 and the n - 1 whole days before it.
+ *
+ * Decay is lazy: a reading adds 2^((minute - decay_base) / half life),
+ * so older readings shrink relative to newer ones without being
+ * touched, and the counters are scaled back down (and decay_base moved
+ * up) once the weights grow past 2^DECAY_RESCALE.
+ *
+ * One file, window.bin, holds the header and then each channel's
+ * sums, slices and decayed counters, so it maps like a hist file.
+ */
+#define WINDOW_SLICE_MINUTES (24 * 60)
+#define WINDOW_SLICES 30
+// spans with running sums, in slices: the last week and the last month
+#define WINDOW_SPANS {7, 30}
+#define NSPANS 2
+#define DECAY_HALF_LIFE (7 * 24 * 60)
+#define DECAY_RESCALE 32
+
+#define WINDOW_MAGIC 0x444e4957 // "WIND"
+#define WINDOW_VERSION 1
+#define WINDOW_FILE "window.bin"
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint16_t counter_bytes;
+  uint16_t bucket_shift;
+  uint16_t nbuckets;
+  uint16_t nrows;
+  uint32_t slice_minutes;
+  uint32_t nslices;
+  uint32_t spans[NSPANS];
+  uint32_t half_life;
+  // seqlock over everything below and the counters (seqlock.h), even at rest
+  uint32_t seq;
+  // slice of the newest reading
+  uint32_t head;
+  // newest reading, and the minute a decayed weight of 1 belongs to
+  uint32_t latest;
+  uint32_t decay_base;
+  uint64_t observations;
+} hist_window_header_t;
+
+typedef struct {
+  hist_count_t sums[NSPANS][HIST_IMPL(_ncounts)];
+  hist_count_t slices[WINDOW_SLICES][HIST_IMPL(_ncounts)];
+  double decayed[HIST_IMPL(_ncounts)];
+} hist_window_channel_t;
+
+#define WINDOW_FILESIZE (sizeof(hist_window_header_t) + 3 * sizeof(hist_window_channel_t))
+
+typedef struct {
+  int fd;
+  hist_window_header_t *hdr;
+  hist_window_channel_t *channels;
+} hist_window_t;
+
+const uint32_t window_spans[NSPANS] = WINDOW_SPANS;
+
+// opens slices up to key, dropping what falls out of each span
+void hist_window_advance(hist_window_t *w, uint32_t key) {
+  hist_window_header_t *hdr = w->hdr;
+  if (key - hdr->head >= WINDOW_SLICES) {
+    for (int c = 0; c < 3; c++) {
+      memset(w->channels[c].sums, 0, sizeof(w->channels[c].sums));
+      memset(w->channels[c].slices, 0, sizeof(w->channels[c].slices));
+    }
+    hdr->head = key;
+    return;
+  }
+  for (uint32_t k = hdr->head + 1; k <= key; k++) {
+    for (int c = 0; c < 3; c++) {
+      hist_window_channel_t *ch = &w->channels[c];
+      for (int s = 0; s < NSPANS; s++) {
+        if (k < window_spans[s]) {
+          continue;
+        }
+        const hist_count_t *leaving = ch->slices[(k - window_spans[s]) % WINDOW_SLICES];
+        for (int i = 0; i < HIST_IMPL(_ncounts); i++) {
+          ch->sums[s][i] -= leaving[i];
+        }
+      }
+      memset(ch->slices[k % WINDOW_SLICES], 0, sizeof(ch->slices[0]));
+    }
+  }
+  hdr->head = key;
+}
+
+// scales the decayed counters so a weight of 1 belongs to minute
+void hist_window_rescale(hist_window_t *w, uint32_t minute) {
+  double scale = exp2(-((double)minute - w->hdr->decay_base) / DECAY_HALF_LIFE);
+  for (int c = 0; c < 3; c++) {
+    for (int i = 0; i < HIST_IMPL(_ncounts); i++) {
+      w->channels[c].decayed[i] *= scale;
+    }
+  }
+  w->hdr->decay_base = minute;
+}
+
+// counts one reading of all three channels, taken at minute
+void update_hist_window(hist_window_t *w, const unsigned char *values, uint32_t minute) {
+  hist_window_header_t *hdr = w->hdr;
+  uint32_t key = minute / WINDOW_SLICE_MINUTES;
+  int row = HIST_IMPL(_row)(minute);
+
+  seq_write_begin(&hdr->seq);
+  if (hdr->observations == 0) {
+    hdr->head = key;
+    hdr->latest = minute;
+    hdr->decay_base = minute;
+  }
+  hdr->observations++;
+  if (key > hdr->head) {
+    hist_window_advance(w, key);
+  }
+  if (minute > hdr->latest) {
+    hdr->latest = minute;
+  }
+  if ((double)minute - hdr->decay_base > (double)DECAY_RESCALE * DECAY_HALF_LIFE) {
+    hist_window_rescale(w, minute);
+  }
+
+  uint32_t age = hdr->head - key;
+  double weight = exp2(((double)minute - hdr->decay_base) / DECAY_HALF_LIFE);
+  for (int c = 0; c < 3; c++) {
+    hist_window_channel_t *ch = &w->channels[c];
+    int i = row * NBUCKETS + (values[c] >> BUCKET_SHIFT);
+    ch->decayed[i] += weight;
+    // a reading older than the ring only decays
+    if (age >= WINDOW_SLICES) {
+      continue;
+    }
+    ch->slices[key % WINDOW_SLICES][i]++;
+    for (int s = 0; s < NSPANS; s++) {
+      ch->sums[s][i] += age < window_spans[s];
+    }
+  }
+  seq_write_end(&hdr->seq);
+}
+
+/*
+ * Copies channel's counts over the last n slices (1 to WINDOW_SLICES)
+ * as of one instant; a span with a running sum is a copy, any other n
+ * adds its slices up
+ */
+void snapshot_hist_window(const hist_window_t *w, int channel, uint32_t n, hist_count_t *counts) {
+  const hist_window_channel_t *ch = &w->channels[channel];
+  uint32_t s;
+  do {
+    s = seq_read_begin(&w->hdr->seq);
+    int span = -1;
+    for (int i = 0; i < NSPANS; i++) {
+      span = window_spans[i] == n ? i : span;
+    }
+    if (span >= 0) {
+      memcpy(counts, ch->sums[span], sizeof(ch->sums[span]));
+    } else {
+      uint32_t head = w->hdr->head;
+      memset(counts, 0, HIST_IMPL(_ncounts) * sizeof(hist_count_t));
+      for (uint32_t k = 0; k < n && k <= head; k++) {
+        const hist_count_t *slice = ch->slices[(head - k) % WINDOW_SLICES];
+        for (int i = 0; i < HIST_IMPL(_ncounts); i++) {
+          counts[i] += slice[i];
+        }
+      }
+    }
+  } while (seq_read_retry(&w->hdr->seq, s));
+}
+
+// channel's decayed counts as of its newest reading, rounded
+void snapshot_decayed(const hist_window_t *w, int channel, hist_count_t *counts) {
+  double decayed[HIST_IMPL(_ncounts)];
+  double scale;
+  uint32_t s;
+  do {
+    s = seq_read_begin(&w->hdr->seq);
+    memcpy(decayed, w->channels[channel].decayed, sizeof(decayed));
+    scale = exp2(-((double)w->hdr->latest - w->hdr->decay_base) / DECAY_HALF_LIFE);
+  } while (seq_read_retry(&w->hdr->seq, s));
+  for (int i = 0; i < HIST_IMPL(_ncounts); i++) {
+    counts[i] = (hist_count_t)(decayed[i] * scale + 0.5);
+  }
+}
+
+/*
+ * construct_hist_window opens (creating if needed) and mmaps the window file
+ * return value is 0 on success
+ */
+int construct_hist_window(char *fname, hist_window_t *w) {
+  struct stat st;
+  hist_window_header_t hdr;
+
+  w->fd = open(fname, O_RDWR | O_CREAT, (mode_t)0600);
+  if (w->fd == -1) {
+    perror("Error opening window file");
+    return -1;
+  }
+  if (fstat(w->fd, &st) == -1) {
+    perror("Error calling fstat()");
+    close(w->fd);
+    return -1;
+  }
+
+  int fresh = st.st_size == 0;
+  if (!fresh && (st.st_size != (off_t)WINDOW_FILESIZE || pread(w->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+                 hdr.magic != WINDOW_MAGIC || hdr.version != WINDOW_VERSION ||
+                 hdr.counter_bytes != sizeof(hist_count_t) || hdr.nbuckets != NBUCKETS || hdr.nrows != NROWS ||
+                 hdr.slice_minutes != WINDOW_SLICE_MINUTES || hdr.nslices != WINDOW_SLICES ||
+                 memcmp(hdr.spans, window_spans, sizeof(hdr.spans)) != 0 || hdr.half_life != DECAY_HALF_LIFE)) {
+    fprintf(stderr, "%s is not a window file of this geometry\n", fname);
+    close(w->fd);
+    return -1;
+  }
+  if (fresh && ftruncate(w->fd, WINDOW_FILESIZE) == -1) {
+    perror("Error extending window file");
+    close(w->fd);
+    return -1;
+  }
+
+  char *map = (char *)mmap(0, WINDOW_FILESIZE, PROT_READ | PROT_WRITE, MAP_SHARED, w->fd, 0);
+  if (map == MAP_FAILED) {
+    perror("Error mapping window file");
+    close(w->fd);
+    return -1;
+  }
+  w->hdr = (hist_window_header_t *)map;
+  w->channels = (hist_window_channel_t *)(map + sizeof(hist_window_header_t));
+  if (fresh) {
+    w->hdr->magic = WINDOW_MAGIC;
+    w->hdr->version = WINDOW_VERSION;
+    w->hdr->counter_bytes = sizeof(hist_count_t);
+    w->hdr->bucket_shift = BUCKET_SHIFT;
+    w->hdr->nbuckets = NBUCKETS;
+    w->hdr->nrows = NROWS;
+    w->hdr->slice_minutes = WINDOW_SLICE_MINUTES;
+    w->hdr->nslices = WINDOW_SLICES;
+    memcpy(w->hdr->spans, window_spans, sizeof(w->hdr->spans));
+    w->hdr->half_life = DECAY_HALF_LIFE;
+  }
+  w->hdr->seq &= ~1u;
+  return 0;
+}
+
+int deconstruct_hist_window(hist_window_t *w) {
+  if (munmap(w->hdr, WINDOW_FILESIZE) == -1) {
+    perror("Error un-mapping window file");
+    close(w->fd);
+    return -1;
+  }
+  close(w->fd);
+  return 0;
+}
+
+#endif
@@ -1,107 +1,231 @@
 #define _GNU_SOURCE
 
+#include "archive.h"
 #include "arduinocom.h"
-#include "hist.h"
-#include "record.h"
+#include "metrics.h"
+#include "query.h"
+#include "ring.h"
+#include "scheduler.h"
+#include "server.h"
+#include "uring.h"
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
 
-int read_cmd(enum message *cmd, char *extra);
 int matches(const char *buf, const char *prefix);
-void main_loop_data(int tty_fd, char *record, char **hists);
-void main_loop_cli(char *record, char **hists);
+int channel_index(char c);
+int parse_period(const char *spec);
+int parse_capacity(const char *spec, record_capacity_t *capacity);
+int serve_command(archive_t *archives, int narchives, int *station, const char *line, FILE *out);
 
 char *names[3] = {"Temperature", "Pressure", "Humidity"};
-char *hist_file_names[3] = {"tmp_hist.bin", "prs_hist.bin", "hmd_hist.bin"};
+
+void main_loop_data(struct device *devs, int ndevs, archive_t *archives);
+void main_loop_cli(archive_t *archives, int narchives);
 
 /* Inter Process Communications
- * signal_pipe is for sending the user commands to the background process
- * data_pipe is for sending the data from the background to client process 
+ * cmd_ring is for sending the user commands to the background process
+ * reply_ring is for sending the data from the background to client process
+ * Both are shared memory rings set up before the fork
  */
+typedef struct {
+  enum message msg;
+  int extra;
+} command_t;
+
+// replies carry the reading already decoded at ingest
+typedef record_t reply_t;
+
+SPSC_RING(cmd, command_t, 64)
+SPSC_RING(reply, reply_t, 16)
+
+// readings requested from a device per round-trip
+int batch_size = 1;
+
+// readings after which a device is done, 0 to sample until exit
+long max_readings = 0;
+
+// how often each channel of each device is sampled
+#define DEFAULT_PERIOD_MS 1000
+long periods_ms[MAXDEVICES][3];
+
+// whether the data loop runs on io_uring rather than epoll
+int use_uring = 0;
+
 int pid;
-int signal_pipe[2];  
-int data_pipe[2];
+cmd_ring_t *cmd_ring;
+reply_ring_t *reply_ring;
 
 int main(int argc, char **argv) {
   int res = 0;
+  struct device devs[MAXDEVICES];
+  int ndevs = 0;
 
-  /*
-   * /dev/ttyACM0 unless the user specifies a file
-   */
-  char *serial_file = (argc == 2) ? argv[1] : "/dev/ttyACM0";
+  // one per device, each station's readings kept apart
+  archive_t archives[MAXDEVICES];
+  int narchives = 0;
+  char station_dir[16];
+  server_t server;
+  memset(&server, 0, sizeof(server));
 
   /*
-   * Need the following flags to open:
-   * O_RDWR: to read from/write to the devices
-   * O_NOCTTY: Do not become the process's controlling terminal
-   * O_NDELAY: Open the resource in nonblocking mode
+   * -n N asks every device for N readings per round-trip
+   * -b BAUD switches the devices to BAUD once they are up
+   * -d none|group|wal picks how the archive files are flushed,
+   * -g N and -t MS how often (every N readings or MS milliseconds)
+   * -s PATH is the unix socket the query server listens on
+   * -p [DEV:]CHANNEL:MS samples CHANNEL (t, p or h) of device DEV, or of
+   *    every device, every MS milliseconds (DEFAULT_PERIOD_MS otherwise)
+   * -r N stops sampling a device after N readings
+   * -i epoll|uring picks how the data loop waits and does its I/O
+   * -a RECORDS[:SEGMENTS[:COLD]] sizes a new record archive: SEGMENTS
+   *    files of RECORDS readings each (an existing one keeps its size),
+   *    and keeps the last COLD compressed segments (0 for all)
+   * -M prefaults the archive mappings and asks for huge pages
    */
-  int serial_fd = open(serial_file, O_RDWR | O_NOCTTY | O_NDELAY);
-  if (serial_fd == -1) {
-    perror("Error opening serial");
-    res = -1;
-    goto done;
+  long baud = BOOT_BAUD;
+  int durability = DURABILITY_GROUP;
+  long group_readings = 64;
+  long group_ms = 1000;
+  const char *socket_path = SERVER_SOCKET;
+  record_capacity_t capacity = RECORD_CAPACITY_DEFAULT;
+  int opt;
+  for (int i = 0; i < MAXDEVICES; i++) {
+    for (int c = 0; c < 3; c++) {
+      periods_ms[i][c] = DEFAULT_PERIOD_MS;
+    }
+  }
+  while ((opt = getopt(argc, argv, "n:b:d:g:t:s:p:r:i:a:M")) != -1) {
+    if (opt == 'n') {
+      batch_size = atoi(optarg);
+    } else if (opt == 'b') {
+      baud = atol(optarg);
+    } else if (opt == 'd') {
+      durability = durability_parse(optarg);
+    } else if (opt == 'g') {
+      group_readings = atol(optarg);
+    } else if (opt == 't') {
+      group_ms = atol(optarg);
+    } else if (opt == 's') {
+      socket_path = optarg;
+    } else if (opt == 'p' && parse_period(optarg) == 0) {
+    } else if (opt == 'r' && (max_readings = atol(optarg)) >= 0) {
+    } else if (opt == 'i' && (strcmp(optarg, "epoll") == 0 || strcmp(optarg, "uring") == 0)) {
+      use_uring = strcmp(optarg, "uring") == 0;
+    } else if (opt == 'a' && parse_capacity(optarg, &capacity) == 0) {
+    } else if (opt == 'M') {
+      capacity.populate = 1;
+    } else {
+      fprintf(stderr,
+              "Usage: %s [-n batch] [-b baud] [-d none|group|wal] [-g readings] [-t ms] [-s socket]"
+              " [-p [dev:]t|p|h:ms ...] [-r readings] [-i epoll|uring] [-a records[:segments[:cold]]] [-M]"
+              " [serial ...]\n",
+              argv[0]);
+      return -1;
+    }
+  }
+  if (durability < 0 || group_readings < 1 || group_ms < 0) {
+    fprintf(stderr, "Durability must be none, group or wal, flushed every >= 1 readings\n");
+    return -1;
+  }
+  if (baud_to_speed(baud) == 0) {
+    fprintf(stderr, "Unsupported baud rate %ld\n", baud);
+    return -1;
+  }
+  if (batch_size < 1 || batch_size > 255) {
+    fprintf(stderr, "Batch size must be between 1 and 255\n");
+    return -1;
   }
 
-  /* Configure settings on the serial port */
-  if (init_tty(serial_fd) == -1) {
-    perror("Issue setting up serial file");
-    res = -1;
-    goto done;
+  /*
+   * /dev/ttyACM0 unless the user specifies one or more files,
+   * one per Arduino
+   */
+  char *default_serial[1] = {"/dev/ttyACM0"};
+  char **serial_files = (optind < argc) ? argv + optind : default_serial;
+  int nserial = (optind < argc) ? argc - optind : 1;
+  if (nserial > MAXDEVICES) {
+    fprintf(stderr, "At most %d serial devices are supported\n", MAXDEVICES);
+    return -1;
   }
 
-  // Three histograms, Temp, Pressure, Humidity
-  char *hists[3];
-  int hist_fds[3];
-  for (int i = 0; i < 3; i++) {
+  for (ndevs = 0; ndevs < nserial; ndevs++) {
     /*
-     * construct_hist is responsible for opening the file and mmaping the file
-     * reports a file descriptor by filling a user provided pointer
-     * reports the mapped region address by filling another user provided
-     * pointer return value is 0 on success
+     * Need the following flags to open:
+     * O_RDWR: to read from/write to the devices
+     * O_NOCTTY: Do not become the process's controlling terminal
+     * O_NDELAY: Open the resource in nonblocking mode
      */
-    if (construct_hist(hist_file_names[i], &hist_fds[i], &hists[i])) {
+    int serial_fd = open(serial_files[ndevs], O_RDWR | O_NOCTTY | O_NDELAY);
+    if (serial_fd == -1) {
+      perror("Error opening serial");
+      res = -1;
+      goto done;
+    }
+    dev_init(&devs[ndevs], serial_fd);
+
+    /* Configure settings on the serial port */
+    if (init_tty(serial_fd, baud_to_speed(BOOT_BAUD)) == -1) {
+      perror("Issue setting up serial file");
+      ndevs++;
+      res = -1;
+      goto done;
+    }
+
+    /* Wait until the Arduino says it is ready, then agree on a baud rate */
+    if (dev_handshake(&devs[ndevs], HANDSHAKE_TIMEOUT_MS) ||
+        dev_set_baud(&devs[ndevs], baud, HANDSHAKE_TIMEOUT_MS)) {
+      fprintf(stderr, "Arduino on %s is not responding\n", serial_files[ndevs]);
+      ndevs++;
       res = -1;
       goto done;
     }
   }
-  int record_fd = 0;
-  char *record = NULL;
+
   /*
-   * construct_record is responsible for opening the file and mmaping the file
-   * the file descriptor is loaded into user provided pointer
-   * the address of the mapped region is loaded into another user provided
-   * pointer return value is 0 on success
+   * construct_archive opens and mmaps every hist, quantile and record
+   * file, replaying the write-ahead log first when there is one
+   * return value is 0 on success
+   * A lone device keeps its archive in the working directory, with more
+   * every device's goes into station<i>/, as the analyzer reads them
    */
-  if (construct_record("record.bin", &record_fd, &record)) {
+  for (narchives = 0; narchives < ndevs; narchives++) {
+    snprintf(station_dir, sizeof(station_dir), "station%d", narchives);
+    if (construct_archive(&archives[narchives], ndevs > 1 ? station_dir : NULL, durability, group_readings,
+                          group_ms, &capacity)) {
+      res = -1;
+      goto done;
+    }
+  }
+
+  if (construct_metrics()) {
     res = -1;
     goto done;
-  } 
+  }
 
-  /* Create pipes for comm between parent and child
-   * Signal pipe is used by the cli loop to ask for
-   * values from the data loop.  
-   * Note, with pipe, on success, zero is returned
+  /* Create rings for comm between parent and child
+   * The command ring is used by the cli loop to ask for
+   * values from the data loop, which answers on the reply ring.
    */
-   if (pipe(signal_pipe) == -1) {
-            perror("Error initializing signal pipe");
-            return -1;
-	}
-  
-   if (pipe(data_pipe) == -1) {
-            perror("Error initializing data pipe");
-            return -1;
-	}
+  if ((cmd_ring = cmd_ring_create()) == NULL) {
+    perror("Error initializing command ring");
+    return -1;
+  }
+
+  if ((reply_ring = reply_ring_create()) == NULL) {
+    perror("Error initializing reply ring");
+    return -1;
+  }
 
   printf("Initializing Host-side Processes\n");
-  sleep(1);   //let arduino set up
 
   /* Fork and call main_loop_cli in the child
    * and main_loop_data in the parent.
@@ -111,37 +235,208 @@ int main(int argc, char **argv) {
             exit(1);
 	}
 	if(pid == 0) {
-	    main_loop_cli(record, hists); 
+	    main_loop_cli(archives, narchives); 
 	} else {
-	    main_loop_data(serial_fd, record, hists);
+	    // fdatasyncs, compression and query clients are threads of the data process only
+	    int started = 0;
+	    while (started < narchives && archive_start(&archives[started]) == 0) {
+	        started++;
+	    }
+	    if (started == narchives && server_start(&server, socket_path, archives, narchives, serve_command) == 0) {
+	        main_loop_data(devs, ndevs, archives);
+	    }
+	    server_stop(&server);
 	}
   /*
    * cleanup resources
    */
 done:
-  if (serial_fd)
-    close(serial_fd);
-  for (int i = 0; i < 3; i++) {
-    if (hist_fds[i])
-      deconstruct_hist(hist_fds[i], hists[i]);
-  }
-  if (record_fd)
-    deconstruct_record(record_fd, record);
+  for (int i = 0; i < ndevs; i++) {
+    close(devs[i].fd);
+  }
+  for (int i = 0; i < narchives; i++)
+    deconstruct_archive(&archives[i]);
   return res;
 }
 
+/*
+ * Runs one of the commands that only read the archive, printing to out;
+ * shared by the CLI and the query server's clients.
+ * returns 0 if buf was one of them
+ */
+int query_command(archive_t *archive, const char *buf, FILE *out) {
+  char from[STAMPLEN + 1], to[STAMPLEN + 1], tier[9], window[16];
+  char channel;
+  int hour;
+  double p;
+
+  if (sscanf(buf, "hist %c %15s", &channel, window) == 2 && channel_index(channel) >= 0) {
+    hist_count_t counts[HIST_IMPL(_ncounts)];
+    long n = atol(window);
+    if (strcmp(window, "decay") == 0) {
+      snapshot_decayed(&archive->window, channel_index(channel), counts);
+      fprintf(out, "%s, readings weighed down by half every %d h\n", names[channel_index(channel)],
+              DECAY_HALF_LIFE / 60);
+      print_hist_counts(counts, out);
+    } else if (n >= 1 && n <= WINDOW_SLICES) {
+      snapshot_hist_window(&archive->window, channel_index(channel), n, counts);
+      // slices are calendar days, the newest one begun at 00:00 not n * 24 h ago
+      fprintf(out, "%s, the last %ld calendar days (including today)\n", names[channel_index(channel)], n);
+      print_hist_counts(counts, out);
+    } else {
+      fprintf(out, "Usage: hist t|p|h [1-%d|decay] (calendar days)\n", WINDOW_SLICES);
+    }
+
+  }
+  else if (sscanf(buf, "hist %c", &channel) == 1 && channel_index(channel) >= 0) {
+    print_hist(&archive->hists[channel_index(channel)], out);
+
+  }
+  else if (sscanf(buf, "record from %12s to %12s", from, to) == 2) {
+    uint32_t lo = parse_stamp(from), hi = parse_stamp(to);
+    if (strlen(from) != STAMPLEN || strlen(to) != STAMPLEN || lo == STAMP_INVALID || hi == STAMP_INVALID) {
+      fprintf(out, "Usage: record from yyyymmddhhmm to yyyymmddhhmm\n");
+    } else {
+      print_record_range(&archive->record, lo, hi, out);
+    }
+
+  }
+  else if (sscanf(buf, "quantile %c %d %lf", &channel, &hour, &p) == 3) {
+    int c = channel_index(channel);
+    if (c < 0 || hour < 0 || hour >= 24 || p < 0.0 || p > 1.0) {
+      fprintf(out, "Usage: quantile t|p|h HOUR FRACTION\n");
+    } else {
+      int v = quantile_value(&archive->quantiles[c], hour, p);
+      if (v < 0) {
+        fprintf(out, "No %s readings at %02d:00 yet\n", names[c], hour);
+      } else {
+        fprintf(out, "p%g %s at %02d:00: %d\n", p * 100, names[c], hour, v);
+      }
+    }
+
+  }
+  else if (matches(buf, "select")) {
+    query_t q;
+    char err[80];
+    uint64_t t = metric_start();
+    if (parse_query(buf, &q, err, sizeof(err))) {
+      fprintf(out, "%s\n", err);
+      fprintf(out, "Usage: select COLUMNS [where COLUMN OP VALUE [and ...]] [group by hour|day|month] [limit N]\n");
+    } else {
+      uint64_t matched;
+      int tier = run_rollup_query(archive->rollups, &q, out, &matched);
+      if (tier < 0) {
+        matched = run_query(&archive->record, &q, out);
+      }
+      fprintf(out, "(%llu records", (unsigned long long)matched);
+      if (tier >= 0) {
+        fprintf(out, ", %s rollup", tier_names[tier]);
+      }
+      if (metrics) {
+        fprintf(out, ", %.1f ms", (metric_now() - t) * metrics->ns_per_tick / 1e6);
+      }
+      fprintf(out, ")\n");
+    }
+
+  }
+  else if (sscanf(buf, "rollup %8s", tier) == 1) {
+    int t = rollup_tier_index(tier);
+    int n = sscanf(buf, "rollup %*s from %12s to %12s", from, to);
+    uint32_t lo = n == 2 ? parse_stamp(from) : 0, hi = n == 2 ? parse_stamp(to) : 0;
+    if (t < 0 || (n == 2 && (strlen(from) != STAMPLEN || strlen(to) != STAMPLEN || lo == STAMP_INVALID ||
+                             hi == STAMP_INVALID))) {
+      fprintf(out, "Usage: rollup hour|day|month [from yyyymmddhhmm to yyyymmddhhmm]\n");
+    } else if (n == 2) {
+      print_rollup(&archive->rollups[t], lo, hi, out);
+    } else {
+      print_rollup(&archive->rollups[t], 0, UINT32_MAX, out);
+    }
+
+  }
+  else if (matches(buf, "stats")) {
+    print_stats(archive->stats, out);
+
+  }
+  else if (matches(buf, "record")) {
+    print_record(&archive->record, out);
+
+  }
+  else if (matches(buf, "archive")) {
+    print_cold(&archive->record, out);
+
+  }
+  else if (matches(buf, "metrics")) {
+    print_metrics(out);
+
+  }
+  else {
+    return -1;
+  }
+  return 0;
+}
+
+// the commands query_command knows
+void print_query_help(FILE *out) {
+  fprintf(out, "\trecord\n");
+  fprintf(out, "\trecord from yyyymmddhhmm to yyyymmddhhmm\n");
+  fprintf(out, "\tarchive\n");
+  fprintf(out, "\tselect tmp,hmd where rained=2 and tmp>150 group by hour\n");
+  fprintf(out, "\trollup hour|day|month [from yyyymmddhhmm to yyyymmddhhmm]\n");
+  fprintf(out, "\thist t\n");
+  fprintf(out, "\thist p\n");
+  fprintf(out, "\thist h\n");
+  fprintf(out, "\thist t|p|h DAYS|decay\n");
+  fprintf(out, "\tquantile t|p|h HOUR FRACTION\n");
+  fprintf(out, "\tstats\n");
+  fprintf(out, "\tmetrics\n");
+  fprintf(out, "\tstation [N [QUERY]]\n");
+}
+
+/*
+ * Picks which of the nstations archives the later queries read with
+ * "station N", runs just one query on station N with "station N QUERY"
+ * (the client's form, a connection per command), or names the current
+ * one with "station"
+ * returns 0 if buf was one of these
+ */
+int station_command(archive_t *archives, int nstations, int *station, const char *buf, FILE *out) {
+  int n, off = 0;
+  if (sscanf(buf, "station %d %n", &n, &off) == 1) {
+    if (n < 0 || n >= nstations || (buf[off] != '\0' && query_command(&archives[n], buf + off, out))) {
+      fprintf(out, "Usage: station 0-%d [QUERY]\n", nstations - 1);
+    } else if (buf[off] == '\0') {
+      *station = n;
+      fprintf(out, "Querying station %d\n", n);
+    }
+  } else if (matches(buf, "station")) {
+    fprintf(out, "Querying station %d of %d\n", *station, nstations);
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+// query_command for the query server's clients, anything else gets the list
+int serve_command(archive_t *archives, int narchives, int *station, const char *line, FILE *out) {
+  if (station_command(archives, narchives, station, line, out) && query_command(&archives[*station], line, out)) {
+    fprintf(out, "Available commands: \n");
+    print_query_help(out);
+    fprintf(out, "\n");
+  }
+  return 0;
+}
+
 /* Foreground process run in the child.
  * Takes care of taking user input and sending
  * the appropriate commands to the background process.
  * Some commands require a reply from the parent and
  * some just print visualization info.
  */
-void main_loop_cli(char *record, char **hists) {
-  /* We only want to SEND signals and READ data */
-  //0 is the read side for both pipes and 1 is the write side
-    close(signal_pipe[0]);
-    close(data_pipe[1]);
-
+void main_loop_cli(archive_t *archives, int narchives) {
+  /* We only push to the command ring and pop from the reply ring */
+  command_t cmd;
+  // the station queries and env go to
+  int station = 0;
   char* buf;
   size_t buffer_size = 10 * sizeof(char);
   buf = (char *) malloc(buffer_size);
@@ -160,63 +455,53 @@ void main_loop_cli(char *record, char **hists) {
     printf("USER INPUT: %s\n", buf);
 
     /* Compares user input with each option on the help menu */
+    cmd.msg = 0;
+    cmd.extra = 0;
     if (matches(buf, "resume")){
-        write(signal_pipe[1], "resume", strlen("resume"));
+        cmd.msg = RESUME;
 
     }
     else if (matches(buf, "pause")) {
-        write(signal_pipe[1], "pause", strlen("pause"));
+        cmd.msg = PAUSE;
 
     }
     else if (matches(buf, "exit")) {
-        write(signal_pipe[1], "exit", strlen("exit"));
+        cmd.msg = EXIT;
+        cmd_push(cmd_ring, &cmd);
         exit(1);
 
     }
     else if (buf[0] == 'b' && buf[1] == 'l' && buf[2] == 'i' 
             && buf[3] == 'n' && buf[4] == 'k' && buf[5] == ' ') {
-        write(signal_pipe[1], buf, strlen(buf));
+        cmd.msg = BLINK;
+        cmd.extra = atoi(buf + 6);
 
     }
     else if (matches(buf, "env")) {
-        write(signal_pipe[1], "env", strlen("env"));
+        cmd.msg = REQUEST;
+        cmd.extra = station;
+        if (cmd_push(cmd_ring, &cmd)) {
+            printf("Command queue is full\n");
+            continue;
+        }
+        cmd.msg = 0;
 
         /* For reading data back from the Arduino */
-        char data_reply[17]; 
-        data_reply[16] = '\0';
-        int consumed = 0;
-        int res = 0;
-        while (consumed < 16) {
-            res = read(data_pipe[0], data_reply + (consumed * sizeof(char)), 16 - consumed);
-            if (res >= 0) {
-                consumed += res;
-            } else {
-                perror("Issue reading from data_pipe");
-                exit(1);
-            }
+        reply_t data_reply;
+        while (!reply_pop(reply_ring, &data_reply)) {
+            reply_wait(reply_ring);
         }
-        printf("\t Arduino Reply: (consumed: %d):  %03u, %03u, %03u, %03u, %.12s\n", consumed, 
-              (unsigned char)data_reply[0], (unsigned char)data_reply[1], 
-              (unsigned char)data_reply[2], (unsigned char)data_reply[3], data_reply + 4);
-
-    }
-    else if (buf[0] == 'h' && buf[1] == 'i' && buf[2] == 's' 
-              && buf[3] == 't' && buf[5] == 't') {
-        print_hist(hists[0]);
+        char stamp[STAMPLEN];
+        format_stamp(data_reply.minute, stamp);
+        printf("\t Arduino Reply: (consumed: %d):  %03u, %03u, %03u, %03u, %.12s\n", REPLYLEN, 
+              data_reply.tmp, data_reply.prs, data_reply.hmd, data_reply.rained, stamp);
 
     }
-    else if (buf[0] == 'h' && buf[1] == 'i' && buf[2] == 's' 
-              && buf[3] == 't' && buf[5] == 'p') {
-        print_hist(hists[1]);
+    else if (station_command(archives, narchives, &station, buf, stdout) == 0) {
 
     }
-    else if (buf[0] == 'h' && buf[1] == 'i' && buf[2] == 's' 
-              && buf[3] == 't' && buf[5] == 'h') {
-        print_hist(hists[2]);
-
-    }
-    else if (matches(buf, "record")) {
-        printf("%s", record);
+    // hist, record, select, ... read the station's archive directly
+    else if (query_command(&archives[station], buf, stdout) == 0) {
 
     }
     // This is for printing the menu
@@ -229,16 +514,17 @@ void main_loop_cli(char *record, char **hists) {
       print_help = 1;
     }
 
+    if (cmd.msg && cmd_push(cmd_ring, &cmd)) {
+      printf("Command queue is full\n");
+    }
+
     if (print_help){
       printf("Available commands: \n");
       printf("\tpause\n");
       printf("\tresume\n");
       printf("\tblink X\n");
       printf("\tenv\n");
-      printf("\trecord\n");
-      printf("\thist t\n");
-      printf("\thist p\n");
-      printf("\thist h\n");
+      print_query_help(stdout);
       //printf("\t*hist t X\n");
       //printf("\t*hist p X\n");
       //printf("\t*hist h X\n");
@@ -251,84 +537,66 @@ void main_loop_cli(char *record, char **hists) {
 
 }    
 
-/* Uses select to wait 1 second for changes in a set of 
- * file descriptors (signal_pipe). If there is a change, 
- * it reads all the contents, filling up buf. 
- * If the buf matches known commands: "resume", "pause", 
- * "exit", "blink X", or "request", assign the correct
- * values to output parameters cmd and extra.
- *   extra would contain the value of X for blink.
- * If select triggered, return a 1.
- * if select doesn't trigger, returns 0;
-*/
-int read_cmd(enum message *cmd, char *extra) {
-  static char buf[1024];
-  static size_t offset = 0;
-  static struct timeval tv;
-  static fd_set readfds;
-  int _extra = 0;
-
-  // reset these values every time we call select
-  tv.tv_usec = 0;
-  tv.tv_sec = 1; //Timeout is one second
-
-  FD_ZERO(&readfds);
-  FD_SET(signal_pipe[0], &readfds);
-  //initialize file descriptors and only read end of signal_pipe)
- 
-
-  //   to be read from signal_pipe
-  if (select(FD_SETSIZE, &readfds, NULL, NULL, &tv)) {
-    // Default return parameters
-    *cmd = 0;
-    *extra = 0;
-    // reads the data from the signal_pipe
-    offset += read(signal_pipe[0], buf + offset, 1024 - offset);
-    // loop for seeking any matches between "/n" in buf
-    while (1) {
-      // check the buffer for our key words
-
-      if (matches(buf, "resume")) {
-        *cmd = RESUME;
-
-      } else if (matches(buf, "pause")) {
-        *cmd = PAUSE;
-
-      } else if (matches(buf, "exit")) {
-        *cmd = EXIT;
-        exit(1);
+/* maps the t/p/h channel letters to the index used by names[] */
+int channel_index(char c) {
+  switch (c) {
+  case 't':
+    return 0;
+  case 'p':
+    return 1;
+  case 'h':
+    return 2;
+  default:
+    return -1;
+  }
+}
 
-      } else if (sscanf(buf, "blink %d", &_extra) == 1) {
-        *cmd = BLINK;
-        *extra = (char)_extra; //stores blink frequency 
-       
-      } else if (matches(buf, "env")) {
-        *cmd = REQUEST;
+/*
+ * Sets a sampling period from -p [DEV:]CHANNEL:MS
+ * returns 0 if spec was valid
+ */
+int parse_period(const char *spec) {
+  int dev = -1, n = 0;
+  char channel;
+  long ms;
 
-      }
+  if (sscanf(spec, "%d:%c:%ld%n", &dev, &channel, &ms, &n) != 3 &&
+      (dev = -1, sscanf(spec, "%c:%ld%n", &channel, &ms, &n) != 2)) {
+    return -1;
+  }
+  int c = channel_index(channel);
+  if (spec[n] != '\0' || c < 0 || ms < 1 || dev >= MAXDEVICES || dev < -1) {
+    return -1;
+  }
+  for (int i = 0; i < MAXDEVICES; i++) {
+    if (dev == -1 || dev == i) {
+      periods_ms[i][c] = ms;
+    }
+  }
+  return 0;
+}
 
-      // reset buffer
-      if (cmd != 0) {
-        offset = 0;
-        memset(buf, 0, 1024);
-        return 1;
-      }
+/*
+ * Sets the record archive's capacity from -a RECORDS[:SEGMENTS[:COLD]]
+ * returns 0 if spec was valid
+ */
+int parse_capacity(const char *spec, record_capacity_t *capacity) {
+  unsigned long records, segments = capacity->max_segments, cold = capacity->cold_segments;
+  int n = 0;
 
-      // If we are unable to find a key word, look for a \n
-      char *nl = strstr(buf, "\n");
-      if (nl) {
-        // shift buf over until nl+1 is the first character
-        size_t shift = nl - buf + 1;
-        offset -= shift;
-        memmove(buf, nl + 1, offset);
-        memset(buf + offset, 0, 1024 - offset);
-      }
-      
-    }
-    return 0;
+  if (sscanf(spec, "%lu:%lu:%lu%n", &records, &segments, &cold, &n) != 3 &&
+      sscanf(spec, "%lu:%lu%n", &records, &segments, &n) != 2 && sscanf(spec, "%lu%n", &records, &n) != 1) {
+    return -1;
+  }
+  if (spec[n] != '\0' || records < 1 || records > UINT32_MAX / RECORDLEN || segments < 1 || segments > UINT32_MAX ||
+      cold > UINT32_MAX) {
+    return -1;
   }
+  capacity->seg_records = records;
+  capacity->max_segments = segments;
+  capacity->cold_segments = cold;
   return 0;
-}  
+}
 
 /* string compare method*/
 int matches(const char *buf, const char *prefix) {
@@ -339,135 +607,594 @@ int matches(const char *buf, const char *prefix) {
   return 0;
 }
 
-/* Background process that performs the following sequence:
- * uses read_cmd to check if the user sent a commad.
- *   if there is a command, it sends it (cmd) 
- * and possibly the "extra" char over Serial to the Arduino.
- * if the command was not to pause, and a second has passed, 
- *   then request data from Serial, read the result into buf.
- *   (Always 16 bytes), and increase the num_readings.
- *   Then update each hist and the record. If the command was 
- *   "request", then Also send the reply through the data_pipe.  , 
- * This performs 24 readings over 3 days. 
+/*
+ * Tags stored in epoll_event.data.u32 so the loop knows which
+ * file descriptor woke it up. Devices use their index.
  */
-void main_loop_data(int tty_fd, char *record, char **hists) {
-  enum message msg = 0;
-  char to_send[2] = {0, 0};
+#define TAG_TIMER (MAXDEVICES + 0)
+#define TAG_CMD (MAXDEVICES + 1)
+
+// how long a device may stay AWAITING before its partial reply is dropped
+#define MAX_STALE_MS 3000
+
+int watch_fd(int epfd, int fd, uint32_t tag) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.u32 = tag;
+  return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/*
+ * Insert a complete reply from dev into the archive and,
+ * if the CLI asked for it, push it onto the reply ring.
+ */
+void handle_reply(struct device *dev, archive_t *archive) {
+  char *reply = dev->reply;
+
+  /*
+   * Format of the DATA frame payload as follows
+   * BYTE # | VALUE
+   * 0      | Temp reading (between 0 and 255)
+   * 1      | Pressure reading (0-255)
+   * 2      | Humidity reading (0-255)
+   * 3      | Rain - 0 means no observation, 1 means no rain, 2 means rain
+   * 4      | timestamp year index 0 (ISO-8601)
+   * 5      | timestamp year index 1 (ISO-8601)
+   * 6      | timestamp year index 2 (ISO-8601)
+   * 7      | timestamp year index 3 (ISO-8601)
+   * 8      | timestamp month index 0 (ISO-8601)
+   * 9      | timestamp month index 1 (ISO-8601)
+   * 10     | timestamp day index 0 (ISO-8601)
+   * 11     | timestamp day index 1 (ISO-8601)
+   * 12     | timestamp hour index 0 (ISO-8601)
+   * 13     | timestamp hour index 1 (ISO-8601)
+   * 14     | timestamp minute index 0 (ISO-8601)
+   * 15     | timestamp minute index 1 (ISO-8601)
+   *
+   * e.g.
+   * 202001010600 represents January 1st 2020 at exactly 6 AM
+   *
+   * The timestamp is parsed once here into a minute epoch,
+   * everything downstream works on the packed reading; one that is not
+   * a date (the CRC only vouches for the bytes) drops the reading
+   */
+
+  // Debug print
+  // printf("\t Got: %03u, %03u, %03u, %03u, %.12s\n", (unsigned char)reply[0],
+  // 	(unsigned char)reply[1], (unsigned char)reply[2],
+  // 	(unsigned char)reply[3], reply + 4);
+
+  /*
+   * Insert new sensor reading into hists and record data structures
+   * (and the write-ahead log, depending on the durability mode)
+   */
+  record_t reading;
+  reading.minute = parse_stamp(reply + 4);
+  if (reading.minute == STAMP_INVALID) {
+    metric_add(COUNTER_BAD_STAMPS, 1);
+    return;
+  }
+  reading.tmp = reply[0];
+  reading.prs = reply[1];
+  reading.hmd = reply[2];
+  reading.rained = reply[3];
+  ingest_reading(archive, &reading);
+
+  /* Now reply to client if the message was REQUEST */
+  if (dev->want_reply) {
+    uint64_t t = metric_start();
+    if (reply_push(reply_ring, &reading)) {
+      metric_add(COUNTER_REPLY_DROPPED, 1);
+    }
+    metric_lap(STAGE_REPLY_PUSH, t);
+    dev->want_reply = 0;
+  }
+}
+
+/*
+ * Asks dev for n readings, timing the write and
+ * remembering when so the round trip can be timed too
+ */
+void request_readings(struct device *dev, int n, uint64_t *sent_at) {
+  uint64_t t = metric_start();
+  dev_request(dev, n);
+  *sent_at = metric_lap(STAGE_SERIAL_WRITE, t);
+  metric_add(COUNTER_REQUESTS, 1);
+}
+
+/*
+ * Copies the counters the devices keep into the shared metrics
+ */
+void collect_device_metrics(struct device *devs, int ndevs) {
+  uint64_t short_reads = 0, bad_frames = 0;
+  for (int i = 0; i < ndevs; i++) {
+    short_reads += devs[i].short_reads;
+    bad_frames += devs[i].parser.bad_frames;
+  }
+  metric_set(COUNTER_SHORT_READS, short_reads);
+  metric_set(COUNTER_BAD_FRAMES, bad_frames);
+}
+
+/* Background process built around a single event loop that
+ * multiplexes every serial device, the command ring's eventfd and the
+ * scheduler's timerfd.
+ *   - command ring signalled: pop the queued user commands and
+ *     forward them (and possibly the "extra" char) to the Arduinos.
+ *     "env" requests a reading from the first device right away
+ *     and its reply is pushed onto the reply ring.
+ *   - timerfd expired: every channel of every device has a deadline
+ *     of its own (-p); a device one of whose channels is due is asked
+ *     for a batch of readings unless it is paused or still answering.
+ *     A housekeeping job commits each archive if its group has gotten
+ *     old enough and dumps the metrics.
+ *   - device readable: run its bytes through the frame parser and
+ *     update each hist and the record for every DATA frame.
+ * The process sleeps in between, so it uses no CPU while idle and
+ * commands are handled as soon as they arrive.
+ * It samples until told to exit, or until every device has failed or
+ * given max_readings readings (-r).
+ *
+ * The loop waits in epoll_wait and reads and writes with plain system
+ * calls, or (-i uring) keeps a read outstanding on every descriptor of
+ * an io_uring and queues its REQUEST frames there, so a wakeup costs
+ * one io_uring_enter however many devices it serves.  Either way each
+ * station's write-ahead log gets one write per wakeup, after which the
+ * wakeup's readings are applied (archive_flush).
+ *
+ * A DATA frame always carries all three channels, so a due channel
+ * polls its whole device and the reading is archived whole; the
+ * periods decide how often each device is polled, and deadlines are
+ * accounted per channel.
+ */
+// the Prometheus text dump, rewritten every METRICS_DUMP_TICKS housekeeping runs
+#define METRICS_FILE "metrics.prom"
+#define METRICS_DUMP_TICKS 10
+#define HOUSEKEEPING_MS 1000
+// sched_job_t owner of the housekeeping job, devices use their index
+#define JOB_HOUSEKEEPING -1
+
+#define URING_ENTRIES 64
+// what one read of a device may bring in
+#define URING_RXBUF 4096
+// user_data of a write, with the device's tag in the low bits
+#define URING_WRITE (1ULL << 32)
+
+typedef struct {
+  uring_t ring;
+  unsigned char rx[MAXDEVICES][URING_RXBUF];
+  unsigned char tx[MAXDEVICES][FRAME_MAXLEN];
+  // length of the frame being written from tx, 0 once it is free
+  int tx_len[MAXDEVICES];
+  uint64_t timer_buf;
+  uint64_t cmd_buf;
+} uring_io_t;
+
+// state of the data loop, whichever backend runs it
+typedef struct {
+  struct device *devs;
+  int ndevs;
+  // device i's readings go to archives[i]
+  archive_t *archives;
+  int is_paused;
+  int active;
+  uint64_t ticks;
+  // when each device's outstanding REQUEST was written
+  uint64_t sent_at[MAXDEVICES];
+  // the timer wakeup each device was last polled in
+  uint64_t polled[MAXDEVICES];
+  uint64_t timer_wakeups;
+  scheduler_t sched;
+  // NULL on the epoll backend
+  uring_io_t *io;
+} data_loop_t;
+
+// whether dev is to be polled no more: failed or given all its readings
+int dev_done(const struct device *dev) {
+  return dev->state == DEV_FAILED || (max_readings && dev->num_readings >= max_readings);
+}
+
+// the readings to ask dev for in one round trip
+int dev_batch(const struct device *dev) {
+  if (max_readings && max_readings - dev->num_readings < batch_size) {
+    return max_readings - dev->num_readings;
+  }
+  return batch_size;
+}
+
+void print_schedule(scheduler_t *sched) {
+  for (int j = 0; j < sched->njobs; j++) {
+    sched_job_t *job = &sched->jobs[j];
+    if (job->owner != JOB_HOUSEKEEPING) {
+      printf("Device %d %s every %llu ms: %llu deadlines, %llu missed\n", job->owner, names[job->channel],
+             (unsigned long long)(job->period_ns / 1000000), (unsigned long long)(job->fired + job->missed),
+             (unsigned long long)job->missed);
+    }
+  }
+}
+
+// a free submission entry, submitting what is queued if there is none
+struct io_uring_sqe *uring_io_sqe(uring_io_t *io) {
+  struct io_uring_sqe *sqe;
+  while ((sqe = uring_sqe(&io->ring)) == NULL) {
+    uring_enter(&io->ring, 0);
+  }
+  return sqe;
+}
+
+void uring_io_read(uring_io_t *io, int fd, void *buf, unsigned len, uint32_t tag) {
+  uring_prep(uring_io_sqe(io), IORING_OP_READ, fd, buf, len, -1, tag);
+}
+
+/*
+ * Asks device i for n readings: on the ring when its frame buffer is
+ * free, with a plain write otherwise.
+ * A write on the ring only completes visibly if it fails, so its buffer
+ * is taken until the batch is in (which it cannot be before the write
+ * is) or the write is reported.
+ */
+void loop_request(data_loop_t *l, int i, int n) {
+  uring_io_t *io = l->io;
+  if (io == NULL || io->tx_len[i]) {
+    request_readings(&l->devs[i], n, &l->sent_at[i]);
+    return;
+  }
+  char count = (char)n;
+  struct io_uring_sqe *sqe = uring_io_sqe(io);
+  io->tx_len[i] = frame_encode(REQUEST, &count, 1, io->tx[i]);
+  uring_prep(sqe, IORING_OP_WRITE, l->devs[i].fd, io->tx[i], io->tx_len[i], -1, URING_WRITE | i);
+  uring_quiet(&io->ring, sqe);
+  dev_expect(&l->devs[i], n);
+  l->sent_at[i] = metric_start();
+  metric_add(COUNTER_REQUESTS, 1);
+}
+
+// pops every command the user queued and writes them to the Arduinos
+void loop_commands(data_loop_t *l) {
+  command_t cmd;
   char extra = 0;
-  time_t next_time = 0;
-  int is_paused = 0;
-  int num_readings = 0;
 
-  /* We only want to READ signals and SEND data */
-  close(signal_pipe[1]);
-  close(data_pipe[0]);
+  uint64_t depth = RING_LOAD(&cmd_ring->tail) - cmd_ring->head;
+  metric_set(COUNTER_CMD_DEPTH, depth);
+  if (metrics && depth > metrics->counters[COUNTER_CMD_DEPTH_MAX]) {
+    metric_set(COUNTER_CMD_DEPTH_MAX, depth);
+  }
+  while (cmd_pop(cmd_ring, &cmd)) {
+    metric_add(COUNTER_COMMANDS, 1);
+    if (cmd.msg == EXIT) {
+      // leave through the cleanup so the archive gets a final flush
+      l->active = 0;
+      break;
 
-  printf("Beginning Sensor Reading\n");
-  while (num_readings < 3 * 24) {
-    /*
-     * Check if the user has written in a valid command 
-     * and writes to the Arduino
-     */
-        if((read_cmd(&msg, &extra) == 0)) {
-          if (msg == RESUME) {
-            write(tty_fd, &msg, sizeof(msg));
-            is_paused = 0;
-      
-          } else if (msg == PAUSE) {
-              write(tty_fd, &msg, sizeof(msg));
-              is_paused = 1;
+    } else if (cmd.msg == RESUME || cmd.msg == PAUSE) {
+      for (int i = 0; i < l->ndevs; i++) {
+        dev_send(&l->devs[i], cmd.msg, NULL, 0);
+      }
+      l->is_paused = (cmd.msg == PAUSE);
 
-          } else if (msg == EXIT) {
-              exit(1);
+    } else if (cmd.msg == BLINK) {
+      extra = (char)cmd.extra;
+      for (int i = 0; i < l->ndevs; i++) {
+        dev_send(&l->devs[i], BLINK, &extra, 1);
+      }
 
-          } else if (msg == BLINK) {
-              to_send[0] = msg;
-              to_send[1] = extra;
+    } else if (cmd.msg == REQUEST && cmd.extra >= 0 && cmd.extra < l->ndevs) {
+      l->devs[cmd.extra].want_reply = 1;
+      if (l->devs[cmd.extra].state == DEV_IDLE) {
+        loop_request(l, cmd.extra, 1);
+      }
+    }
+  }
+}
 
-              send_msg(to_send, 2, tty_fd);
+/*
+ * Runs every job that is due and arms the timer for the next one
+ * returns 0 on success
+ */
+int loop_deadlines(data_loop_t *l) {
+  scheduler_t *sched = &l->sched;
+  uint64_t now = sched_now(), late;
+  int j;
 
-          } else if (msg == REQUEST) {
-              write(tty_fd, &msg, sizeof(msg));
+  l->timer_wakeups++;
+  while ((j = sched_next(sched, now, &late)) >= 0) {
+    sched_job_t *job = &sched->jobs[j];
+    metric_add(COUNTER_DEADLINES, 1);
+    if (metrics) {
+      metric_record(STAGE_SCHEDULE_LAG, late / metrics->ns_per_tick);
+    }
 
-          }
+    if (job->owner == JOB_HOUSEKEEPING) {
+      // a group that is old enough is committed even without new readings
+      for (int i = 0; i < l->ndevs; i++) {
+        if (durability_due(&l->archives[i].durability, 0)) {
+          archive_commit(&l->archives[i]);
         }
+      }
+      if (++l->ticks % METRICS_DUMP_TICKS == 0) {
+        collect_device_metrics(l->devs, l->ndevs);
+        dump_metrics(METRICS_FILE);
+      }
+      continue;
+    }
 
     /*
-     * Check if we should request a reading from the user
+     * Poll the job's device, unless another of its channels
+     * already did in this wakeup
      */
-    time_t t;
-    time(&t);
-    
-    if (!is_paused && next_time <= t) {
-      next_time = t + 1;
-
-        write(tty_fd, "2", 1);
-      /*
-       * Format of reply as follows
-       * BYTE # | VALUE
-       * 0      | Temp reading (between 0 and 255)
-       * 1      | Pressure reading (0-255)
-       * 2      | Humidity reading (0-255)
-       * 3      | Rain - 0 means no observation, 1 means no rain, 2 means rain
-       * 4      | timestamp year index 0 (ISO-8601)
-       * 5      | timestamp year index 1 (ISO-8601)
-       * 6      | timestamp year index 2 (ISO-8601)
-       * 7      | timestamp year index 3 (ISO-8601)
-       * 8      | timestamp month index 0 (ISO-8601)
-       * 9      | timestamp month index 1 (ISO-8601)
-       * 10     | timestamp day index 0 (ISO-8601)
-       * 11     | timestamp day index 1 (ISO-8601)
-       * 12     | timestamp hour index 0 (ISO-8601)
-       * 13     | timestamp hour index 1 (ISO-8601)
-       * 14     | timestamp minute index 0 (ISO-8601)
-       * 15     | timestamp minute index 1 (ISO-8601)
-       *
-       * e.g.
-       * 202001010600 represents January 1st 2020 at exactly 6 AM
-       */
-
-      /*
-       * read and accumulate a 16 byte reply
-       * (kept in a null terminated 17 byte buffer)
-       */
-      char reply[17];
-      reply[16] = '\0';
-      int consumed = 0;
-      while (consumed < 16) {
-        int res = read(tty_fd, reply + (consumed * sizeof(char)), 16 - consumed);
-        if (res >= 0) {
-          consumed += res;
-        } else {
-          perror("Issue reading from serial");
-          return;
-        }
+    int i = job->owner;
+    struct device *dev = &l->devs[i];
+    if (dev_done(dev) || l->is_paused || l->polled[i] == l->timer_wakeups) {
+      continue;
+    }
+    if (dev->state == DEV_AWAITING && now_ms() - dev->requested_ms < MAX_STALE_MS) {
+      // still answering the last poll, this deadline goes unserved
+      sched_miss(sched, j);
+      continue;
+    }
+    // idle, or a batch that never completed: ask again
+    if (dev->state == DEV_AWAITING) {
+      metric_add(COUNTER_DROPPED, dev->pending);
+    }
+    loop_request(l, i, dev_batch(dev));
+    l->polled[i] = l->timer_wakeups;
+  }
+  uint64_t missed = 0;
+  for (j = 0; j < sched->njobs; j++) {
+    missed += sched->jobs[j].missed;
+  }
+  metric_set(COUNTER_DEADLINES_MISSED, missed);
+  if (sched_arm(sched)) {
+    perror("Error arming the sampling timer");
+    return -1;
+  }
+  return 0;
+}
+
+// archives the reading device i just completed
+void loop_reply(data_loop_t *l, int i) {
+  struct device *dev = &l->devs[i];
+  handle_reply(dev, &l->archives[i]);
+  if (max_readings && dev->num_readings == max_readings) {
+    l->active--;
+  }
+}
+
+// writes each station's log batch and applies the readings it held back
+void loop_flush(data_loop_t *l) {
+  for (int i = 0; i < l->ndevs; i++) {
+    archive_flush(&l->archives[i]);
+  }
+}
+
+// after device i's input is drained: times the round trip if the batch is in
+void loop_received(data_loop_t *l, int i) {
+  if (l->devs[i].state == DEV_IDLE && l->sent_at[i]) {
+    metric_lap(STAGE_ROUND_TRIP, l->sent_at[i]);
+    l->sent_at[i] = 0;
+  }
+  if (l->io && l->devs[i].state == DEV_IDLE) {
+    l->io->tx_len[i] = 0;
+  }
+}
+
+void loop_failed(data_loop_t *l, int i) {
+  perror("Issue reading from serial");
+  if (!dev_done(&l->devs[i])) {
+    l->active--;
+  }
+  l->devs[i].state = DEV_FAILED;
+}
+
+void main_loop_epoll(data_loop_t *l) {
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd == -1) {
+    perror("Error creating epoll instance");
+    return;
+  }
+  if (watch_fd(epfd, l->sched.timer_fd, TAG_TIMER) || watch_fd(epfd, cmd_ring->event_fd, TAG_CMD)) {
+    perror("Error registering with epoll");
+    close(epfd);
+    return;
+  }
+  for (int i = 0; i < l->ndevs; i++) {
+    if (watch_fd(epfd, l->devs[i].fd, i)) {
+      perror("Error registering serial with epoll");
+      close(epfd);
+      return;
+    }
+  }
+
+  printf("Beginning Sensor Reading\n");
+  while (l->active > 0) {
+    struct epoll_event events[MAXDEVICES + 2];
+    int nev = epoll_wait(epfd, events, MAXDEVICES + 2, -1);
+    if (nev == -1) {
+      if (errno == EINTR) {
+        continue;
       }
+      perror("Error waiting on epoll");
+      break;
+    }
 
-      // Debug print
-      // printf("\t Got: %03u, %03u, %03u, %03u, %.12s\n", (unsigned char)reply[0], 
-      // 	(unsigned char)reply[1], (unsigned char)reply[2], 
-      // 	(unsigned char)reply[3], reply + 4);
+    for (int e = 0; e < nev; e++) {
+      uint32_t tag = events[e].data.u32;
 
-      num_readings++;
+      if (tag == TAG_CMD) {
+        uint64_t wakeups;
+        read(cmd_ring->event_fd, &wakeups, sizeof(wakeups));
+        loop_commands(l);
 
-      /*
-       * Insert new sensor reading into hists and record data structures
-       */
-      int time = (reply[12] - '0') * 10 + (reply[13] - '0');
-      for (int i = 0; i < 3; i++) {
-        // hist only needs the hour between 0 and 23
-       update_hist(hists[i], reply[i], time);
+      } else if (tag == TAG_TIMER) {
+        uint64_t expirations;
+        if (read(l->sched.timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+          continue;
+        }
+        if (loop_deadlines(l)) {
+          l->active = 0;
+        }
 
+      } else if (tag < (uint32_t)l->ndevs) {
+        struct device *dev = &l->devs[tag];
+        int res;
+        uint64_t t = metric_start();
+        while ((res = dev_recv(dev)) == 1) {
+          metric_lap(STAGE_SERIAL_READ, t);
+          loop_reply(l, tag);
+          t = metric_start();
+        }
+        metric_lap(STAGE_SERIAL_READ, t);
+        loop_received(l, tag);
+        if (res == -1 || (events[e].events & (EPOLLHUP | EPOLLERR))) {
+          epoll_ctl(epfd, EPOLL_CTL_DEL, dev->fd, NULL);
+          loop_failed(l, tag);
+        }
       }
-      update_record(record, reply[0], reply[1], reply[2], reply[3], reply + 4);
+    }
+    loop_flush(l);
+  }
+  close(epfd);
+}
+
+/*
+ * The io_uring backend: reads stay outstanding on every device, the
+ * timer and the command eventfd, and are queued again as they complete,
+ * so each wakeup is a single io_uring_enter that also submits whatever
+ * REQUEST frames the last one queued.
+ * The descriptors are made blocking (a tty waiting for at least one
+ * byte) so their reads wait in the kernel rather than fail with EAGAIN.
+ * returns -1 without having run if there is no io_uring
+ */
+int main_loop_uring(data_loop_t *l) {
+  uring_io_t *io = calloc(1, sizeof(uring_io_t));
+  int err;
+  if (io == NULL || (err = uring_init(&io->ring, URING_ENTRIES)) < 0) {
+    fprintf(stderr, "No io_uring (%s), using epoll\n", io ? strerror(-err) : "out of memory");
+    free(io);
+    return -1;
+  }
+  l->io = io;
+
+  for (int i = 0; i < l->ndevs; i++) {
+    struct termios tty;
+    int fd = l->devs[i].fd;
+    if (tcgetattr(fd, &tty) == 0) {
+      tty.c_cc[VMIN] = 1;
+      tcsetattr(fd, TCSANOW, &tty);
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    uring_io_read(io, fd, io->rx[i], URING_RXBUF, i);
+  }
+  fcntl(l->sched.timer_fd, F_SETFL, fcntl(l->sched.timer_fd, F_GETFL) & ~O_NONBLOCK);
+  uring_io_read(io, l->sched.timer_fd, &io->timer_buf, sizeof(io->timer_buf), TAG_TIMER);
+  uring_io_read(io, cmd_ring->event_fd, &io->cmd_buf, sizeof(io->cmd_buf), TAG_CMD);
+
+  printf("Beginning Sensor Reading\n");
+  while (l->active > 0) {
+    struct io_uring_cqe cqe;
+    int res = uring_enter(&io->ring, 1);
+    if (res < 0 && res != -EINTR) {
+      errno = -res;
+      perror("Error waiting on io_uring");
+      break;
+    }
 
-      /* Now reply to client if the message was REQUEST */
-        if(msg == REQUEST) {
-            write(data_pipe[1], reply, 17);
+    while (l->active > 0 && uring_peek(&io->ring, &cqe)) {
+      uint32_t tag = cqe.user_data & 0xFFFFFFFF;
+
+      if (cqe.user_data & URING_WRITE) {
+        /*
+         * Failed (the device is asked again once it has gone stale),
+         * or any write on a kernel that reports them all; a short
+         * one finishes the plain way
+         */
+        if (cqe.res >= 0 && cqe.res < io->tx_len[tag]) {
+          dev_write(&l->devs[tag], io->tx[tag] + cqe.res, io->tx_len[tag] - cqe.res);
+        }
+        io->tx_len[tag] = 0;
+
+      } else if (tag == TAG_CMD) {
+        loop_commands(l);
+        uring_io_read(io, cmd_ring->event_fd, &io->cmd_buf, sizeof(io->cmd_buf), TAG_CMD);
+
+      } else if (tag == TAG_TIMER) {
+        if (loop_deadlines(l)) {
+          l->active = 0;
+        }
+        uring_io_read(io, l->sched.timer_fd, &io->timer_buf, sizeof(io->timer_buf), TAG_TIMER);
+
+      } else if (tag < (uint32_t)l->ndevs) {
+        struct device *dev = &l->devs[tag];
+        if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+          uring_io_read(io, dev->fd, io->rx[tag], URING_RXBUF, tag);
+          continue;
+        }
+        // with VMIN = 1 an empty read is a hangup
+        if (cqe.res <= 0) {
+          errno = cqe.res ? -cqe.res : EPIPE;
+          loop_failed(l, tag);
+          continue;
+        }
+        uint64_t t = metric_start();
+        if (cqe.res < FRAME_HEADER + REPLYLEN + FRAME_TRAILER) {
+          dev->short_reads++;
         }
-      /* Resets msg to 0 */
-        msg = 0;
+        for (int off = 0; off < cqe.res;) {
+          off += dev_feed(dev, io->rx[tag] + off, cqe.res - off);
+          while (dev_next(dev)) {
+            metric_lap(STAGE_SERIAL_READ, t);
+            loop_reply(l, tag);
+            t = metric_start();
+          }
+        }
+        metric_lap(STAGE_SERIAL_READ, t);
+        loop_received(l, tag);
+        uring_io_read(io, dev->fd, io->rx[tag], URING_RXBUF, tag);
+      }
     }
+    loop_flush(l);
+  }
+
+  uring_destroy(&io->ring);
+  free(io);
+  l->io = NULL;
+  return 0;
+}
+
+void main_loop_data(struct device *devs, int ndevs, archive_t *archives) {
+  data_loop_t *l = calloc(1, sizeof(data_loop_t));
+  if (l == NULL) {
+    perror("Error allocating the data loop");
+    return;
   }
-  printf("DONE with parent LOOP\n");
+  l->devs = devs;
+  l->ndevs = ndevs;
+  l->archives = archives;
+  l->active = ndevs;
+  if (sched_init(&l->sched)) {
+    free(l);
+    return;
+  }
+
+  // every job is due right away
+  int jobs_ok = sched_add(&l->sched, JOB_HOUSEKEEPING, 0, HOUSEKEEPING_MS) >= 0;
+  for (int i = 0; i < ndevs; i++) {
+    for (int c = 0; c < 3; c++) {
+      jobs_ok &= sched_add(&l->sched, i, c, periods_ms[i][c]) >= 0;
+    }
+  }
+  if (!jobs_ok || sched_arm(&l->sched)) {
+    perror("Error scheduling sampling");
+  } else {
+    if (!use_uring || main_loop_uring(l)) {
+      main_loop_epoll(l);
+    }
+    printf("DONE with parent LOOP\n");
+    print_schedule(&l->sched);
+    collect_device_metrics(devs, ndevs);
+    dump_metrics(METRICS_FILE);
+  }
+
+  sched_destroy(&l->sched);
+  free(l);
 }
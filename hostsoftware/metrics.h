@@ -0,0 +1,252 @@
+#ifndef metrics_h_
+#define metrics_h_
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+ * Latency histograms and counters for the data loop, in memory shared
+ * with the CLI process so 'metrics' can print them while ingest runs.
+ *
+ * Stage latencies are measured in ticks of the TSC where there is one
+ * (CLOCK_MONOTONIC_RAW nanoseconds otherwise) and counted in log2
+ * buckets: bucket b holds latencies in [2^(b-1), 2^b) ticks, so a sample
+ * is one clz and one increment.  Ticks are converted to nanoseconds only
+ * when printing, with a rate calibrated in construct_metrics.
+ * The stages every reading goes through take a few dozen nanoseconds,
+ * about what reading the clock costs, so only one reading in
+ * METRIC_SAMPLE is timed there; their counts are samples, not readings.
+ *
+ * Only the data process writes; every field is a naturally aligned
+ * 64 bit word, so readers see each value whole, if not all of them from
+ * the same instant.
+ */
+#define METRIC_BUCKETS 48
+#define METRIC_SAMPLE 16
+
+enum metric_stage {
+  STAGE_SERIAL_WRITE, // writing a REQUEST frame
+  STAGE_ROUND_TRIP,   // REQUEST written until its last DATA frame arrived
+  STAGE_SERIAL_READ,  // one dev_recv call: read(2) and frame parsing
+  STAGE_WAL,          // appending to the write-ahead log (sampled)
+  STAGE_HIST,         // update_hist, update_quantile and update_hist_window, all channels (sampled)
+  STAGE_RECORD,       // update_record (sampled)
+  STAGE_ROLLUP,       // update_rollup, all tiers (sampled)
+  STAGE_STATS,        // update_stats (sampled)
+  STAGE_COMMIT,       // handing a group to the durability engine
+  STAGE_REPLY_PUSH,   // pushing a reading onto the reply ring
+  STAGE_SCHEDULE_LAG, // a sampling deadline until the loop took it
+  NSTAGES
+};
+
+enum metric_counter {
+  COUNTER_READINGS,      // readings ingested
+  COUNTER_REQUESTS,      // REQUEST frames written
+  COUNTER_SHORT_READS,   // serial reads shorter than one DATA frame
+  COUNTER_BAD_FRAMES,    // frames dropped by the parser (CRC or length)
+  COUNTER_BAD_STAMPS,    // DATA frames dropped at ingest for a timestamp that is not a date
+  COUNTER_DROPPED,       // readings of batches abandoned as stale
+  COUNTER_REPLY_DROPPED, // readings the CLI asked for but the reply ring was full
+  COUNTER_COMMANDS,      // commands popped off the command ring
+  COUNTER_CMD_DEPTH,     // command ring depth at the last wakeup
+  COUNTER_CMD_DEPTH_MAX, // deepest the command ring has been
+  COUNTER_DEADLINES,     // sampling deadlines taken off the scheduler
+  COUNTER_DEADLINES_MISSED, // deadlines slept through or whose device was still answering
+  NCOUNTERS
+};
+
+typedef struct {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[METRIC_BUCKETS];
+} latency_hist_t;
+
+typedef struct {
+  double ns_per_tick;
+  uint64_t samples;
+  latency_hist_t stages[NSTAGES];
+  uint64_t counters[NCOUNTERS];
+} metrics_t;
+
+const char *stage_names[NSTAGES] = {"serial_write", "round_trip", "serial_read", "wal", "hist",
+                                    "record", "rollup", "stats", "commit", "reply_push", "schedule_lag"};
+const char *counter_names[NCOUNTERS] = {"readings", "requests", "short_reads", "bad_frames", "bad_stamps",
+                                        "dropped_readings", "reply_dropped", "commands", "cmd_queue_depth",
+                                        "cmd_queue_depth_max", "deadlines", "deadlines_missed"};
+
+// NULL until construct_metrics, every metric_* call is a no-op then
+metrics_t *metrics;
+
+uint64_t metrics_raw_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t metric_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return metrics_raw_ns();
+#endif
+}
+
+/*
+ * Start of a timed section: 0 (and every metric_lap from it a no-op)
+ * when metrics are off, otherwise the current time
+ */
+uint64_t metric_start(void) { return metrics ? metric_now() : 0; }
+
+// like metric_start, but only for one call in METRIC_SAMPLE
+uint64_t metric_start_sampled(void) {
+  if (!metrics || metrics->samples++ % METRIC_SAMPLE) {
+    return 0;
+  }
+  return metric_now();
+}
+
+void metric_record(enum metric_stage stage, uint64_t ticks) {
+  latency_hist_t *h = &metrics->stages[stage];
+  int b = ticks ? 64 - __builtin_clzll(ticks) : 0;
+  h->buckets[b < METRIC_BUCKETS ? b : METRIC_BUCKETS - 1]++;
+  h->count++;
+  h->sum += ticks;
+  h->max = ticks > h->max ? ticks : h->max;
+}
+
+// records the time since start against stage and returns the current time
+uint64_t metric_lap(enum metric_stage stage, uint64_t start) {
+  if (!start) {
+    return 0;
+  }
+  uint64_t now = metric_now();
+  metric_record(stage, now - start);
+  return now;
+}
+
+void metric_add(enum metric_counter counter, uint64_t n) {
+  if (metrics) {
+    metrics->counters[counter] += n;
+  }
+}
+
+void metric_set(enum metric_counter counter, uint64_t v) {
+  if (metrics) {
+    metrics->counters[counter] = v;
+  }
+}
+
+/*
+ * Maps the metrics into memory shared with processes forked afterwards
+ * and calibrates the tick rate against CLOCK_MONOTONIC_RAW
+ * returns 0 on success
+ */
+int construct_metrics(void) {
+  metrics_t *m = mmap(0, sizeof(metrics_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (m == MAP_FAILED) {
+    perror("Error mapping metrics");
+    return -1;
+  }
+  memset(m, 0, sizeof(*m));
+
+  struct timespec pause = {0, 20 * 1000 * 1000};
+  uint64_t ns0 = metrics_raw_ns();
+  uint64_t t0 = metric_now();
+  nanosleep(&pause, NULL);
+  uint64_t ns1 = metrics_raw_ns();
+  uint64_t t1 = metric_now();
+  m->ns_per_tick = (t1 > t0) ? (double)(ns1 - ns0) / (t1 - t0) : 1.0;
+
+  metrics = m;
+  return 0;
+}
+
+// latency below which a fraction p of the samples fall, in nanoseconds
+double latency_quantile(const latency_hist_t *h, double p) {
+  uint64_t rank = (uint64_t)(p * h->count + 0.999999);
+  uint64_t seen = 0;
+  for (int b = 0; b < METRIC_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen >= rank && seen > 0) {
+      uint64_t upper = b ? (1ULL << b) - 1 : 0;
+      return (upper < h->max ? upper : h->max) * metrics->ns_per_tick;
+    }
+  }
+  return h->max * metrics->ns_per_tick;
+}
+
+/*
+ * Prints every stage's latency summary and the counters
+ */
+int print_metrics(FILE *out) {
+  fprintf(out, "Stage             count    mean ns     p50 ns     p99 ns     max ns   (sampled stages: 1 in %d)\n",
+          METRIC_SAMPLE);
+  fprintf(out, "-------------------------------------------------------------------\n");
+  for (int s = 0; s < NSTAGES; s++) {
+    const latency_hist_t *h = &metrics->stages[s];
+    if (h->count == 0) {
+      fprintf(out, "%-12s %10s\n", stage_names[s], "0");
+      continue;
+    }
+    fprintf(out, "%-12s %10llu %10.0f %10.0f %10.0f %10.0f\n", stage_names[s], (unsigned long long)h->count,
+            (double)h->sum / h->count * metrics->ns_per_tick, latency_quantile(h, 0.5), latency_quantile(h, 0.99),
+            h->max * metrics->ns_per_tick);
+  }
+  fprintf(out, "\n");
+  for (int c = 0; c < NCOUNTERS; c++) {
+    fprintf(out, "%-20s %10llu\n", counter_names[c], (unsigned long long)metrics->counters[c]);
+  }
+  fprintf(out, "\n");
+  return 0;
+}
+
+/*
+ * Writes the metrics in the Prometheus text format to fname, through a
+ * temporary file renamed into place, so a collector (e.g. node_exporter's
+ * textfile collector) never sees half a dump.  Returns 0 on success.
+ */
+int dump_metrics(const char *fname) {
+  char tmp[300];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", fname);
+  FILE *out = fopen(tmp, "w");
+  if (out == NULL) {
+    return -1;
+  }
+
+  fprintf(out, "# TYPE weather_stage_seconds histogram\n");
+  for (int s = 0; s < NSTAGES; s++) {
+    const latency_hist_t *h = &metrics->stages[s];
+    uint64_t cumulative = 0;
+    for (int b = 0; b < METRIC_BUCKETS - 1; b++) {
+      cumulative += h->buckets[b];
+      fprintf(out, "weather_stage_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %llu\n", stage_names[s],
+              (b ? (1ULL << b) - 1 : 0) * metrics->ns_per_tick / 1e9, (unsigned long long)cumulative);
+    }
+    fprintf(out, "weather_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", stage_names[s],
+            (unsigned long long)h->count);
+    fprintf(out, "weather_stage_seconds_sum{stage=\"%s\"} %.9g\n", stage_names[s],
+            h->sum * metrics->ns_per_tick / 1e9);
+    fprintf(out, "weather_stage_seconds_count{stage=\"%s\"} %llu\n", stage_names[s], (unsigned long long)h->count);
+  }
+  for (int c = 0; c < NCOUNTERS; c++) {
+    int gauge = c == COUNTER_CMD_DEPTH || c == COUNTER_CMD_DEPTH_MAX;
+    fprintf(out, "# TYPE weather_%s%s %s\n", counter_names[c], gauge ? "" : "_total", gauge ? "gauge" : "counter");
+    fprintf(out, "weather_%s%s %llu\n", counter_names[c], gauge ? "" : "_total",
+            (unsigned long long)metrics->counters[c]);
+  }
+
+  if (fclose(out) != 0 || rename(tmp, fname) == -1) {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+#endif
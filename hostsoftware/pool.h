@@ -0,0 +1,196 @@
+#ifndef pool_h_
+#define pool_h_
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A work-stealing thread pool for batch jobs.
+ *
+ * Every worker owns a deque of tasks.  It pushes the tasks it spawns onto
+ * the bottom of its own deque and pops from the bottom too, so it works
+ * depth first on what it just produced while it is still in cache; a
+ * worker whose deque is empty steals from the top of someone else's,
+ * which is where the oldest and usually biggest pieces of work are.
+ * Each deque has its own lock, only ever contended by a thief, so the
+ * workers share no hot cache line but the pending count.
+ *
+ * pool_run returns once every task, including the ones tasks spawned,
+ * has finished.
+ */
+typedef struct pool pool_t;
+
+typedef struct {
+  void (*fn)(pool_t *pool, int worker, void *arg);
+  void *arg;
+} pool_task_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+  pool_task_t *tasks;
+  // capacity, a power of two; top and bottom are free running
+  uint64_t cap;
+  uint64_t top;
+  uint64_t bottom;
+  uint64_t executed;
+  uint64_t stolen;
+  char pad[64];
+} pool_deque_t;
+
+struct pool {
+  int nworkers;
+  pool_deque_t *deques;
+  pthread_t *threads;
+  // tasks submitted but not finished yet
+  uint64_t pending;
+  // round robin target of submissions from outside the pool
+  int next;
+};
+
+typedef struct {
+  pool_t *pool;
+  int worker;
+} pool_worker_arg_t;
+
+/*
+ * Sets up a pool of nworkers workers (not started yet)
+ * returns 0 on success
+ */
+int pool_init(pool_t *pool, int nworkers) {
+  memset(pool, 0, sizeof(*pool));
+  pool->nworkers = nworkers;
+  pool->deques = calloc(nworkers, sizeof(pool_deque_t));
+  pool->threads = calloc(nworkers, sizeof(pthread_t));
+  if (pool->deques == NULL || pool->threads == NULL) {
+    free(pool->deques);
+    free(pool->threads);
+    return -1;
+  }
+  for (int w = 0; w < nworkers; w++) {
+    pthread_mutex_init(&pool->deques[w].lock, NULL);
+  }
+  return 0;
+}
+
+/*
+ * Queues fn(pool, worker, arg) on worker's deque; worker is the calling
+ * worker from inside a task, or -1 from outside the pool
+ * returns 0 on success
+ */
+int pool_submit(pool_t *pool, int worker, void (*fn)(pool_t *, int, void *), void *arg) {
+  if (worker < 0) {
+    worker = pool->next++ % pool->nworkers;
+  }
+  pool_deque_t *d = &pool->deques[worker];
+
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom - d->top == d->cap) {
+    uint64_t cap = d->cap ? d->cap * 2 : 256;
+    pool_task_t *tasks = malloc(cap * sizeof(pool_task_t));
+    if (tasks == NULL) {
+      pthread_mutex_unlock(&d->lock);
+      return -1;
+    }
+    for (uint64_t i = d->top; i < d->bottom; i++) {
+      tasks[i & (cap - 1)] = d->tasks[i & (d->cap - 1)];
+    }
+    free(d->tasks);
+    d->tasks = tasks;
+    d->cap = cap;
+  }
+  d->tasks[d->bottom & (d->cap - 1)] = (pool_task_t){fn, arg};
+  d->bottom++;
+  __atomic_add_fetch(&pool->pending, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&d->lock);
+  return 0;
+}
+
+// pops the newest task (own deque) or steals the oldest (someone else's)
+int pool_take(pool_deque_t *d, int steal, pool_task_t *task) {
+  int found = 0;
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom != d->top) {
+    if (steal) {
+      *task = d->tasks[d->top++ & (d->cap - 1)];
+    } else {
+      *task = d->tasks[--d->bottom & (d->cap - 1)];
+    }
+    found = 1;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+void *pool_worker(void *arg) {
+  pool_t *pool = ((pool_worker_arg_t *)arg)->pool;
+  int w = ((pool_worker_arg_t *)arg)->worker;
+  pool_deque_t *own = &pool->deques[w];
+  uint32_t rng = 2463534242u + w;
+  pool_task_t task;
+
+  for (;;) {
+    int found = pool_take(own, 0, &task);
+    // empty: try every other deque once, starting at a random one
+    for (int i = 0; !found && i < pool->nworkers - 1; i++) {
+      if (i == 0) {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+      }
+      int victim = (w + 1 + (rng + i) % (pool->nworkers - 1)) % pool->nworkers;
+      if ((found = pool_take(&pool->deques[victim], 1, &task))) {
+        own->stolen++;
+      }
+    }
+    if (!found) {
+      // nothing queued anywhere: done, unless a running task may still spawn more
+      if (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) == 0) {
+        return NULL;
+      }
+      sched_yield();
+      continue;
+    }
+    task.fn(pool, w, task.arg);
+    own->executed++;
+    __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_RELEASE);
+  }
+}
+
+/*
+ * Runs the workers until every task has finished
+ * returns 0 on success
+ */
+int pool_run(pool_t *pool) {
+  pool_worker_arg_t *args = calloc(pool->nworkers, sizeof(pool_worker_arg_t));
+  int started = 0;
+  if (args == NULL) {
+    return -1;
+  }
+  for (started = 0; started < pool->nworkers; started++) {
+    args[started] = (pool_worker_arg_t){pool, started};
+    if (pthread_create(&pool->threads[started], NULL, pool_worker, &args[started])) {
+      perror("Error starting pool worker");
+      break;
+    }
+  }
+  // with fewer workers than asked for the others still drain every deque
+  for (int w = 0; w < started; w++) {
+    pthread_join(pool->threads[w], NULL);
+  }
+  free(args);
+  return started ? 0 : -1;
+}
+
+void pool_destroy(pool_t *pool) {
+  for (int w = 0; w < pool->nworkers; w++) {
+    pthread_mutex_destroy(&pool->deques[w].lock);
+    free(pool->deques[w].tasks);
+  }
+  free(pool->deques);
+  free(pool->threads);
+}
+
+#endif
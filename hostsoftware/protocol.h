@@ -0,0 +1,134 @@
+#ifndef protocol_h_
+#define protocol_h_
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Framed serial protocol spoken with the sketch (sensorsoftware.ino
+ * carries its own copy of the encoder, decoder and CRC).
+ *
+ * BYTE #      | VALUE
+ * 0           | FRAME_START (0x7E)
+ * 1           | type, one of enum message
+ * 2           | payload length (0-FRAME_MAXPAYLOAD)
+ * 3 .. 3+n-1  | payload
+ * 3+n, 4+n    | CRC16-CCITT of bytes 1 .. 3+n-1, high byte first
+ *
+ * TYPE        | DIRECTION      | PAYLOAD
+ * BLINK '1'   | host -> sketch | 1 byte, how many times to blink
+ * REQUEST '2' | host -> sketch | 1 byte n (missing means 1), answered by
+ *             |                | n DATA frames back to back
+ * PAUSE '3'   | host -> sketch | none
+ * RESUME '4'  | host -> sketch | none
+ * DATA 'D'    | sketch -> host | 16 byte reading, see handle_reply
+ * HELLO 'H'   | host -> sketch | none, asks the sketch whether it is up
+ *             | sketch -> host | 5 bytes: PROTOCOL_VERSION, then the
+ *             |                | current baud rate, 32 bits high byte
+ *             |                | first; also sent unprompted at boot
+ * BAUD 'B'    | host -> sketch | 4 bytes, the new baud rate high byte
+ *             |                | first (any other length, or a rate
+ *             |                | baud_to_speed lacks, is ignored)
+ *             | sketch -> host | the same 4 bytes, sent at the old rate
+ *             |                | before the sketch switches over
+ * EXIT '5' only ever goes between the host's own processes.
+ */
+#define FRAME_START 0x7E
+#define FRAME_HEADER 3
+#define FRAME_TRAILER 2
+#define FRAME_MAXPAYLOAD 32
+#define FRAME_MAXLEN (FRAME_HEADER + FRAME_MAXPAYLOAD + FRAME_TRAILER)
+
+// CRC16-CCITT (poly 0x1021, init 0xFFFF), a byte at a time without a table
+uint16_t crc16(const unsigned char *data, int len) {
+  uint16_t crc = 0xFFFF;
+  for (int i = 0; i < len; i++) {
+    uint16_t x = (crc >> 8) ^ data[i];
+    x ^= x >> 4;
+    crc = (uint16_t)((crc << 8) ^ (x << 12) ^ (x << 5) ^ x);
+  }
+  return crc;
+}
+
+/*
+ * Writes a frame into out (at least FRAME_MAXLEN bytes)
+ * returns the frame length, or -1 if the payload is too long
+ */
+int frame_encode(unsigned char type, const void *payload, int len, unsigned char *out) {
+  if (len < 0 || len > FRAME_MAXPAYLOAD) {
+    return -1;
+  }
+  out[0] = FRAME_START;
+  out[1] = type;
+  out[2] = (unsigned char)len;
+  if (len) {
+    memcpy(out + FRAME_HEADER, payload, len);
+  }
+  uint16_t crc = crc16(out + 1, len + 2);
+  out[FRAME_HEADER + len] = crc >> 8;
+  out[FRAME_HEADER + len + 1] = crc & 0xFF;
+  return FRAME_HEADER + len + FRAME_TRAILER;
+}
+
+/*
+ * Receive side: bytes are appended to buf, and frame_next peels good
+ * frames off the front.  On garbage, a bad length or a bad CRC only the
+ * leading byte is discarded and the rest is scanned again for a start
+ * byte, so a corrupted byte costs the frame it hit and nothing after it.
+ */
+typedef struct {
+  unsigned char buf[2 * FRAME_MAXLEN];
+  int len;
+  unsigned long bad_frames;
+} frame_parser_t;
+
+void frame_drop(frame_parser_t *p, int n) {
+  p->len -= n;
+  memmove(p->buf, p->buf + n, p->len);
+}
+
+/*
+ * Returns 1 and fills type, payload and len when a complete, valid frame
+ * was at the front of the buffer, 0 if more bytes are needed
+ */
+int frame_next(frame_parser_t *p, unsigned char *type, unsigned char *payload, int *len) {
+  while (p->len > 0) {
+    // skip to the next start byte
+    unsigned char *start = memchr(p->buf, FRAME_START, p->len);
+    if (start == NULL) {
+      p->len = 0;
+      return 0;
+    }
+    if (start != p->buf) {
+      frame_drop(p, start - p->buf);
+    }
+
+    if (p->len < FRAME_HEADER) {
+      return 0;
+    }
+    int n = p->buf[2];
+    if (n > FRAME_MAXPAYLOAD) {
+      p->bad_frames++;
+      frame_drop(p, 1);
+      continue;
+    }
+    if (p->len < FRAME_HEADER + n + FRAME_TRAILER) {
+      return 0;
+    }
+
+    uint16_t crc = ((uint16_t)p->buf[FRAME_HEADER + n] << 8) | p->buf[FRAME_HEADER + n + 1];
+    if (crc16(p->buf + 1, n + 2) != crc) {
+      p->bad_frames++;
+      frame_drop(p, 1);
+      continue;
+    }
+
+    *type = p->buf[1];
+    *len = n;
+    memcpy(payload, p->buf + FRAME_HEADER, n);
+    frame_drop(p, FRAME_HEADER + n + FRAME_TRAILER);
+    return 1;
+  }
+  return 0;
+}
+
+#endif
@@ -0,0 +1,146 @@
+#ifndef quantile_h_
+#define quantile_h_
+#include "hist.h"
+
+/*
+ * Per hour quantile sketches for one channel.
+ *
+ * Readings are single bytes, so an HDR style sketch at full resolution is
+ * just 256 unit wide buckets per hour: 1 KB per sketch, O(1) updates,
+ * exact quantiles, and two sketches merge by adding counters.
+ * The file uses the same versioned header as the hist files.
+ */
+#define QBUCKETS 256
+
+HIST_SPECIALIZE(qhist, uint32_t, 0, QBUCKETS, NROWS, ROW_MINUTES)
+
+#define QUANTILE_FILESIZE (sizeof(hist_header_t) + qhist_ncounts * sizeof(qhist_count_t))
+
+typedef struct {
+  int fd;
+  hist_header_t *hdr;
+  qhist_count_t *counts;
+} quantile_t;
+
+int update_quantile(quantile_t *q, unsigned char value, uint32_t minute) {
+  seq_write_begin(&q->hdr->seq);
+  qhist_update(q->counts, value, qhist_row(minute));
+  q->hdr->observations++;
+  seq_write_end(&q->hdr->seq);
+  return 0;
+}
+
+/*
+ * Smallest reading v such that at least a fraction p of the readings
+ * taken in hour time are <= v.  Returns -1 if there are none.
+ */
+int quantile_value(quantile_t *q, int time, double p) {
+  uint64_t row[QBUCKETS];
+  uint64_t total = 0;
+  uint32_t s;
+  // the rows the hour spans (one unless ROW_MINUTES is under an hour), as of one instant
+  int first = qhist_row(time * 60), last = qhist_row(time * 60 + 59);
+  do {
+    s = seq_read_begin(&q->hdr->seq);
+    memset(row, 0, sizeof(row));
+    for (int r = first; r <= last; r++) {
+      for (int v = 0; v < QBUCKETS; v++) {
+        row[v] += qhist_get(q->counts, r, v);
+      }
+    }
+  } while (seq_read_retry(&q->hdr->seq, s));
+
+  for (int v = 0; v < QBUCKETS; v++) {
+    total += row[v];
+  }
+  if (total == 0) {
+    return -1;
+  }
+
+  uint64_t rank = (uint64_t)(p * total + 0.999999);
+  rank = rank < 1 ? 1 : rank;
+  uint64_t seen = 0;
+  for (int v = 0; v < QBUCKETS; v++) {
+    seen += row[v];
+    if (seen >= rank) {
+      return v;
+    }
+  }
+  return QBUCKETS - 1;
+}
+
+// folds every count of src into dst
+void merge_quantile(quantile_t *dst, const quantile_t *src) {
+  seq_write_begin(&dst->hdr->seq);
+  for (int i = 0; i < qhist_ncounts; i++) {
+    dst->counts[i] += src->counts[i];
+  }
+  dst->hdr->observations += src->hdr->observations;
+  seq_write_end(&dst->hdr->seq);
+}
+
+/*
+ * construct_quantile opens (creating if needed) and mmaps a sketch file
+ * return value is 0 on success
+ */
+int construct_quantile(char *fname, quantile_t *q) {
+  struct stat st;
+  hist_header_t hdr;
+
+  q->fd = open(fname, O_RDWR | O_CREAT, (mode_t)0600);
+  if (q->fd == -1) {
+    perror("Error opening quantile file");
+    return -1;
+  }
+  if (fstat(q->fd, &st) == -1) {
+    perror("Error calling fstat()");
+    close(q->fd);
+    return -1;
+  }
+
+  int fresh = st.st_size == 0;
+  if (!fresh && (st.st_size != (off_t)QUANTILE_FILESIZE || pread(q->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+                 hdr.magic != HIST_MAGIC || hdr.nbuckets != QBUCKETS || hdr.nrows != NROWS ||
+                 hdr.counter_bytes != sizeof(qhist_count_t))) {
+    fprintf(stderr, "%s is not a quantile file\n", fname);
+    close(q->fd);
+    return -1;
+  }
+  if (fresh && ftruncate(q->fd, QUANTILE_FILESIZE) == -1) {
+    perror("Error extending quantile file");
+    close(q->fd);
+    return -1;
+  }
+
+  char *map = (char *)mmap(0, QUANTILE_FILESIZE, PROT_READ | PROT_WRITE, MAP_SHARED, q->fd, 0);
+  if (map == MAP_FAILED) {
+    perror("Error mapping quantile file");
+    close(q->fd);
+    return -1;
+  }
+  q->hdr = (hist_header_t *)map;
+  q->counts = (qhist_count_t *)(map + sizeof(hist_header_t));
+  if (fresh) {
+    q->hdr->magic = HIST_MAGIC;
+    q->hdr->version = HIST_VERSION;
+    q->hdr->counter_bytes = sizeof(qhist_count_t);
+    q->hdr->bucket_shift = 0;
+    q->hdr->nbuckets = QBUCKETS;
+    q->hdr->nrows = NROWS;
+    q->hdr->row_minutes = ROW_MINUTES;
+  }
+  q->hdr->seq &= ~1u;
+  return 0;
+}
+
+int deconstruct_quantile(quantile_t *q) {
+  if (munmap(q->hdr, QUANTILE_FILESIZE) == -1) {
+    perror("Error un-mapping quantile file");
+    close(q->fd);
+    return -1;
+  }
+  close(q->fd);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,587 @@
+#ifndef query_h_
+#define query_h_
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "record.h"
+#include "rollup.h"
+#include "timecodec.h"
+
+/*
+ * A small query language over the record archive, e.g.
+ *
+ *   select tmp,hmd where rained=2 and tmp>150 group by hour
+ *   select count, min(prs), max(prs) where time>=202001010000 and time<202001020000
+ *   select time, tmp where hour=6 limit 10
+ *
+ * select  columns: tmp prs hmd rained hour time, count, or
+ *         min/max/avg/sum(column); with group by, a bare column means avg
+ * where   column op value joined by and, op one of = != < <= > >=;
+ *         time values are yyyymmddhhmm
+ * group by  hour, day or month
+ * limit   at most that many rows (or groups)
+ *
+ * Every condition is folded into an inclusive [lo, hi] range per column
+ * (plus a short list of != values) that is checked on the packed record
+ * before anything is formatted, and a time range is pushed down to the
+ * sparse index so only the blocks that can match are read.  Aggregates
+ * are folded in the same single pass.
+ *
+ * An aggregate that only restricts the time, to whole buckets of a
+ * rollup tier, and only asks for what the buckets keep (count and the
+ * min, max, avg and sum of tmp, prs and hmd, avg and sum of rained) is
+ * answered from the coarsest tier that covers it instead (rollup.h).
+ */
+enum query_column { COL_TMP, COL_PRS, COL_HMD, COL_RAINED, COL_HOUR, COL_TIME, NCOLUMNS, COL_NONE };
+enum query_agg { AGG_VALUE, AGG_COUNT, AGG_MIN, AGG_MAX, AGG_AVG, AGG_SUM };
+enum query_group { GROUP_NONE, GROUP_HOUR, GROUP_DAY, GROUP_MONTH };
+
+#define QUERY_MAXSELECT 16
+#define QUERY_MAXNE 16
+// distinct groups a query can produce (e.g. about 11 years of days)
+#define QUERY_MAXGROUPS 4096
+
+const char *column_names[NCOLUMNS] = {"tmp", "prs", "hmd", "rained", "hour", "time"};
+const char *agg_names[] = {"", "count", "min", "max", "avg", "sum"};
+
+typedef struct {
+  enum query_column column;
+  enum query_agg agg;
+} select_t;
+
+typedef struct {
+  select_t select[QUERY_MAXSELECT];
+  int nselect;
+  int aggregate;
+  // inclusive bounds every record must fall in, per column
+  uint32_t lo[NCOLUMNS];
+  uint32_t hi[NCOLUMNS];
+  enum query_column ne_column[QUERY_MAXNE];
+  uint32_t ne_value[QUERY_MAXNE];
+  int nne;
+  enum query_group group;
+  uint64_t limit;
+} query_t;
+
+typedef struct {
+  uint64_t count;
+  uint64_t sum[NCOLUMNS];
+  uint32_t min[NCOLUMNS];
+  uint32_t max[NCOLUMNS];
+} query_acc_t;
+
+typedef struct {
+  uint32_t key;
+  int used;
+  query_acc_t acc;
+} query_group_t;
+
+// state of one run, passed through scan_records/query_records
+typedef struct {
+  const query_t *q;
+  FILE *out;
+  uint64_t rows;
+  query_acc_t total;
+  query_group_t *groups;
+  uint32_t ngroups;
+  int overflow;
+} query_run_t;
+
+static inline uint32_t column_value(const record_t *r, enum query_column c) {
+  switch (c) {
+  case COL_TMP:
+    return r->tmp;
+  case COL_PRS:
+    return r->prs;
+  case COL_HMD:
+    return r->hmd;
+  case COL_RAINED:
+    return r->rained;
+  case COL_HOUR:
+    return stamp_hour(r->minute);
+  default:
+    return r->minute;
+  }
+}
+
+/*
+ * Tokens: words, numbers, operators and punctuation.
+ * Returns the position after the token, or NULL at the end of the text.
+ */
+const char *query_token(const char *s, char *tok, size_t len) {
+  size_t n = 0;
+  while (*s && isspace((unsigned char)*s)) {
+    s++;
+  }
+  if (!*s) {
+    return NULL;
+  }
+  if (isalnum((unsigned char)*s) || *s == '_') {
+    while ((isalnum((unsigned char)*s) || *s == '_') && n + 1 < len) {
+      tok[n++] = tolower((unsigned char)*s++);
+    }
+  } else if ((s[0] == '<' || s[0] == '>' || s[0] == '!') && s[1] == '=') {
+    tok[n++] = *s++;
+    tok[n++] = *s++;
+  } else {
+    tok[n++] = *s++;
+  }
+  tok[n] = '\0';
+  return s;
+}
+
+enum query_column parse_column(const char *tok) {
+  for (int c = 0; c < NCOLUMNS; c++) {
+    if (strcmp(tok, column_names[c]) == 0) {
+      return c;
+    }
+  }
+  return COL_NONE;
+}
+
+// folds column op value into the query's bounds; returns -1 for an unknown op
+int add_condition(query_t *q, enum query_column c, const char *op, uint32_t v) {
+  if (strcmp(op, "=") == 0) {
+    q->lo[c] = v > q->lo[c] ? v : q->lo[c];
+    q->hi[c] = v < q->hi[c] ? v : q->hi[c];
+  } else if (strcmp(op, "<") == 0) {
+    if (v == 0) {
+      q->lo[c] = 1;
+      q->hi[c] = 0;
+    } else {
+      q->hi[c] = v - 1 < q->hi[c] ? v - 1 : q->hi[c];
+    }
+  } else if (strcmp(op, "<=") == 0) {
+    q->hi[c] = v < q->hi[c] ? v : q->hi[c];
+  } else if (strcmp(op, ">") == 0) {
+    if (v == UINT32_MAX) {
+      q->lo[c] = 1;
+      q->hi[c] = 0;
+    } else {
+      q->lo[c] = v + 1 > q->lo[c] ? v + 1 : q->lo[c];
+    }
+  } else if (strcmp(op, ">=") == 0) {
+    q->lo[c] = v > q->lo[c] ? v : q->lo[c];
+  } else if (strcmp(op, "!=") == 0 && q->nne < QUERY_MAXNE) {
+    q->ne_column[q->nne] = c;
+    q->ne_value[q->nne++] = v;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Parses text into q.  Returns 0 on success, or -1 with a message in err.
+ */
+int parse_query(const char *text, query_t *q, char *err, size_t errlen) {
+  char tok[32], op[32];
+  const char *s = text;
+
+  memset(q, 0, sizeof(*q));
+  for (int c = 0; c < NCOLUMNS; c++) {
+    q->hi[c] = UINT32_MAX;
+  }
+  q->limit = UINT64_MAX;
+
+#define QUERY_FAIL(...)                                                                                              \
+  do {                                                                                                               \
+    snprintf(err, errlen, __VA_ARGS__);                                                                              \
+    return -1;                                                                                                       \
+  } while (0)
+
+  if (!(s = query_token(s, tok, sizeof(tok))) || strcmp(tok, "select") != 0) {
+    QUERY_FAIL("queries start with select");
+  }
+
+  // select list
+  while ((s = query_token(s, tok, sizeof(tok)))) {
+    select_t sel = {COL_NONE, AGG_VALUE};
+    if (strcmp(tok, "count") == 0) {
+      sel.agg = AGG_COUNT;
+    } else if ((sel.column = parse_column(tok)) == COL_NONE) {
+      for (int a = AGG_MIN; a <= AGG_SUM; a++) {
+        if (strcmp(tok, agg_names[a]) == 0) {
+          sel.agg = a;
+        }
+      }
+      if (sel.agg == AGG_VALUE) {
+        QUERY_FAIL("unknown column '%s'", tok);
+      }
+      if (!(s = query_token(s, tok, sizeof(tok))) || strcmp(tok, "(") != 0 ||
+          !(s = query_token(s, tok, sizeof(tok))) || (sel.column = parse_column(tok)) == COL_NONE ||
+          !(s = query_token(s, op, sizeof(op))) || strcmp(op, ")") != 0) {
+        QUERY_FAIL("expected %s(column)", agg_names[sel.agg]);
+      }
+    }
+    if (q->nselect == QUERY_MAXSELECT) {
+      QUERY_FAIL("too many columns");
+    }
+    q->aggregate |= sel.agg != AGG_VALUE;
+    q->select[q->nselect++] = sel;
+
+    const char *next = query_token(s, tok, sizeof(tok));
+    if (!next || strcmp(tok, ",") != 0) {
+      break;
+    }
+    s = next;
+  }
+  if (q->nselect == 0) {
+    QUERY_FAIL("select what?");
+  }
+
+  // clauses
+  while (s && (s = query_token(s, tok, sizeof(tok)))) {
+    if (strcmp(tok, "where") == 0 || strcmp(tok, "and") == 0) {
+      enum query_column c;
+      char value[32];
+      if (!(s = query_token(s, tok, sizeof(tok))) || (c = parse_column(tok)) == COL_NONE) {
+        QUERY_FAIL("expected a column after where/and");
+      }
+      if (!(s = query_token(s, op, sizeof(op))) || !(s = query_token(s, value, sizeof(value))) ||
+          !isdigit((unsigned char)value[0])) {
+        QUERY_FAIL("expected %s OP NUMBER", column_names[c]);
+      }
+      uint32_t v;
+      if (c == COL_TIME) {
+        if (strlen(value) != STAMPLEN || (v = parse_stamp(value)) == STAMP_INVALID) {
+          QUERY_FAIL("time values are dates from 1970 on, yyyymmddhhmm");
+        }
+      } else {
+        v = strtoul(value, NULL, 10);
+      }
+      if (add_condition(q, c, op, v)) {
+        QUERY_FAIL("unknown operator '%s'", op);
+      }
+    } else if (strcmp(tok, "group") == 0) {
+      if (!(s = query_token(s, tok, sizeof(tok))) || strcmp(tok, "by") != 0 ||
+          !(s = query_token(s, tok, sizeof(tok)))) {
+        QUERY_FAIL("expected group by hour|day|month");
+      }
+      if (strcmp(tok, "hour") == 0) {
+        q->group = GROUP_HOUR;
+      } else if (strcmp(tok, "day") == 0) {
+        q->group = GROUP_DAY;
+      } else if (strcmp(tok, "month") == 0) {
+        q->group = GROUP_MONTH;
+      } else {
+        QUERY_FAIL("can only group by hour, day or month");
+      }
+    } else if (strcmp(tok, "limit") == 0) {
+      if (!(s = query_token(s, tok, sizeof(tok))) || !isdigit((unsigned char)tok[0])) {
+        QUERY_FAIL("expected limit N");
+      }
+      q->limit = strtoull(tok, NULL, 10);
+    } else {
+      QUERY_FAIL("unexpected '%s'", tok);
+    }
+  }
+#undef QUERY_FAIL
+
+  // under group by every column is an aggregate
+  if (q->group != GROUP_NONE) {
+    for (int i = 0; i < q->nselect; i++) {
+      if (q->select[i].agg == AGG_VALUE) {
+        q->select[i].agg = AGG_AVG;
+      }
+    }
+    q->aggregate = 1;
+  }
+  return 0;
+}
+
+static inline int query_match(const query_t *q, const record_t *r) {
+  // the byte columns first, they are the cheapest to reject on
+  if (r->tmp < q->lo[COL_TMP] || r->tmp > q->hi[COL_TMP] || r->prs < q->lo[COL_PRS] || r->prs > q->hi[COL_PRS] ||
+      r->hmd < q->lo[COL_HMD] || r->hmd > q->hi[COL_HMD] || r->rained < q->lo[COL_RAINED] ||
+      r->rained > q->hi[COL_RAINED]) {
+    return 0;
+  }
+  if (q->lo[COL_HOUR] > 0 || q->hi[COL_HOUR] < 23) {
+    uint32_t hour = stamp_hour(r->minute);
+    if (hour < q->lo[COL_HOUR] || hour > q->hi[COL_HOUR]) {
+      return 0;
+    }
+  }
+  for (int i = 0; i < q->nne; i++) {
+    if (column_value(r, q->ne_column[i]) == q->ne_value[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void acc_add(query_acc_t *acc, const record_t *r) {
+  for (int c = 0; c < NCOLUMNS; c++) {
+    uint32_t v = column_value(r, c);
+    acc->sum[c] += v;
+    acc->min[c] = (acc->count == 0 || v < acc->min[c]) ? v : acc->min[c];
+    acc->max[c] = (acc->count == 0 || v > acc->max[c]) ? v : acc->max[c];
+  }
+  acc->count++;
+}
+
+uint32_t group_key(enum query_group group, uint32_t minute) {
+  char stamp[STAMPLEN];
+  switch (group) {
+  case GROUP_HOUR:
+    return stamp_hour(minute);
+  case GROUP_DAY:
+    return minute / 1440;
+  default:
+    // yyyymm
+    format_stamp(minute, stamp);
+    return strtoul((char[7]){stamp[0], stamp[1], stamp[2], stamp[3], stamp[4], stamp[5], '\0'}, NULL, 10);
+  }
+}
+
+void print_group_key(FILE *out, enum query_group group, uint32_t key) {
+  char stamp[STAMPLEN];
+  switch (group) {
+  case GROUP_HOUR:
+    fprintf(out, "%02u:00     ", key);
+    break;
+  case GROUP_DAY:
+    format_stamp(key * 1440, stamp);
+    fprintf(out, "%.4s-%.2s-%.2s ", stamp, stamp + 4, stamp + 6);
+    break;
+  default:
+    fprintf(out, "%04u-%02u    ", key / 100, key % 100);
+    break;
+  }
+}
+
+void print_acc(FILE *out, const query_t *q, const query_acc_t *acc) {
+  for (int i = 0; i < q->nselect; i++) {
+    const select_t *sel = &q->select[i];
+    switch (sel->agg) {
+    case AGG_COUNT:
+      fprintf(out, " %12llu", (unsigned long long)acc->count);
+      break;
+    case AGG_MIN:
+      fprintf(out, " %12u", acc->count ? acc->min[sel->column] : 0);
+      break;
+    case AGG_MAX:
+      fprintf(out, " %12u", acc->count ? acc->max[sel->column] : 0);
+      break;
+    case AGG_SUM:
+      fprintf(out, " %12llu", (unsigned long long)acc->sum[sel->column]);
+      break;
+    default:
+      fprintf(out, " %12.2f", acc->count ? (double)acc->sum[sel->column] / acc->count : 0.0);
+      break;
+    }
+  }
+  fprintf(out, "\n");
+}
+
+void print_row(FILE *out, const query_t *q, const record_t *r) {
+  char stamp[STAMPLEN];
+  for (int i = 0; i < q->nselect; i++) {
+    if (q->select[i].column == COL_TIME) {
+      format_stamp(r->minute, stamp);
+      fprintf(out, " %12.12s", stamp);
+    } else {
+      fprintf(out, " %12u", column_value(r, q->select[i].column));
+    }
+  }
+  fprintf(out, "\n");
+}
+
+// the accumulator of group key, NULL (and overflow set) when there are too many groups
+query_acc_t *query_group(query_run_t *run, uint32_t key) {
+  uint32_t slot = (key * 2654435761u) % QUERY_MAXGROUPS;
+  while (run->groups[slot].used && run->groups[slot].key != key) {
+    slot = (slot + 1) % QUERY_MAXGROUPS;
+  }
+  if (!run->groups[slot].used) {
+    if (run->ngroups == QUERY_MAXGROUPS - 1) {
+      run->overflow = 1;
+      return NULL;
+    }
+    run->groups[slot].used = 1;
+    run->groups[slot].key = key;
+    run->ngroups++;
+  }
+  return &run->groups[slot].acc;
+}
+
+int query_visit(const record_t *r, void *arg) {
+  query_run_t *run = arg;
+  const query_t *q = run->q;
+
+  if (!query_match(q, r)) {
+    return 0;
+  }
+  if (!q->aggregate) {
+    print_row(run->out, q, r);
+    return ++run->rows >= q->limit;
+  }
+  if (q->group == GROUP_NONE) {
+    acc_add(&run->total, r);
+    return 0;
+  }
+
+  query_acc_t *acc = query_group(run, group_key(q->group, r->minute));
+  if (acc == NULL) {
+    return 1;
+  }
+  acc_add(acc, r);
+  return 0;
+}
+
+int compare_groups(const void *a, const void *b) {
+  const query_group_t *x = a, *y = b;
+  if (x->used != y->used) {
+    return y->used - x->used;
+  }
+  return (x->key > y->key) - (x->key < y->key);
+}
+
+void print_query_header(FILE *out, const query_t *q) {
+  if (q->group != GROUP_NONE) {
+    fprintf(out, "%-11s", q->group == GROUP_HOUR ? "hour" : q->group == GROUP_DAY ? "day" : "month");
+  }
+  for (int i = 0; i < q->nselect; i++) {
+    char name[32];
+    if (q->select[i].agg == AGG_COUNT) {
+      snprintf(name, sizeof(name), "count");
+    } else if (q->select[i].agg == AGG_VALUE) {
+      snprintf(name, sizeof(name), "%s", column_names[q->select[i].column]);
+    } else {
+      snprintf(name, sizeof(name), "%s(%s)", agg_names[q->select[i].agg], column_names[q->select[i].column]);
+    }
+    fprintf(out, " %12s", name);
+  }
+  fprintf(out, "\n");
+}
+
+// starts a run, with the group table if q groups; returns -1 out of memory
+int query_run_init(query_run_t *run, const query_t *q, FILE *out) {
+  memset(run, 0, sizeof(*run));
+  run->q = q;
+  run->out = out;
+  if (q->group != GROUP_NONE && (run->groups = calloc(QUERY_MAXGROUPS, sizeof(query_group_t))) == NULL) {
+    fprintf(out, "Out of memory\n");
+    return -1;
+  }
+  print_query_header(out, q);
+  return 0;
+}
+
+/*
+ * Prints whatever run has aggregated and frees it
+ * returns the number of records that went into it
+ */
+uint64_t query_run_finish(query_run_t *run) {
+  const query_t *q = run->q;
+  uint64_t matched = run->rows;
+  if (q->aggregate && q->group == GROUP_NONE) {
+    print_acc(run->out, q, &run->total);
+    matched = run->total.count;
+  } else if (q->group != GROUP_NONE) {
+    qsort(run->groups, QUERY_MAXGROUPS, sizeof(query_group_t), compare_groups);
+    for (uint32_t g = 0; g < run->ngroups && g < q->limit; g++) {
+      print_group_key(run->out, q->group, run->groups[g].key);
+      print_acc(run->out, q, &run->groups[g].acc);
+      matched += run->groups[g].acc.count;
+    }
+    if (run->overflow) {
+      fprintf(run->out, "More than %d groups, the result is incomplete\n", QUERY_MAXGROUPS - 1);
+    }
+    free(run->groups);
+  }
+  return matched;
+}
+
+/*
+ * Runs q over every live record in one pass and prints the result to out
+ * returns the number of matching records
+ */
+uint64_t run_query(record_store_t *rs, const query_t *q, FILE *out) {
+  query_run_t run;
+  if (query_run_init(&run, q, out)) {
+    return 0;
+  }
+  // a time range goes through the index, anything else is a full scan
+  if (q->lo[COL_TIME] > 0 || q->hi[COL_TIME] < UINT32_MAX) {
+    query_records(rs, q->lo[COL_TIME], q->hi[COL_TIME], query_visit, &run);
+  } else {
+    scan_records(rs, query_visit, &run);
+  }
+  return query_run_finish(&run);
+}
+
+// 1 if the buckets of a rollup keep everything q asks for
+int query_fits_rollup(const query_t *q) {
+  if (!q->aggregate || q->nne) {
+    return 0;
+  }
+  for (int c = 0; c < NCOLUMNS; c++) {
+    if (c != COL_TIME && (q->lo[c] > 0 || q->hi[c] < (c == COL_HOUR ? 23 : UINT32_MAX))) {
+      return 0;
+    }
+  }
+  for (int i = 0; i < q->nselect; i++) {
+    const select_t *sel = &q->select[i];
+    if (sel->agg != AGG_COUNT && sel->column != COL_TMP && sel->column != COL_PRS && sel->column != COL_HMD &&
+        !(sel->column == COL_RAINED && (sel->agg == AGG_AVG || sel->agg == AGG_SUM))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int rollup_visit(const rollup_bucket_t *b, void *arg) {
+  void **args = arg;
+  query_run_t *run = args[0];
+  const rollup_t *r = args[1];
+  uint32_t start = rollup_start(r->tier, b->key);
+  query_acc_t *acc = run->q->group == GROUP_NONE ? &run->total : query_group(run, group_key(run->q->group, start));
+  if (acc == NULL) {
+    return 1;
+  }
+
+  for (int c = 0; c < 3; c++) {
+    acc->min[c] = (acc->count == 0 || b->min[c] < acc->min[c]) ? b->min[c] : acc->min[c];
+    acc->max[c] = (acc->count == 0 || b->max[c] > acc->max[c]) ? b->max[c] : acc->max[c];
+    acc->sum[c] += b->sum[c];
+  }
+  // rained is 1 without and 2 with rain, 0 if not observed
+  acc->sum[COL_RAINED] += b->rain_obs + b->rain;
+  acc->count += b->count;
+  return 0;
+}
+
+/*
+ * Answers q from the coarsest of the tiers that covers its time range
+ * and groups, see query_fits_rollup
+ * returns the tier it used, or -1 if q has to go to the records
+ */
+int run_rollup_query(rollup_t *tiers, const query_t *q, FILE *out, uint64_t *matched) {
+  // the coarsest tier each grouping can use, hour of the day only comes out of hours
+  enum rollup_tier coarsest = q->group == GROUP_HOUR ? TIER_HOUR : q->group == GROUP_DAY ? TIER_DAY : TIER_MONTH;
+  query_run_t run;
+
+  if (!query_fits_rollup(q)) {
+    return -1;
+  }
+  for (int t = coarsest; t >= TIER_HOUR; t--) {
+    if (!rollup_covers(&tiers[t], q->lo[COL_TIME], q->hi[COL_TIME])) {
+      continue;
+    }
+    void *args[2] = {&run, &tiers[t]};
+    if (query_run_init(&run, q, out)) {
+      return -1;
+    }
+    scan_rollup(&tiers[t], q->lo[COL_TIME], q->hi[COL_TIME], rollup_visit, args);
+    *matched = query_run_finish(&run);
+    return t;
+  }
+  return -1;
+}
+
+#endif
@@ -1,98 +1,698 @@
 #ifndef record_h_
 #define record_h_
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-// These defines set the sizes of the record file!!!
-#define RECORDLEN 36
-#define NUMRECORDS (24 * 3)
-#define RECORD_FILESIZE (NUMRECORDS * RECORDLEN)
+#include "protocol.h"
+#include "seqlock.h"
+#include "timecodec.h"
 
-int _records_so_far;
+/*
+ * The record archive is a ring of fixed size segment files holding packed
+ * binary records, plus a small header file (the record file name itself,
+ * e.g. record.bin) that says which segments are live.
+ * Records are only formatted as CSV when they are read back.
+ *
+ * The archive survives restarts: construct_record maps an existing one
+ * and appends where it left off.  After a crash the header can be a few
+ * readings off from the head segment either way, so the last
+ * RECORD_TAIL records are checked against it (see repair_tail).
+ */
+
+// These defines set the default sizes of the record files, see record_capacity_t
+#define RECORDLEN 8
+#define SEGMENT_RECORDS (24 * 30)
+#define NUMSEGMENTS 12
+// segments a process keeps mapped at once, whatever the capacity
+#define SEGMENT_SLOTS 16
+// a segment file grows by this many records at a time (1 MiB) as it fills
+#define RECORD_CHUNK (1 << 17)
+// compressed segments the cold tier keeps (compress.h), 0 for all of them
+#define COLD_SEGMENTS 1024
+
+#define RECORD_MAGIC 0x44434552 // "RECD"
+#define RECORD_VERSION 3
+// records at the end of the head segment checked on startup
+#define RECORD_TAIL 4096
+#define RECORD_MARKS 16
+
+// one sparse index entry per INDEX_STRIDE records
+#define INDEX_STRIDE 64
+
+/*
+ * One reading, exactly RECORDLEN bytes
+ * minute is the timestamp as minutes since 1970 (see timecodec.h)
+ */
+typedef struct {
+  uint32_t minute;
+  unsigned char tmp;
+  unsigned char prs;
+  unsigned char hmd;
+  unsigned char rained;
+} record_t;
+
+/*
+ * How big the archive is, picked when it is created: the ring holds
+ * max_segments segment files of seg_records records each.
+ * populate prefaults the writer's mappings, including every chunk a
+ * segment grows by, and asks for huge pages where the kernel has them,
+ * so appends do not take page faults.
+ * cold_segments is how many compressed segments outlive the ring; unlike
+ * the rest it applies to an existing archive too.
+ */
+typedef struct {
+  uint32_t seg_records;
+  uint32_t max_segments;
+  int populate;
+  uint32_t cold_segments;
+} record_capacity_t;
 
-int update_record(char *record, unsigned char tmp, unsigned char prs,
-                  unsigned char hmd, unsigned char rained,
-                  char timeString[12]) {
+#define RECORD_CAPACITY_DEFAULT {SEGMENT_RECORDS, NUMSEGMENTS, 0, COLD_SEGMENTS}
 
+/*
+ * Header file shared (MAP_SHARED) by every process using the archive.
+ * Segments are numbered by a sequence number that only grows;
+ * segments first_seg..head_seg exist on disk, head_seg is being appended to.
+ * Record number n (counting from the first ever, total so far) is record
+ * n % seg_records of segment n / seg_records.
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t seg_records;
+  uint32_t max_segments;
+  uint32_t first_seg;
+  uint32_t head_seg;
+  uint32_t head_count;
+  // seqlock over the fields above, total and last_minute (seqlock.h)
+  uint32_t seq;
+  uint64_t total;
+  // timestamp of the newest record
+  uint32_t last_minute;
+  // crc16 of the fields that do not change with every record (meta_crc)
+  uint32_t crc;
   /*
-   * Makes sure that we do not write over the length of the file
+   * Counters of the files kept next to the records (see archive.h), nmarks
+   * of them, as of record number marked: they move in step with total, so
+   * a file behind that is missing readings the records still have
    */
-  if (_records_so_far >= NUMRECORDS) {
+  uint64_t marked;
+  uint32_t nmarks;
+  uint32_t pad;
+  uint64_t marks[RECORD_MARKS];
+} record_meta_t;
+
+/*
+ * Sparse timestamp index (the record file name plus .idx), one entry per
+ * block of INDEX_STRIDE records, slot (seq % max_segments) * seg_blocks + block.
+ * Keys are the records' minute timestamps, as the station's sketch stamps
+ * them.  They need not rise: the sketch starts its clock over from its
+ * seed whenever it reboots, while the archive resumes, so a block keeps
+ * its min and max key plus the max key of every block up to and
+ * including it, which never decreases and can be binary searched.
+ */
+typedef struct {
+  uint32_t min_key;
+  uint32_t max_key;
+  uint32_t prefix_max;
+} index_entry_t;
+
+/*
+ * Per process view of the archive.  Segments are mapped lazily into
+ * slot (seq % SEGMENT_SLOTS) so a reader notices segments created by the
+ * writer after it was forked.  A segment is mapped at its full size up
+ * front while its file only grows as it fills; nobody touches records
+ * past head_count, which the file always holds.
+ */
+typedef struct {
+  char fname[256];
+  int meta_fd;
+  record_meta_t *meta;
+  int index_fd;
+  index_entry_t *index;
+  // the capacity from the header, and index blocks per segment
+  uint32_t seg_records;
+  uint32_t max_segments;
+  uint32_t seg_blocks;
+  int populate;
+  uint32_t cold_segments;
+  int seg_fds[SEGMENT_SLOTS];
+  uint32_t seg_ids[SEGMENT_SLOTS];
+  record_t *segs[SEGMENT_SLOTS];
+  // records the head segment's file has room for (writer only)
+  uint32_t head_alloc;
+  // called with a segment's descriptor when the head moves past it
+  void (*on_seal)(void *arg, uint32_t seq, int fd, uint32_t count);
+  void *seal_arg;
+} record_store_t;
+
+// index entry for global block number g (seq * seg_blocks + block)
+index_entry_t *index_entry(record_store_t *rs, uint64_t g) {
+  uint64_t seq = g / rs->seg_blocks;
+  return &rs->index[(seq % rs->max_segments) * rs->seg_blocks + g % rs->seg_blocks];
+}
+
+size_t segment_bytes(const record_store_t *rs) {
+  return (size_t)rs->seg_records * RECORDLEN;
+}
+
+size_t index_bytes(const record_store_t *rs) {
+  return (size_t)rs->max_segments * rs->seg_blocks * sizeof(index_entry_t);
+}
+
+/*
+ * Checksum of the header except head_count, total and last_minute, which
+ * change with every record and are checked against the records instead
+ */
+uint32_t meta_crc(const record_meta_t *meta) {
+  record_meta_t copy = *meta;
+  copy.head_count = 0;
+  copy.seq = 0;
+  copy.total = 0;
+  copy.last_minute = 0;
+  copy.crc = 0;
+  return crc16((const unsigned char *)&copy, sizeof(copy));
+}
+
+// a record that was never written reads as zeros
+int record_valid(const record_t *r) {
+  return r->minute != 0 || r->tmp != 0 || r->prs != 0 || r->hmd != 0 || r->rained != 0;
+}
+
+void segment_name(record_store_t *rs, uint32_t seq, char *out, size_t len) {
+  snprintf(out, len, "%s.%06u", rs->fname, seq);
+}
+
+/*
+ * Returns the mapping of segment seq, mapping it first if needed.
+ * create truncates the segment file, which then grows with grow_segment.
+ * Returns NULL on error.
+ */
+record_t *map_segment(record_store_t *rs, uint32_t seq, int create) {
+  int slot = seq % SEGMENT_SLOTS;
+  char name[300];
+
+  if (!create && rs->segs[slot] && rs->seg_ids[slot] == seq) {
+    return rs->segs[slot];
+  }
+  if (rs->segs[slot]) {
+    munmap(rs->segs[slot], segment_bytes(rs));
+    close(rs->seg_fds[slot]);
+    rs->segs[slot] = NULL;
+  }
+
+  segment_name(rs, seq, name, sizeof(name));
+  int flags = create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR;
+  int fd = open(name, flags, (mode_t)0600);
+  if (fd == -1) {
+    perror("Error opening record segment");
+    return NULL;
+  }
+
+  int flags_map = MAP_SHARED | (rs->populate ? MAP_POPULATE : 0);
+  record_t *seg = (record_t *)mmap(0, segment_bytes(rs), PROT_READ | PROT_WRITE, flags_map, fd, 0);
+  if (seg == MAP_FAILED) {
+    perror("Error mapping record segment");
+    close(fd);
+    return NULL;
+  }
+#ifdef MADV_HUGEPAGE
+  if (rs->populate) {
+    madvise(seg, segment_bytes(rs), MADV_HUGEPAGE);
+  }
+#endif
+  if (create) {
+    rs->head_alloc = 0;
+  }
+  rs->seg_fds[slot] = fd;
+  rs->seg_ids[slot] = seq;
+  rs->segs[slot] = seg;
+  return seg;
+}
+
+/*
+ * Makes room for the next RECORD_CHUNK records of the head segment seg
+ * on fd.  The blocks are allocated with fallocate, so an append never
+ * waits for the file system to find space and the file does not end
+ * up fragmented; where that is not supported the file is just extended
+ * (sparse).
+ * returns 0 on success
+ */
+int grow_segment(record_store_t *rs, int fd, record_t *seg) {
+  uint32_t from = rs->head_alloc;
+  uint32_t to = rs->seg_records - from > RECORD_CHUNK ? from + RECORD_CHUNK : rs->seg_records;
+  off_t off = (off_t)from * RECORDLEN;
+  off_t len = (off_t)(to - from) * RECORDLEN;
+
+  if (fallocate(fd, 0, off, len) == -1 &&
+      ((errno != EOPNOTSUPP && errno != ENOSYS) || ftruncate(fd, off + len) == -1)) {
+    perror("Error extending record segment");
     return -1;
   }
+#ifdef MADV_POPULATE_WRITE
+  if (rs->populate) {
+    off_t page = sysconf(_SC_PAGESIZE);
+    off_t start = off / page * page;
+    madvise((char *)seg + start, off + len - start, MADV_POPULATE_WRITE);
+  }
+#else
+  (void)seg;
+#endif
+  rs->head_alloc = to;
+  return 0;
+}
+
+/*
+ * Folds the timestamp of record i of segment seq into the index entry of
+ * its block
+ */
+void index_add(record_store_t *rs, uint32_t seq, uint32_t i, uint32_t key) {
+  uint64_t g = (uint64_t)seq * rs->seg_blocks + i / INDEX_STRIDE;
+  index_entry_t *e = index_entry(rs, g);
+  if (i % INDEX_STRIDE == 0) {
+    uint32_t prev = (g > (uint64_t)rs->meta->first_seg * rs->seg_blocks) ? index_entry(rs, g - 1)->prefix_max : 0;
+    e->min_key = key;
+    e->max_key = key;
+    e->prefix_max = prev > key ? prev : key;
+  } else {
+    e->min_key = key < e->min_key ? key : e->min_key;
+    e->max_key = key > e->max_key ? key : e->max_key;
+    e->prefix_max = key > e->prefix_max ? key : e->prefix_max;
+  }
+}
+
+int update_record(record_store_t *rs, const record_t *reading) {
+  record_meta_t *meta = rs->meta;
 
-   /*
-   *  Write out data in a CSV format
-   *  and counts the number of records archived
+  /*
+   * When the head segment is full start a new one, and once there are
+   * more than max_segments drop the oldest, so ingest never stops
    */
-  //first paramter represents the point in record at which it should print the value for the datapoints
-  //keeps track of the number of records in the .bin file and multiplies that by the length of the record to use as offset from the start of record
-  //tells you where to write to
-  sprintf((record + (_records_so_far * (sizeof(char) * RECORDLEN))), "  %03u, %03u, %03u, %03u, %.12s,\n", tmp, prs, hmd, rained, timeString);
-  _records_so_far++;
+  if (meta->head_count >= meta->seg_records) {
+    if (rs->on_seal && map_segment(rs, meta->head_seg, 0)) {
+      rs->on_seal(rs->seal_arg, meta->head_seg, rs->seg_fds[meta->head_seg % SEGMENT_SLOTS], meta->head_count);
+    }
+    if (map_segment(rs, meta->head_seg + 1, 1) == NULL) {
+      return -1;
+    }
+    seq_write_begin(&meta->seq);
+    meta->head_count = 0;
+    meta->head_seg++;
+    int drop = meta->head_seg - meta->first_seg >= meta->max_segments;
+    if (drop) {
+      meta->first_seg++;
+    }
+    meta->crc = meta_crc(meta);
+    seq_write_end(&meta->seq);
+    if (drop) {
+      char name[300];
+      segment_name(rs, meta->first_seg - 1, name, sizeof(name));
+      unlink(name);
+    }
+  }
+
+  record_t *seg = map_segment(rs, meta->head_seg, 0);
+  if (seg == NULL) {
+    return -1;
+  }
+  if (meta->head_count >= rs->head_alloc && grow_segment(rs, rs->seg_fds[meta->head_seg % SEGMENT_SLOTS], seg)) {
+    return -1;
+  }
+
+  /*
+   * Write out the packed reading, then publish it by bumping the counts
+   */
+  seg[meta->head_count] = *reading;
+
+  /*
+   * Fold the key into the index entry of its block before publishing
+   */
+  index_add(rs, meta->head_seg, meta->head_count, reading->minute);
+  seq_write_begin(&meta->seq);
+  meta->head_count++;
+  meta->total++;
+  meta->last_minute = reading->minute;
+  seq_write_end(&meta->seq);
+
+  return 0;
+}
+
+/*
+ * Reads first_seg, head_seg and head_count as of one instant
+ */
+void record_bounds(const record_store_t *rs, uint32_t *first, uint32_t *head, uint32_t *head_count) {
+  const record_meta_t *meta = rs->meta;
+  uint32_t s;
+  do {
+    s = seq_read_begin(&meta->seq);
+    *first = meta->first_seg;
+    *head = meta->head_seg;
+    *head_count = meta->head_count;
+  } while (seq_read_retry(&meta->seq, s));
+}
+
+/*
+ * Whether segment seq (and its index entries) is still in the ring; the
+ * writer reuses a dropped segment's index slot only after moving first_seg
+ * past it, so an index entry read before this returns true was intact
+ */
+int segment_live(const record_store_t *rs, uint32_t seq) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return seq >= __atomic_load_n(&rs->meta->first_seg, __ATOMIC_RELAXED);
+}
+
+/*
+ * Calls fn on every live record, oldest first, and stops early if fn
+ * returns nonzero.  Returns the number of records visited.
+ */
+uint64_t scan_records(record_store_t *rs, int (*fn)(const record_t *, void *), void *arg) {
+  uint32_t first_seg, head_seg, head_count;
+  uint64_t visited = 0;
+
+  // records past the snapshot are left for the next scan
+  record_bounds(rs, &first_seg, &head_seg, &head_count);
+  for (uint32_t seq = first_seg; seq <= head_seg; seq++) {
+    uint32_t count = (seq == head_seg) ? head_count : rs->meta->seg_records;
+    record_t *seg = segment_live(rs, seq) ? map_segment(rs, seq, 0) : NULL;
+    if (seg == NULL) {
+      continue;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      visited++;
+      if (fn(&seg[i], arg)) {
+        return visited;
+      }
+    }
+  }
+  return visited;
+}
+
+/*
+ * Calls fn on every live record with from <= minute <= to, in archive order,
+ * and returns how many matched.
+ * Binary searches the index for the first block whose prefix_max reaches
+ * from, then walks the index entries from there on, reading only blocks
+ * whose keys overlap [from, to].  After a reboot of the sketch its stamps
+ * start over, so a block past to can still be followed by blocks in range
+ * and the walk does not stop early; the blocks it skips cost an index
+ * entry each.
+ */
+uint64_t query_records(record_store_t *rs, uint32_t from, uint32_t to, int (*fn)(const record_t *, void *),
+                       void *arg) {
+  uint32_t first_seg, head_seg, head_count;
+  record_bounds(rs, &first_seg, &head_seg, &head_count);
+  uint64_t lo = (uint64_t)first_seg * rs->seg_blocks;
+  uint64_t end = (uint64_t)head_seg * rs->seg_blocks + (head_count + INDEX_STRIDE - 1) / INDEX_STRIDE;
+  uint64_t hi = end;
+  uint64_t matched = 0;
+
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (index_entry(rs, mid)->prefix_max < from) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  for (uint64_t g = lo; g < end; g++) {
+    index_entry_t e = *index_entry(rs, g);
+    uint32_t seq = g / rs->seg_blocks;
+    if (!segment_live(rs, seq)) {
+      // dropped while we were searching, its slot may belong to a newer segment
+      continue;
+    }
+    if (e.min_key > to || e.max_key < from) {
+      continue;
+    }
+    uint32_t first = (g % rs->seg_blocks) * INDEX_STRIDE;
+    uint32_t count = (seq == head_seg) ? head_count : rs->meta->seg_records;
+    uint32_t last = first + INDEX_STRIDE < count ? first + INDEX_STRIDE : count;
+    record_t *seg = map_segment(rs, seq, 0);
+    if (seg == NULL) {
+      continue;
+    }
+    for (uint32_t i = first; i < last; i++) {
+      if (seg[i].minute >= from && seg[i].minute <= to) {
+        matched++;
+        if (fn(&seg[i], arg)) {
+          return matched;
+        }
+      }
+    }
+  }
+  return matched;
+}
+
+/*
+ * Formats one record the way the archive used to store it on disk,
+ * RECORD_TEXTLEN characters per record
+ */
+#define RECORD_TEXTLEN 36
+int format_record(const record_t *r, void *out) {
+  char stamp[STAMPLEN];
+  format_stamp(r->minute, stamp);
+  fprintf((FILE *)out, "  %03u, %03u, %03u, %03u, %.12s,\n", r->tmp, r->prs, r->hmd, r->rained, stamp);
+  return 0;
+}
+
+/*
+ * Prints out every live record in CSV
+ */
+int print_record(record_store_t *rs, FILE *out) {
+  scan_records(rs, format_record, out);
+  return 0;
+}
 
+/*
+ * Prints out the records between two minute timestamps (inclusive) in CSV
+ */
+int print_record_range(record_store_t *rs, uint32_t from, uint32_t to, FILE *out) {
+  query_records(rs, from, to, format_record, out);
   return 0;
 }
 
 /*
- * construct_record is responsible for opening the file and mmaping the file
- * the file descriptor (fd) is loaded into user provided pointer
- * the address of the mapped region (buffer) is loaded into another user provided
- * pointer return value is 0 on success
+ * Squares the header with the head segment after an unclean stop.
+ * A record is written before head_count counts it, and pages reach the
+ * disk in no particular order, so the file may hold records the header
+ * does not count yet, or the header may count records whose page never
+ * made it and read as zeros.  Within RECORD_TAIL records of head_count
+ * the archive now ends at the first record that is not valid; anything
+ * after it is cleared so a later repair cannot take it back, and the
+ * index entries of the blocks looked at are rebuilt.
+ * returns how many records the header was short (negative if it counted
+ * too many)
  */
-int construct_record(char *record_fname, int *fd, char **buffer) {
-  _records_so_far = 0;
+int64_t repair_tail(record_store_t *rs) {
+  record_meta_t *meta = rs->meta;
+  record_t *seg = map_segment(rs, meta->head_seg, 0);
+  if (seg == NULL) {
+    return 0;
+  }
+  uint32_t count = meta->head_count < rs->head_alloc ? meta->head_count : rs->head_alloc;
+  uint32_t lo = count > RECORD_TAIL ? count - RECORD_TAIL : 0;
+  uint32_t hi = rs->head_alloc - count > RECORD_TAIL ? count + RECORD_TAIL : rs->head_alloc;
+  uint32_t end = lo;
+  while (end < hi && record_valid(&seg[end])) {
+    end++;
+  }
+  memset(&seg[end], 0, (size_t)(hi - end) * RECORDLEN);
+  for (uint32_t i = lo / INDEX_STRIDE * INDEX_STRIDE; i < end; i++) {
+    index_add(rs, meta->head_seg, i, seg[i].minute);
+  }
+
+  int64_t off = (int64_t)end - meta->head_count;
+  seq_write_begin(&meta->seq);
+  meta->head_count = end;
+  meta->total += off;
+  if (end) {
+    meta->last_minute = seg[end - 1].minute;
+  }
+  seq_write_end(&meta->seq);
+  return off;
+}
+
+// whether hdr describes an archive this code can append to
+int record_resumable(const record_meta_t *hdr) {
+  // a writer that died while turning a segment (odd seq) left the checksum behind
+  return hdr->magic == RECORD_MAGIC && hdr->version == RECORD_VERSION &&
+         (hdr->crc == meta_crc(hdr) || (hdr->seq & 1)) && hdr->seg_records >= 1 && hdr->max_segments >= 1 &&
+         hdr->first_seg <= hdr->head_seg && hdr->head_seg - hdr->first_seg < hdr->max_segments &&
+         hdr->head_count <= hdr->seg_records && hdr->nmarks <= RECORD_MARKS;
+}
+
+/*
+ * Takes rs->marks as the counters of the files kept next to the records
+ * as of now, see record_meta_t
+ */
+void mark_record(record_store_t *rs, const uint64_t *counters, uint32_t n) {
+  record_meta_t *meta = rs->meta;
+  seq_write_begin(&meta->seq);
+  meta->marked = meta->total;
+  meta->nmarks = n < RECORD_MARKS ? n : RECORD_MARKS;
+  memcpy(meta->marks, counters, meta->nmarks * sizeof(uint64_t));
+  meta->crc = meta_crc(meta);
+  seq_write_end(&meta->seq);
+}
+
+/*
+ * construct_record is responsible for opening the header file, mmaping it
+ * and the head segment
+ * an existing archive is resumed as it is (its capacity wins over the
+ * one asked for), anything else is replaced by an empty archive of the
+ * given capacity
+ * the state is loaded into a user provided record_store_t
+ * return value is 0 on success
+ */
+int construct_record(char *record_fname, record_store_t *rs, const record_capacity_t *capacity) {
+  struct stat st;
+  record_meta_t hdr;
+
+  memset(rs, 0, sizeof(*rs));
+  snprintf(rs->fname, sizeof(rs->fname), "%s", record_fname);
 
   /*
    * Opens a file for reading and writing with permission granted to user and error checks
    */
-  *fd = open(record_fname, O_RDWR | O_CREAT | O_TRUNC, (mode_t)0600);
-         if (*fd == -1) {
-             perror("Error opening mmapped file");
-             return -1;
-         }
+  rs->meta_fd = open(record_fname, O_RDWR | O_CREAT, (mode_t)0600);
+  if (rs->meta_fd == -1) {
+    perror("Error opening mmapped file");
+    return -1;
+  }
+  if (fstat(rs->meta_fd, &st) == -1) {
+    perror("Error calling fstat()");
+    close(rs->meta_fd);
+    return -1;
+  }
 
-  /*
-   * Seeks to the end of the file and write a \0 to extend the file and error checks
-   */
-  if(lseek(*fd, RECORD_FILESIZE, SEEK_SET) == -1) {
-          perror("Error calling lseek()");
-          close(*fd);
-          return -1;
-   }
+  int resume = st.st_size == sizeof(record_meta_t) && pread(rs->meta_fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+               record_resumable(&hdr);
+  if (!resume && st.st_size > 0) {
+    fprintf(stderr, "%s is not a version %d record archive, starting a new one\n", record_fname, RECORD_VERSION);
+  }
+  if (!resume && (ftruncate(rs->meta_fd, 0) == -1 || ftruncate(rs->meta_fd, sizeof(record_meta_t)) == -1)) {
+    perror("Error extending record header");
+    close(rs->meta_fd);
+    return -1;
+  }
 
-   //writes a \0 to the end of the file and error checks
-  if((write(*fd, "\0", 1)) == -1) {
-              perror("Error writing");
-              close(*fd);
-              return -1;
+  rs->meta = (record_meta_t *)mmap(0, sizeof(record_meta_t), PROT_READ | PROT_WRITE, MAP_SHARED, rs->meta_fd, 0);
+  if (rs->meta == MAP_FAILED) {
+    close(rs->meta_fd);
+    perror("Error mapping the file");
+    return -1;
+  }
+
+  if (!resume) {
+    rs->meta->magic = RECORD_MAGIC;
+    rs->meta->version = RECORD_VERSION;
+    rs->meta->seg_records = capacity->seg_records;
+    rs->meta->max_segments = capacity->max_segments;
+    rs->meta->crc = meta_crc(rs->meta);
+  } else if (rs->meta->seg_records != capacity->seg_records || rs->meta->max_segments != capacity->max_segments) {
+    fprintf(stderr, "%s keeps its %u segments of %u records\n", record_fname, rs->meta->max_segments,
+            rs->meta->seg_records);
   }
+  rs->meta->seq &= ~1u;
+  rs->seg_records = rs->meta->seg_records;
+  rs->max_segments = rs->meta->max_segments;
+  rs->seg_blocks = (rs->seg_records + INDEX_STRIDE - 1) / INDEX_STRIDE;
+  rs->populate = capacity->populate;
+  rs->cold_segments = capacity->cold_segments;
 
   /*
-   * Maps the proper region of the file into the user's address space and error checks
-   * Casts as a char* since buffer points to the pointer record
+   * The index file is rebuilt along with a new archive
    */
-    *buffer = (char*)mmap(0, RECORD_FILESIZE, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
-    if(*buffer == MAP_FAILED) {
-      close(*fd);
-      perror("Error mapping the file");
-      return -1;
-    }
+  char name[300];
+  snprintf(name, sizeof(name), "%s.idx", record_fname);
+  rs->index_fd = open(name, O_RDWR | O_CREAT | (resume ? 0 : O_TRUNC), (mode_t)0600);
+  if (rs->index_fd == -1 || ftruncate(rs->index_fd, index_bytes(rs)) == -1) {
+    perror("Error creating record index");
+    return -1;
+  }
+  rs->index = (index_entry_t *)mmap(0, index_bytes(rs), PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | (rs->populate ? MAP_POPULATE : 0), rs->index_fd, 0);
+  if (rs->index == MAP_FAILED) {
+    perror("Error mapping record index");
+    close(rs->index_fd);
+    return -1;
+  }
 
+  if (!resume) {
+    return map_segment(rs, 0, 1) == NULL ? -1 : 0;
+  }
+  if (map_segment(rs, rs->meta->head_seg, 0) == NULL ||
+      fstat(rs->seg_fds[rs->meta->head_seg % SEGMENT_SLOTS], &st) == -1) {
+    fprintf(stderr, "%s is missing its head segment\n", record_fname);
+    return -1;
+  }
+  rs->head_alloc = st.st_size / RECORDLEN < rs->seg_records ? st.st_size / RECORDLEN : rs->seg_records;
+  int64_t off = repair_tail(rs);
+  if (off) {
+    fprintf(stderr, "%s: the header was %lld records off, repaired from the head segment\n", record_fname,
+            (long long)off);
+  }
   return 0;
 }
 
-int deconstruct_record(int record_fd, char *record) {
+/*
+ * A reader's view of rs for another thread of the same process: it shares
+ * the header and index mappings but maps segments on its own, so it never
+ * touches the segment mappings the writer replaces as the ring turns
+ */
+void open_record_view(const record_store_t *rs, record_store_t *view) {
+  memset(view, 0, sizeof(*view));
+  memcpy(view->fname, rs->fname, sizeof(view->fname));
+  view->meta_fd = -1;
+  view->meta = rs->meta;
+  view->index_fd = -1;
+  view->index = rs->index;
+  view->seg_records = rs->seg_records;
+  view->max_segments = rs->max_segments;
+  view->seg_blocks = rs->seg_blocks;
+  // a query reads a little of many segments, prefaulting them all would cost more than it saves
+  view->populate = 0;
+}
+
+void close_record_view(record_store_t *view) {
+  for (int i = 0; i < SEGMENT_SLOTS; i++) {
+    if (view->segs[i]) {
+      munmap(view->segs[i], segment_bytes(view));
+      close(view->seg_fds[i]);
+      view->segs[i] = NULL;
+    }
+  }
+}
+
+int deconstruct_record(record_store_t *rs) {
   /*
-   * Un-maps and closes file
+   * Un-maps and closes every file
    */
-  
-  if(munmap(record, RECORD_FILESIZE) == -1) {
-      close(record_fd);
-      perror("Error un-mapping the file");
-      return -1;
+  for (int i = 0; i < SEGMENT_SLOTS; i++) {
+    if (rs->segs[i]) {
+      munmap(rs->segs[i], segment_bytes(rs));
+      close(rs->seg_fds[i]);
+      rs->segs[i] = NULL;
     }
+  }
+
+  munmap(rs->index, index_bytes(rs));
+  close(rs->index_fd);
 
-    close(record_fd);
+  if (munmap(rs->meta, sizeof(record_meta_t)) == -1) {
+    close(rs->meta_fd);
+    perror("Error un-mapping the file");
+    return -1;
+  }
 
+  close(rs->meta_fd);
   return 0;
 }
 
@@ -0,0 +1,95 @@
+#ifndef ring_h_
+#define ring_h_
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * Lock-free single producer / single consumer rings that live in a
+ * MAP_SHARED | MAP_ANONYMOUS mapping set up before the fork, so one
+ * process can push typed structs and the other pop them with plain
+ * loads and stores.
+ *
+ * head is only written by the consumer and tail only by the producer.
+ * Both are free running counters; slot = counter % capacity.
+ *
+ * The consumer sleeps on an eventfd.  The producer only writes to it when
+ * its push found the ring empty, so a busy ring costs no syscalls at all.
+ * Both sides publish their counter, fence, then read the other one, so
+ * either the producer sees the ring went empty and signals, or the
+ * consumer sees the new tail and keeps popping.
+ */
+
+#define RING_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define RING_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define RING_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/*
+ * SPSC_RING generates a ring type NAME##_ring_t holding CAPACITY
+ * elements of TYPE, and its functions:
+ *   NAME##_ring_create  map a shared ring and its eventfd, NULL on error
+ *   NAME##_push         copy an element in, -1 if the ring is full
+ *   NAME##_pop          copy an element out, 0 if the ring is empty
+ *   NAME##_wait         block on the eventfd until something is pushed
+ */
+#define SPSC_RING(NAME, TYPE, CAPACITY)                                             \
+  typedef struct {                                                                  \
+    uint32_t head;                                                                  \
+    char pad0[60];                                                                  \
+    uint32_t tail;                                                                  \
+    char pad1[60];                                                                  \
+    int event_fd;                                                                   \
+    TYPE slots[CAPACITY];                                                           \
+  } NAME##_ring_t;                                                                  \
+                                                                                    \
+  NAME##_ring_t *NAME##_ring_create(void) {                                         \
+    NAME##_ring_t *ring = mmap(0, sizeof(NAME##_ring_t), PROT_READ | PROT_WRITE,    \
+                               MAP_SHARED | MAP_ANONYMOUS, -1, 0);                  \
+    if (ring == MAP_FAILED) {                                                       \
+      return NULL;                                                                  \
+    }                                                                               \
+    memset(ring, 0, sizeof(*ring));                                                 \
+    ring->event_fd = eventfd(0, EFD_CLOEXEC);                                       \
+    if (ring->event_fd == -1) {                                                     \
+      munmap(ring, sizeof(*ring));                                                  \
+      return NULL;                                                                  \
+    }                                                                               \
+    return ring;                                                                    \
+  }                                                                                 \
+                                                                                    \
+  int NAME##_push(NAME##_ring_t *ring, const TYPE *item) {                          \
+    uint32_t tail = ring->tail;                                                     \
+    if (tail - RING_LOAD(&ring->head) >= (CAPACITY)) {                              \
+      return -1;                                                                    \
+    }                                                                               \
+    ring->slots[tail % (CAPACITY)] = *item;                                         \
+    RING_STORE(&ring->tail, tail + 1);                                              \
+    RING_FENCE();                                                                   \
+    if (RING_LOAD(&ring->head) == tail) {                                           \
+      uint64_t one = 1;                                                             \
+      write(ring->event_fd, &one, sizeof(one));                                     \
+    }                                                                               \
+    return 0;                                                                       \
+  }                                                                                 \
+                                                                                    \
+  int NAME##_pop(NAME##_ring_t *ring, TYPE *item) {                                 \
+    uint32_t head = ring->head;                                                     \
+    if (RING_LOAD(&ring->tail) == head) {                                           \
+      return 0;                                                                     \
+    }                                                                               \
+    *item = ring->slots[head % (CAPACITY)];                                         \
+    RING_STORE(&ring->head, head + 1);                                              \
+    RING_FENCE();                                                                   \
+    return 1;                                                                       \
+  }                                                                                 \
+                                                                                    \
+  void NAME##_wait(NAME##_ring_t *ring) {                                           \
+    uint64_t count;                                                                 \
+    if (RING_LOAD(&ring->tail) == ring->head) {                                     \
+      read(ring->event_fd, &count, sizeof(count));                                  \
+    }                                                                               \
+  }
+
+#endif
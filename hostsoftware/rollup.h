@@ -0,0 +1,307 @@
+#ifndef rollup_h_
+#define rollup_h_
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "record.h"
+#include "seqlock.h"
+#include "timecodec.h"
+
+/*
+ * Downsampled copies of the archive: every reading is also counted into
+ * the hour, the day and the calendar month it was taken in, each tier
+ * in a file of its own.  A bucket keeps the count, min, max and sum of
+ * every channel and how often it rained, so 'select' can answer
+ * aggregates over long ranges from a few buckets instead of scanning
+ * the records, and keeps answering after the records have been
+ * recycled.
+ *
+ * A tier is a ring of buckets, bucket number k in slot k % nslots, so
+ * its retention is its number of slots: a bucket is dropped when a
+ * newer one takes its slot, and a reading for a bucket that old is
+ * not counted.  Everything before the header's expired bucket is gone.
+ * A tier created next to an archive that already held readings never
+ * saw them, so its first bucket is only partial (since > 0).
+ */
+enum rollup_tier { TIER_HOUR, TIER_DAY, TIER_MONTH, NTIERS };
+
+const char *tier_names[NTIERS] = {"hourly", "daily", "monthly"};
+char *rollup_file_names[NTIERS] = {"rollup_hour.bin", "rollup_day.bin", "rollup_month.bin"};
+
+// retention of each tier, in buckets: three months of hours, five years of days, a century of months
+#define ROLLUP_HOURS (24 * 92)
+#define ROLLUP_DAYS (366 * 5)
+#define ROLLUP_MONTHS (12 * 100)
+
+#define ROLLUP_MAGIC 0x4c4c4f52 // "ROLL"
+#define ROLLUP_VERSION 1
+
+// one hour, day or month; empty while count is 0
+typedef struct {
+  uint32_t key;
+  uint32_t count;
+  uint32_t rain_obs; // readings that observed the rain at all (rained != 0)
+  uint32_t rain;     // readings with rain (rained == 2)
+  uint8_t min[3];
+  uint8_t max[3];
+  uint16_t pad;
+  uint64_t sum[3];
+} rollup_bucket_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t tier;
+  uint32_t nslots;
+  // seqlock over the buckets and the fields below (seqlock.h), even at rest
+  uint32_t seq;
+  uint32_t expired;
+  uint64_t observations;
+  // readings the record archive held when the tier was created
+  uint64_t since;
+  uint32_t first;
+  uint32_t pad;
+} rollup_header_t;
+
+typedef struct {
+  int fd;
+  enum rollup_tier tier;
+  size_t size;
+  rollup_header_t *hdr;
+  rollup_bucket_t *buckets;
+} rollup_t;
+
+// tier named hour, day or month, -1 for anything else
+int rollup_tier_index(const char *name) {
+  static const char *units[NTIERS] = {"hour", "day", "month"};
+  for (int t = 0; t < NTIERS; t++) {
+    if (strcmp(name, units[t]) == 0) {
+      return t;
+    }
+  }
+  return -1;
+}
+
+// the bucket a reading taken at minute counts into
+uint32_t rollup_key(enum rollup_tier tier, uint32_t minute) {
+  switch (tier) {
+  case TIER_HOUR:
+    return minute / 60;
+  case TIER_DAY:
+    return minute / 1440;
+  default:
+    return stamp_month(minute);
+  }
+}
+
+// first minute of bucket key
+uint32_t rollup_start(enum rollup_tier tier, uint32_t key) {
+  switch (tier) {
+  case TIER_HOUR:
+    return key * 60;
+  case TIER_DAY:
+    return key * 1440;
+  default:
+    return month_start(key);
+  }
+}
+
+void update_rollup(rollup_t *r, const record_t *reading) {
+  rollup_header_t *hdr = r->hdr;
+  uint32_t key = rollup_key(r->tier, reading->minute);
+  rollup_bucket_t *b = &r->buckets[key % hdr->nslots];
+  unsigned char values[3] = {reading->tmp, reading->prs, reading->hmd};
+
+  seq_write_begin(&hdr->seq);
+  if (hdr->observations == 0) {
+    hdr->first = key;
+  }
+  hdr->observations++;
+  if (key < hdr->expired || (b->count && key < b->key)) {
+    // older than the tier keeps
+    hdr->expired = key + 1 > hdr->expired ? key + 1 : hdr->expired;
+    seq_write_end(&hdr->seq);
+    return;
+  }
+  if (b->count && key != b->key) {
+    hdr->expired = b->key + 1 > hdr->expired ? b->key + 1 : hdr->expired;
+    b->count = 0;
+  }
+  if (b->count == 0) {
+    memset(b, 0, sizeof(*b));
+    b->key = key;
+    memset(b->min, 0xFF, sizeof(b->min));
+  }
+  b->count++;
+  b->rain_obs += reading->rained != 0;
+  b->rain += reading->rained == 2;
+  for (int c = 0; c < 3; c++) {
+    b->min[c] = values[c] < b->min[c] ? values[c] : b->min[c];
+    b->max[c] = values[c] > b->max[c] ? values[c] : b->max[c];
+    b->sum[c] += values[c];
+  }
+  seq_write_end(&hdr->seq);
+}
+
+/*
+ * Whether the tier holds every reading taken in minutes [lo, hi]: the
+ * range starts and ends on bucket boundaries (lo 0 and hi UINT32_MAX
+ * are open ends) and none of it has expired or predates the tier
+ */
+int rollup_covers(const rollup_t *r, uint32_t lo, uint32_t hi) {
+  uint32_t expired, first;
+  uint64_t since;
+  uint32_t s;
+  do {
+    s = seq_read_begin(&r->hdr->seq);
+    expired = r->hdr->expired;
+    first = r->hdr->first;
+    since = r->hdr->since;
+  } while (seq_read_retry(&r->hdr->seq, s));
+
+  uint32_t klo = lo ? rollup_key(r->tier, lo) : 0;
+  if ((lo && rollup_start(r->tier, klo) != lo) ||
+      (hi != UINT32_MAX && rollup_start(r->tier, rollup_key(r->tier, hi + 1)) != hi + 1)) {
+    return 0;
+  }
+  return klo >= expired && (since == 0 || klo > first);
+}
+
+/*
+ * Calls fn on a copy of every bucket starting in [lo, hi], in slot
+ * order; stops early when fn returns nonzero
+ */
+void scan_rollup(const rollup_t *r, uint32_t lo, uint32_t hi, int (*fn)(const rollup_bucket_t *, void *), void *arg) {
+  uint32_t klo = lo ? rollup_key(r->tier, lo) : 0;
+  uint32_t khi = rollup_key(r->tier, hi);
+  for (uint32_t i = 0; i < r->hdr->nslots; i++) {
+    rollup_bucket_t b;
+    uint32_t s;
+    do {
+      s = seq_read_begin(&r->hdr->seq);
+      b = r->buckets[i];
+    } while (seq_read_retry(&r->hdr->seq, s));
+    if (b.count && b.key >= klo && b.key <= khi && fn(&b, arg)) {
+      return;
+    }
+  }
+}
+
+/*
+ * Opens (creating if needed) and maps fname as the file of tier; a new
+ * tier notes that the archive already held since readings
+ * return value is 0 on success
+ */
+int construct_rollup(const char *fname, enum rollup_tier tier, rollup_t *r, uint64_t since) {
+  static const uint32_t nslots[NTIERS] = {ROLLUP_HOURS, ROLLUP_DAYS, ROLLUP_MONTHS};
+  struct stat st;
+  rollup_header_t hdr;
+
+  r->tier = tier;
+  r->size = sizeof(rollup_header_t) + nslots[tier] * sizeof(rollup_bucket_t);
+  r->fd = open(fname, O_RDWR | O_CREAT, (mode_t)0600);
+  if (r->fd == -1) {
+    perror("Error opening rollup file");
+    return -1;
+  }
+  if (fstat(r->fd, &st) == -1) {
+    perror("Error calling fstat()");
+    close(r->fd);
+    return -1;
+  }
+
+  int fresh = st.st_size == 0;
+  if (!fresh && (st.st_size != (off_t)r->size || pread(r->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+                 hdr.magic != ROLLUP_MAGIC || hdr.version != ROLLUP_VERSION || hdr.tier != (uint32_t)tier ||
+                 hdr.nslots != nslots[tier])) {
+    fprintf(stderr, "%s is not a %s rollup file\n", fname, tier_names[tier]);
+    close(r->fd);
+    return -1;
+  }
+  if (fresh && ftruncate(r->fd, r->size) == -1) {
+    perror("Error extending rollup file");
+    close(r->fd);
+    return -1;
+  }
+
+  char *map = (char *)mmap(0, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+  if (map == MAP_FAILED) {
+    perror("Error mapping rollup file");
+    close(r->fd);
+    return -1;
+  }
+  r->hdr = (rollup_header_t *)map;
+  r->buckets = (rollup_bucket_t *)(map + sizeof(rollup_header_t));
+  if (fresh) {
+    r->hdr->magic = ROLLUP_MAGIC;
+    r->hdr->version = ROLLUP_VERSION;
+    r->hdr->tier = tier;
+    r->hdr->nslots = nslots[tier];
+    r->hdr->since = since;
+  }
+  r->hdr->seq &= ~1u;
+  return 0;
+}
+
+int deconstruct_rollup(rollup_t *r) {
+  if (munmap(r->hdr, r->size) == -1) {
+    perror("Error un-mapping rollup file");
+    close(r->fd);
+    return -1;
+  }
+  close(r->fd);
+  return 0;
+}
+
+int compare_buckets(const void *a, const void *b) {
+  const rollup_bucket_t *x = a, *y = b;
+  if ((x->count == 0) != (y->count == 0)) {
+    return (x->count == 0) - (y->count == 0);
+  }
+  return (x->key > y->key) - (x->key < y->key);
+}
+
+/*
+ * Prints the buckets of the tier starting in minutes [lo, hi], oldest first
+ */
+void print_rollup(const rollup_t *r, uint32_t lo, uint32_t hi, FILE *out) {
+  uint32_t nslots = r->hdr->nslots;
+  rollup_bucket_t *copy = malloc(nslots * sizeof(rollup_bucket_t));
+  char stamp[STAMPLEN];
+  uint32_t s;
+
+  if (copy == NULL) {
+    fprintf(out, "Out of memory\n");
+    return;
+  }
+  do {
+    s = seq_read_begin(&r->hdr->seq);
+    memcpy(copy, r->buckets, nslots * sizeof(rollup_bucket_t));
+  } while (seq_read_retry(&r->hdr->seq, s));
+  qsort(copy, nslots, sizeof(rollup_bucket_t), compare_buckets);
+
+  fprintf(out, "%-16s %8s %4s %4s %7s %4s %4s %7s %4s %4s %7s %13s\n", tier_names[r->tier], "count", "tmin", "tmax",
+          "tmean", "pmin", "pmax", "pmean", "hmin", "hmax", "hmean", "rain");
+  for (uint32_t i = 0; i < nslots && copy[i].count; i++) {
+    const rollup_bucket_t *b = &copy[i];
+    uint32_t start = rollup_start(r->tier, b->key);
+    if (start < lo || start > hi) {
+      continue;
+    }
+    format_stamp(start, stamp);
+    fprintf(out, "%.4s-%.2s-%.2s %.2s:00 %8u", stamp, stamp + 4, stamp + 6, stamp + 8, b->count);
+    for (int c = 0; c < 3; c++) {
+      fprintf(out, " %4u %4u %7.2f", b->min[c], b->max[c], (double)b->sum[c] / b->count);
+    }
+    fprintf(out, " %6u/%-6u\n", b->rain, b->rain_obs);
+  }
+  free(copy);
+}
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef scheduler_h_
+#define scheduler_h_
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Deadline scheduler for the data loop.
+ *
+ * Every job has a period of its own and its next deadline on
+ * CLOCK_MONOTONIC; the jobs are kept in a binary min-heap on that
+ * deadline and one timerfd is armed (absolute) for the earliest, so
+ * the loop wakes exactly when something is due however many jobs and
+ * periods there are.
+ *
+ * Deadlines stay on each job's grid (start + k * period) and are never
+ * made up in a burst: a job popped a whole period or more late counts
+ * the deadlines it slept through as missed and moves on to the next one
+ * in the future.  The owner counts a deadline it could not serve as
+ * missed too (sched_miss).
+ */
+#define SCHED_MAXJOBS 64
+
+typedef struct {
+  uint64_t period_ns;
+  uint64_t due_ns;
+  int owner;     // what the job is for, up to the caller
+  int channel;
+  uint64_t fired;
+  uint64_t missed;
+} sched_job_t;
+
+typedef struct {
+  int timer_fd;
+  int njobs;
+  sched_job_t jobs[SCHED_MAXJOBS];
+  // indices into jobs, heap[0] due first
+  int heap[SCHED_MAXJOBS];
+} scheduler_t;
+
+uint64_t sched_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int sched_before(scheduler_t *s, int a, int b) {
+  const sched_job_t *x = &s->jobs[s->heap[a]], *y = &s->jobs[s->heap[b]];
+  return x->due_ns < y->due_ns || (x->due_ns == y->due_ns && s->heap[a] < s->heap[b]);
+}
+
+void sched_swap(scheduler_t *s, int a, int b) {
+  int t = s->heap[a];
+  s->heap[a] = s->heap[b];
+  s->heap[b] = t;
+}
+
+void sched_sift_up(scheduler_t *s, int i) {
+  while (i > 0 && sched_before(s, i, (i - 1) / 2)) {
+    sched_swap(s, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+void sched_sift_down(scheduler_t *s, int i) {
+  for (;;) {
+    int least = i;
+    for (int c = 2 * i + 1; c <= 2 * i + 2 && c < s->njobs; c++) {
+      if (sched_before(s, c, least)) {
+        least = c;
+      }
+    }
+    if (least == i) {
+      return;
+    }
+    sched_swap(s, i, least);
+    i = least;
+  }
+}
+
+/*
+ * Creates the timer
+ * returns 0 on success
+ */
+int sched_init(scheduler_t *s) {
+  memset(s, 0, sizeof(*s));
+  s->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (s->timer_fd == -1) {
+    perror("Error creating timerfd");
+    return -1;
+  }
+  return 0;
+}
+
+void sched_destroy(scheduler_t *s) { close(s->timer_fd); }
+
+/*
+ * Adds a job due now and every period_ms after
+ * returns its index, or -1 if there are too many
+ */
+int sched_add(scheduler_t *s, int owner, int channel, long period_ms) {
+  if (s->njobs == SCHED_MAXJOBS || period_ms < 1) {
+    return -1;
+  }
+  int j = s->njobs++;
+  sched_job_t *job = &s->jobs[j];
+  memset(job, 0, sizeof(*job));
+  job->period_ns = period_ms * 1000000ULL;
+  job->due_ns = sched_now();
+  job->owner = owner;
+  job->channel = channel;
+  s->heap[j] = j;
+  sched_sift_up(s, j);
+  return j;
+}
+
+/*
+ * Points the timer at the earliest deadline (one already past fires at
+ * once; a zero would disarm it, but monotonic time is never 0); call it
+ * after taking every due job
+ */
+int sched_arm(scheduler_t *s) {
+  struct itimerspec when;
+  memset(&when, 0, sizeof(when));
+  if (s->njobs) {
+    uint64_t due = s->jobs[s->heap[0]].due_ns;
+    when.it_value.tv_sec = due / 1000000000ULL;
+    when.it_value.tv_nsec = due % 1000000000ULL;
+  }
+  return timerfd_settime(s->timer_fd, TFD_TIMER_ABSTIME, &when, NULL);
+}
+
+/*
+ * Takes the earliest job if it is due at now and moves it to its next
+ * deadline after now; *late is how long after its deadline it was taken.
+ * Returns the job's index, -1 when nothing is due.
+ */
+int sched_next(scheduler_t *s, uint64_t now, uint64_t *late) {
+  if (s->njobs == 0) {
+    return -1;
+  }
+  int j = s->heap[0];
+  sched_job_t *job = &s->jobs[j];
+  if (job->due_ns > now) {
+    return -1;
+  }
+  uint64_t skipped = (now - job->due_ns) / job->period_ns;
+  *late = now - job->due_ns;
+  job->fired++;
+  job->missed += skipped;
+  job->due_ns += (skipped + 1) * job->period_ns;
+  sched_sift_down(s, 0);
+  return j;
+}
+
+// counts a deadline of job j its owner could not serve
+void sched_miss(scheduler_t *s, int j) { s->jobs[j].missed++; }
+
+#endif
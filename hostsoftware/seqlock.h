@@ -0,0 +1,43 @@
+#ifndef seqlock_h_
+#define seqlock_h_
+#include <sched.h>
+#include <stdint.h>
+
+/*
+ * Sequence locks for state one writer updates in place in a shared
+ * mapping while any number of readers (threads or processes) copy it.
+ *
+ * The writer makes the sequence odd, updates, and makes it even again;
+ * it never waits.  A reader notes an even sequence, copies what it needs
+ * and retries if the sequence has moved since, so it only ever keeps a
+ * copy no update overlapped.  Readers never write, so they cost ingest
+ * nothing but the two stores per update.
+ *
+ *   uint32_t s;
+ *   do {
+ *     s = seq_read_begin(&hdr->seq);
+ *     ... copy ...
+ *   } while (seq_read_retry(&hdr->seq, s));
+ */
+static inline void seq_write_begin(uint32_t *seq) {
+  __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+  // orders the odd sequence before the update's stores (free on x86)
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seq_write_end(uint32_t *seq) { __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE); }
+
+static inline uint32_t seq_read_begin(const uint32_t *seq) {
+  uint32_t s;
+  while ((s = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1) {
+    sched_yield();
+  }
+  return s;
+}
+
+static inline int seq_read_retry(const uint32_t *seq, uint32_t start) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(seq, __ATOMIC_RELAXED) != start;
+}
+
+#endif
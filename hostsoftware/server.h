@@ -0,0 +1,244 @@
+#ifndef server_h_
+#define server_h_
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "archive.h"
+
+/*
+ * Query server for local clients, run on threads of the data process.
+ *
+ * It listens on a unix domain stream socket; every connection gets a
+ * thread of its own that reads commands one per line, answers each with
+ * the handler, and closes the connection once the client has shut down
+ * its end, e.g.
+ *
+ *   echo "hist t" | nc -U host.sock
+ *
+ * A client thread reads the archive through its own view (its own
+ * segment mappings, see open_record_view) and the seqlocks of the shared
+ * state, so a slow client never holds up ingest and never sees half an
+ * update.  Only read-only commands make sense here; the handler decides.
+ * With several stations the handler is given all their archives and the
+ * station the connection picked last (0 to begin with).
+ */
+#define SERVER_SOCKET "host.sock"
+#define SERVER_MAXCLIENTS 64
+
+typedef int (*server_handler_t)(archive_t *archives, int narchives, int *station, const char *line, FILE *out);
+
+typedef struct {
+  int fd;
+  int used;
+  int done;
+  pthread_t thread;
+  struct server *server;
+} server_client_t;
+
+typedef struct server {
+  char path[108];
+  int listen_fd;
+  int stop_fd;
+  pthread_t thread;
+  int running;
+  archive_t *archives;
+  int narchives;
+  server_handler_t handle;
+  pthread_mutex_t lock;
+  server_client_t clients[SERVER_MAXCLIENTS];
+} server_t;
+
+void *server_client_main(void *arg) {
+  server_client_t *client = arg;
+  server_t *server = client->server;
+  archive_t *views = malloc(server->narchives * sizeof(archive_t));
+  int station = 0;
+  char *line = NULL;
+  size_t len = 0;
+
+  for (int i = 0; views && i < server->narchives; i++) {
+    views[i] = server->archives[i];
+    open_record_view(&server->archives[i].record, &views[i].record);
+  }
+  int in_fd = dup(client->fd);
+  FILE *in = in_fd == -1 ? NULL : fdopen(in_fd, "r");
+  FILE *out = fdopen(client->fd, "w");
+  if (views && in && out) {
+    while (getline(&line, &len, in) > 0) {
+      server->handle(views, server->narchives, &station, line, out);
+      if (fflush(out) == EOF) {
+        break;
+      }
+    }
+  }
+  free(line);
+  for (int i = 0; views && i < server->narchives; i++) {
+    close_record_view(&views[i].record);
+  }
+  free(views);
+
+  // server_stop may still shut the socket down until it is given up here
+  pthread_mutex_lock(&server->lock);
+  client->done = 1;
+  pthread_mutex_unlock(&server->lock);
+  if (in) {
+    fclose(in);
+  } else if (in_fd != -1) {
+    close(in_fd);
+  }
+  if (out) {
+    fclose(out);
+  } else {
+    close(client->fd);
+  }
+  return NULL;
+}
+
+// joins the threads of clients that have gone, under server->lock
+void server_reap(server_t *server) {
+  for (int i = 0; i < SERVER_MAXCLIENTS; i++) {
+    server_client_t *c = &server->clients[i];
+    if (c->used && c->done) {
+      pthread_join(c->thread, NULL);
+      c->used = 0;
+    }
+  }
+}
+
+void *server_main(void *arg) {
+  server_t *server = arg;
+  struct pollfd fds[2] = {{server->listen_fd, POLLIN, 0}, {server->stop_fd, POLLIN, 0}};
+
+  for (;;) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("Error polling the query socket");
+      return NULL;
+    }
+    if (fds[1].revents) {
+      return NULL;
+    }
+    int fd = accept(server->listen_fd, NULL, NULL);
+    if (fd == -1) {
+      continue;
+    }
+
+    pthread_mutex_lock(&server->lock);
+    server_reap(server);
+    server_client_t *client = NULL;
+    for (int i = 0; i < SERVER_MAXCLIENTS && client == NULL; i++) {
+      if (!server->clients[i].used) {
+        client = &server->clients[i];
+      }
+    }
+    if (client) {
+      *client = (server_client_t){fd, 1, 0, 0, server};
+      if (pthread_create(&client->thread, NULL, server_client_main, client)) {
+        client->used = 0;
+        client = NULL;
+      }
+    }
+    pthread_mutex_unlock(&server->lock);
+    if (client == NULL) {
+      const char busy[] = "Too many clients\n";
+      if (write(fd, busy, sizeof(busy) - 1) == -1) {
+        // closing it says as much
+      }
+      close(fd);
+    }
+  }
+}
+
+/*
+ * Listens on path (replacing a stale socket) and starts serving the
+ * narchives archives
+ * returns 0 on success
+ */
+int server_start(server_t *server, const char *path, archive_t *archives, int narchives, server_handler_t handle) {
+  struct sockaddr_un addr;
+
+  memset(server, 0, sizeof(*server));
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path %s is too long\n", path);
+    return -1;
+  }
+  snprintf(server->path, sizeof(server->path), "%s", path);
+  server->archives = archives;
+  server->narchives = narchives;
+  server->handle = handle;
+  pthread_mutex_init(&server->lock, NULL);
+
+  // a client hanging up mid reply must not kill the data process
+  signal(SIGPIPE, SIG_IGN);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, path, strlen(path));
+  unlink(path);
+  server->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (server->listen_fd == -1 || bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(server->listen_fd, 16) == -1) {
+    perror("Error listening on the query socket");
+    if (server->listen_fd != -1) {
+      close(server->listen_fd);
+    }
+    return -1;
+  }
+  server->stop_fd = eventfd(0, EFD_CLOEXEC);
+  if (server->stop_fd == -1 || pthread_create(&server->thread, NULL, server_main, server)) {
+    perror("Error starting the query server");
+    close(server->listen_fd);
+    if (server->stop_fd != -1) {
+      close(server->stop_fd);
+    }
+    unlink(path);
+    return -1;
+  }
+  server->running = 1;
+  return 0;
+}
+
+/*
+ * Stops accepting, hangs up on every client and waits for their threads
+ */
+void server_stop(server_t *server) {
+  uint64_t one = 1;
+  if (!server->running) {
+    return;
+  }
+  if (write(server->stop_fd, &one, sizeof(one)) == -1) {
+    perror("Error stopping the query server");
+  }
+  pthread_join(server->thread, NULL);
+
+  pthread_mutex_lock(&server->lock);
+  for (int i = 0; i < SERVER_MAXCLIENTS; i++) {
+    if (server->clients[i].used && !server->clients[i].done) {
+      shutdown(server->clients[i].fd, SHUT_RDWR);
+    }
+  }
+  pthread_mutex_unlock(&server->lock);
+  for (int i = 0; i < SERVER_MAXCLIENTS; i++) {
+    if (server->clients[i].used) {
+      pthread_join(server->clients[i].thread, NULL);
+      server->clients[i].used = 0;
+    }
+  }
+
+  close(server->listen_fd);
+  close(server->stop_fd);
+  unlink(server->path);
+  server->running = 0;
+}
+
+#endif
@@ -0,0 +1,238 @@
+#ifndef stats_h_
+#define stats_h_
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "seqlock.h"
+
+/*
+ * Rolling aggregates per channel, updated in O(1) (amortized) per reading
+ * so 'stats' never has to go back to the archive.
+ *
+ * For every channel there is one window per entry of STATS_WINDOWS plus an
+ * all time aggregate.  A window keeps the samples it covers in a ring so
+ * they can be expired, monotonic deques of ring positions for min and max,
+ * and a Welford mean/variance that samples are added to and removed from.
+ * Windows are measured on the readings' own timestamps, not wall time.
+ */
+
+// window lengths in minutes: last hour and last 24 hours
+#define STATS_WINDOWS {60, 24 * 60}
+#define NWINDOWS 2
+// samples a window can hold; if it overflows the oldest are expired early
+#define WINDOW_CAP 4096
+// weight of the newest reading in the exponentially weighted average
+#define EWMA_ALPHA 0.1
+
+// tmp, prs, hmd, and the rain rate (1 for rain, 0 for no rain)
+#define NCHANNELS 4
+
+typedef struct {
+  uint32_t minute;
+  uint32_t value;
+} sample_t;
+
+typedef struct {
+  uint64_t n;
+  double mean;
+  double m2;
+  uint32_t min;
+  uint32_t max;
+} welford_t;
+
+typedef struct {
+  uint32_t span;
+  // samples in the window live at ring positions [head, tail)
+  uint64_t head;
+  uint64_t tail;
+  sample_t ring[WINDOW_CAP];
+  // ring positions with increasing values (minq) and decreasing values (maxq)
+  uint64_t minq[WINDOW_CAP];
+  uint64_t minq_head, minq_tail;
+  uint64_t maxq[WINDOW_CAP];
+  uint64_t maxq_head, maxq_tail;
+  welford_t w;
+} window_t;
+
+typedef struct {
+  window_t windows[NWINDOWS];
+  welford_t all;
+  double ewma;
+  uint32_t latest;
+} channel_stats_t;
+
+typedef struct {
+  // seqlock over every channel (seqlock.h)
+  uint32_t seq;
+  channel_stats_t channels[NCHANNELS];
+} stats_t;
+
+void welford_add(welford_t *w, double x) {
+  w->n++;
+  double delta = x - w->mean;
+  w->mean += delta / w->n;
+  w->m2 += delta * (x - w->mean);
+}
+
+void welford_remove(welford_t *w, double x) {
+  if (w->n <= 1) {
+    memset(w, 0, sizeof(*w));
+    return;
+  }
+  double delta = x - w->mean;
+  w->mean -= delta / (w->n - 1);
+  w->m2 -= delta * (x - w->mean);
+  w->n--;
+  if (w->m2 < 0) {
+    w->m2 = 0;
+  }
+}
+
+double welford_stddev(const welford_t *w) { return w->n > 1 ? sqrt(w->m2 / (w->n - 1)) : 0.0; }
+
+// drops the oldest sample of the window
+void window_expire_one(window_t *win) {
+  uint64_t pos = win->head++;
+  welford_remove(&win->w, win->ring[pos % WINDOW_CAP].value);
+  if (win->minq_head < win->minq_tail && win->minq[win->minq_head % WINDOW_CAP] == pos) {
+    win->minq_head++;
+  }
+  if (win->maxq_head < win->maxq_tail && win->maxq[win->maxq_head % WINDOW_CAP] == pos) {
+    win->maxq_head++;
+  }
+}
+
+void window_add(window_t *win, uint32_t minute, uint32_t latest, uint32_t value) {
+  // expire everything that fell out of the window, and make room
+  while (win->head < win->tail && win->ring[win->head % WINDOW_CAP].minute + win->span <= latest) {
+    window_expire_one(win);
+  }
+  if (win->tail - win->head == WINDOW_CAP) {
+    window_expire_one(win);
+  }
+
+  uint64_t pos = win->tail++;
+  win->ring[pos % WINDOW_CAP].minute = minute;
+  win->ring[pos % WINDOW_CAP].value = value;
+  welford_add(&win->w, value);
+
+  while (win->minq_tail > win->minq_head && win->ring[win->minq[(win->minq_tail - 1) % WINDOW_CAP] % WINDOW_CAP].value >= value) {
+    win->minq_tail--;
+  }
+  win->minq[win->minq_tail++ % WINDOW_CAP] = pos;
+  while (win->maxq_tail > win->maxq_head && win->ring[win->maxq[(win->maxq_tail - 1) % WINDOW_CAP] % WINDOW_CAP].value <= value) {
+    win->maxq_tail--;
+  }
+  win->maxq[win->maxq_tail++ % WINDOW_CAP] = pos;
+
+  win->w.min = win->ring[win->minq[win->minq_head % WINDOW_CAP] % WINDOW_CAP].value;
+  win->w.max = win->ring[win->maxq[win->maxq_head % WINDOW_CAP] % WINDOW_CAP].value;
+}
+
+/*
+ * Maps the stats into memory shared with processes forked afterwards
+ * returns NULL on error
+ */
+stats_t *construct_stats(void) {
+  uint32_t spans[NWINDOWS] = STATS_WINDOWS;
+  stats_t *stats = mmap(0, sizeof(stats_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (stats == MAP_FAILED) {
+    perror("Error mapping stats");
+    return NULL;
+  }
+  memset(stats, 0, sizeof(*stats));
+  for (int c = 0; c < NCHANNELS; c++) {
+    for (int w = 0; w < NWINDOWS; w++) {
+      stats->channels[c].windows[w].span = spans[w];
+    }
+  }
+  return stats;
+}
+
+void update_channel(channel_stats_t *ch, uint32_t minute, uint32_t value) {
+  if (minute > ch->latest) {
+    ch->latest = minute;
+  }
+  for (int w = 0; w < NWINDOWS; w++) {
+    window_add(&ch->windows[w], minute, ch->latest, value);
+  }
+  ch->ewma = ch->all.n ? ch->ewma + EWMA_ALPHA * (value - ch->ewma) : value;
+  welford_add(&ch->all, value);
+  ch->all.min = (ch->all.n == 1 || value < ch->all.min) ? value : ch->all.min;
+  ch->all.max = (ch->all.n == 1 || value > ch->all.max) ? value : ch->all.max;
+}
+
+/*
+ * Folds one reading into every channel
+ * rained is 0 for no observation (skipped), 1 for no rain and 2 for rain
+ */
+void update_stats(stats_t *stats, uint32_t minute, unsigned char tmp, unsigned char prs, unsigned char hmd,
+                  unsigned char rained) {
+  seq_write_begin(&stats->seq);
+  update_channel(&stats->channels[0], minute, tmp);
+  update_channel(&stats->channels[1], minute, prs);
+  update_channel(&stats->channels[2], minute, hmd);
+  if (rained) {
+    update_channel(&stats->channels[3], minute, rained == 2);
+  }
+  seq_write_end(&stats->seq);
+}
+
+void print_welford(FILE *out, const char *name, const char *window, const welford_t *w, double ewma) {
+  if (w->n == 0) {
+    fprintf(out, "%-12s %-8s %8s\n", name, window, "0");
+    return;
+  }
+  fprintf(out, "%-12s %-8s %8llu %6u %6u %8.2f %8.2f", name, window, (unsigned long long)w->n, w->min, w->max,
+          w->mean, welford_stddev(w));
+  if (ewma >= 0) {
+    fprintf(out, " %8.2f", ewma);
+  }
+  fprintf(out, "\n");
+}
+
+/*
+ * Prints every channel's windows and all time aggregate
+ * (the rain rate is a fraction of observed readings, so only its mean is meaningful)
+ */
+int print_stats(stats_t *stats, FILE *out) {
+  const char *channel_names[NCHANNELS] = {"Temperature", "Pressure", "Humidity", "Rain rate"};
+  char window[16];
+  // the aggregates as of one instant, without the windows' sample rings
+  welford_t windows[NCHANNELS][NWINDOWS], all[NCHANNELS];
+  uint32_t spans[NCHANNELS][NWINDOWS];
+  double ewma[NCHANNELS];
+  uint32_t s;
+  do {
+    s = seq_read_begin(&stats->seq);
+    for (int c = 0; c < NCHANNELS; c++) {
+      for (int w = 0; w < NWINDOWS; w++) {
+        windows[c][w] = stats->channels[c].windows[w].w;
+        spans[c][w] = stats->channels[c].windows[w].span;
+      }
+      all[c] = stats->channels[c].all;
+      ewma[c] = stats->channels[c].ewma;
+    }
+  } while (seq_read_retry(&stats->seq, s));
+
+  fprintf(out, "Channel      Window          n    min    max     mean   stddev     ewma\n");
+  fprintf(out, "-----------------------------------------------------------------------\n");
+  for (int c = 0; c < NCHANNELS; c++) {
+    for (int w = 0; w < NWINDOWS; w++) {
+      if (spans[c][w] % 60 == 0) {
+        snprintf(window, sizeof(window), "%uh", spans[c][w] / 60);
+      } else {
+        snprintf(window, sizeof(window), "%um", spans[c][w]);
+      }
+      print_welford(out, channel_names[c], window, &windows[c][w], -1);
+    }
+    print_welford(out, channel_names[c], "all", &all[c], ewma[c]);
+  }
+  fprintf(out, "\n");
+  return 0;
+}
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef timecodec_h_
+#define timecodec_h_
+#include <stdint.h>
+
+/*
+ * The Arduino sends timestamps as 12 ASCII digits, yyyymmddhhmm.
+ * They are converted once at ingest into minutes since 1970-01-01 00:00,
+ * which fits in 32 bits until the year 10136, compares as an integer,
+ * and gives the hour of day as (minute / 60) % 24.
+ *
+ * Both directions are straight line integer arithmetic (Howard Hinnant's
+ * days_from_civil / civil_from_days with the March based year), with no
+ * loops over months and no branches besides what compiles to setcc.
+ * Parsing checks the fields first: a stamp before 1970 or with a field
+ * out of range (month 13, Feb 30, hour 24) is STAMP_INVALID rather than
+ * a key that wraps or rolls over into the next month.
+ */
+#define STAMPLEN 12
+// what parse_stamp returns for a bad stamp, past any key of a year < 10000
+#define STAMP_INVALID UINT32_MAX
+
+#define DIGIT2(s, i) (((s)[i] - '0') * 10 + ((s)[(i) + 1] - '0'))
+
+// days since 1970-01-01 of y-m-d
+int64_t days_from_civil(int y, int m, int d) {
+  // years start in March so the leap day is the last day of the year,
+  // shifted by one 400 year era so everything stays positive
+  int jan_feb = m <= 2;
+  int y400 = y - jan_feb + 400;
+  int era = y400 / 400;
+  int yoe = y400 - era * 400;
+  int doy = (153 * (m + 9 - 12 * !jan_feb) + 2) / 5 + d - 1;
+  int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return (int64_t)era * 146097 + doe - 719468 - 146097;
+}
+
+// 1 if s starts with STAMPLEN digits
+int valid_stamp(const char *s) {
+  for (int i = 0; i < STAMPLEN; i++) {
+    if (s[i] < '0' || s[i] > '9') {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// the minute epoch of the stamp s starts with, STAMP_INVALID if it is not a date from 1970 on
+uint32_t parse_stamp(const char *s) {
+  static const int month_days[12] = {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+  if (!valid_stamp(s)) {
+    return STAMP_INVALID;
+  }
+  int y = DIGIT2(s, 0) * 100 + DIGIT2(s, 2);
+  int m = DIGIT2(s, 4);
+  int d = DIGIT2(s, 6);
+  int hh = DIGIT2(s, 8);
+  int mm = DIGIT2(s, 10);
+  int leap = (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+  if (y < 1970 || m < 1 || m > 12 || d < 1 || d > month_days[m - 1] || (m == 2 && d == 29 && !leap) || hh > 23 ||
+      mm > 59) {
+    return STAMP_INVALID;
+  }
+  return (uint32_t)(days_from_civil(y, m, d) * 1440 + hh * 60 + mm);
+}
+
+// writes the STAMPLEN digits of minute into out (not null terminated)
+void format_stamp(uint32_t minute, char *out) {
+  uint32_t z = minute / 1440 + 719468;
+  uint32_t in_day = minute % 1440;
+  uint32_t era = z / 146097;
+  uint32_t doe = z - era * 146097;
+  uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  uint32_t mp = (5 * doy + 2) / 153;
+  uint32_t d = doy - (153 * mp + 2) / 5 + 1;
+  uint32_t m = mp + 3 - 12 * (mp >= 10);
+  uint32_t y = yoe + era * 400 + (m <= 2);
+  uint32_t hh = in_day / 60;
+  uint32_t mm = in_day % 60;
+
+  out[0] = '0' + y / 1000 % 10;
+  out[1] = '0' + y / 100 % 10;
+  out[2] = '0' + y / 10 % 10;
+  out[3] = '0' + y % 10;
+  out[4] = '0' + m / 10;
+  out[5] = '0' + m % 10;
+  out[6] = '0' + d / 10;
+  out[7] = '0' + d % 10;
+  out[8] = '0' + hh / 10;
+  out[9] = '0' + hh % 10;
+  out[10] = '0' + mm / 10;
+  out[11] = '0' + mm % 10;
+}
+
+// hour of day (0-23) of a minute epoch
+int stamp_hour(uint32_t minute) { return (minute / 60) % 24; }
+
+// calendar month of a minute epoch, counted as y * 12 + m - 1
+uint32_t stamp_month(uint32_t minute) {
+  uint32_t z = minute / 1440 + 719468;
+  uint32_t era = z / 146097;
+  uint32_t doe = z - era * 146097;
+  uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  uint32_t mp = (5 * doy + 2) / 153;
+  uint32_t m = mp + 3 - 12 * (mp >= 10);
+  uint32_t y = yoe + era * 400 + (m <= 2);
+  return y * 12 + m - 1;
+}
+
+// first minute of a month counted as in stamp_month
+uint32_t month_start(uint32_t month) { return (uint32_t)(days_from_civil(month / 12, month % 12 + 1, 1) * 1440); }
+
+#endif
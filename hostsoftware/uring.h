@@ -0,0 +1,179 @@
+#ifndef uring_h_
+#define uring_h_
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * Just enough io_uring for the data loop, on the raw system calls.
+ *
+ * Requests are queued with uring_sqe/uring_prep and only reach the
+ * kernel with the next uring_enter, which submits everything queued
+ * and waits for completions in the same system call; completions are
+ * then taken with uring_peek without any system call at all.  So a
+ * loop that keeps reads outstanding and queues its writes makes one
+ * system call per wakeup however many descriptors it serves.
+ *
+ * Only the data process uses a ring, from one thread.
+ */
+typedef struct {
+  int fd;
+  unsigned entries;
+  unsigned features; // IORING_FEAT_*
+  // submission queue: indices into sqes, published by moving the tail
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned queued_tail; // sq tail including what uring_enter has not published yet
+  // completion queue
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+  uint64_t enters; // io_uring_enter calls made
+} uring_t;
+
+/*
+ * Sets up a ring of (at least) entries submissions
+ * returns 0 on success, -errno if the kernel has no io_uring for us
+ */
+int uring_init(uring_t *u, unsigned entries) {
+  struct io_uring_params p;
+
+  memset(u, 0, sizeof(*u));
+  memset(&p, 0, sizeof(p));
+  u->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (u->fd == -1) {
+    return -errno;
+  }
+  u->entries = p.sq_entries;
+  u->features = p.features;
+  u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                    IORING_OFF_SQ_RING);
+  u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                    IORING_OFF_CQ_RING);
+  u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+    int err = -errno;
+    if (u->sq_ring != MAP_FAILED) {
+      munmap(u->sq_ring, u->sq_ring_size);
+    }
+    if (u->cq_ring != MAP_FAILED) {
+      munmap(u->cq_ring, u->cq_ring_size);
+    }
+    if (u->sqes != MAP_FAILED) {
+      munmap(u->sqes, u->sqes_size);
+    }
+    close(u->fd);
+    return err;
+  }
+
+  char *sq = u->sq_ring, *cq = u->cq_ring;
+  u->sq_head = (unsigned *)(sq + p.sq_off.head);
+  u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  u->sq_array = (unsigned *)(sq + p.sq_off.array);
+  u->queued_tail = *u->sq_tail;
+  u->cq_head = (unsigned *)(cq + p.cq_off.head);
+  u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return 0;
+}
+
+// closing the ring cancels whatever is still outstanding
+void uring_destroy(uring_t *u) {
+  munmap(u->sqes, u->sqes_size);
+  munmap(u->cq_ring, u->cq_ring_size);
+  munmap(u->sq_ring, u->sq_ring_size);
+  close(u->fd);
+}
+
+/*
+ * The next free submission entry, cleared, NULL when the queue is full
+ * (uring_enter and try again)
+ */
+struct io_uring_sqe *uring_sqe(uring_t *u) {
+  unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+  if (u->queued_tail - head >= u->entries) {
+    return NULL;
+  }
+  unsigned idx = u->queued_tail++ & *u->sq_mask;
+  u->sq_array[idx] = idx;
+  memset(&u->sqes[idx], 0, sizeof(u->sqes[idx]));
+  return &u->sqes[idx];
+}
+
+// a read or write of len bytes at addr; offset -1 is the file position
+void uring_prep(struct io_uring_sqe *sqe, int op, int fd, const void *addr, unsigned len, uint64_t offset,
+                uint64_t data) {
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)addr;
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->user_data = data;
+}
+
+/*
+ * Posts no completion for sqe unless it fails, where the kernel can
+ * (5.17 on), so a write that went through does not wake the waiter
+ */
+void uring_quiet(uring_t *u, struct io_uring_sqe *sqe) {
+#ifdef IORING_FEAT_CQE_SKIP
+  if (u->features & IORING_FEAT_CQE_SKIP) {
+    sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+  }
+#else
+  (void)u;
+  (void)sqe;
+#endif
+}
+
+/*
+ * Submits everything queued and waits until at least wait completions
+ * are ready
+ * returns 0 on success, -errno otherwise (-EINTR on a signal)
+ */
+int uring_enter(uring_t *u, unsigned wait) {
+  // anything the kernel has not consumed yet, e.g. after an EINTR
+  unsigned submit = u->queued_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+  // the entries must be visible before the kernel sees the new tail
+  __atomic_store_n(u->sq_tail, u->queued_tail, __ATOMIC_RELEASE);
+  u->enters++;
+  int res = syscall(__NR_io_uring_enter, u->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  return res < 0 ? -errno : 0;
+}
+
+/*
+ * Takes the oldest completion into cqe
+ * returns 1 if there was one, 0 otherwise
+ */
+int uring_peek(uring_t *u, struct io_uring_cqe *cqe) {
+  unsigned head = *u->cq_head;
+  if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  *cqe = u->cqes[head & *u->cq_mask];
+  __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+#endif
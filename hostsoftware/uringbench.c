@@ -0,0 +1,288 @@
+#define _GNU_SOURCE
+
+#include "arduinocom.h"
+#include "uring.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Round trips of the data loop's serial I/O, epoll against io_uring.
+ * Every device is a pseudo terminal whose other side a child process
+ * answers like the sketch, REQUEST(n) with n DATA frames.  Each round
+ * asks every device for a batch and waits for all of them, the way one
+ * sampling wakeup of host does: with epoll_wait and plain reads and
+ * writes (dev_request, dev_recv), or with the REQUESTs queued on a ring
+ * and reads kept outstanding, one io_uring_enter per wakeup.
+ * Read and write system calls are taken from /proc/self/io, the waits
+ * are counted by the loop.
+ *
+ * usage: uringbench [DEVICES [BATCH [ROUNDS]]]
+ */
+#define URING_RXBUF 4096
+#define URING_WRITE_TAG (1ULL << 32)
+
+double seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// read and write system calls this process has made
+uint64_t io_syscalls(void) {
+  unsigned long long syscr = 0, syscw = 0;
+  char line[128];
+  FILE *f = fopen("/proc/self/io", "r");
+  if (f == NULL) {
+    return 0;
+  }
+  while (fgets(line, sizeof(line), f)) {
+    sscanf(line, "syscr: %llu", &syscr);
+    sscanf(line, "syscw: %llu", &syscw);
+  }
+  fclose(f);
+  return syscr + syscw;
+}
+
+// the sketch's side: answers every REQUEST until the host side closes
+void serve(int *masters, int ndevs) {
+  frame_parser_t parsers[MAXDEVICES];
+  struct pollfd pfds[MAXDEVICES];
+  unsigned char reply[REPLYLEN], data[FRAME_MAXLEN], out[255 * FRAME_MAXLEN];
+
+  memset(parsers, 0, sizeof(parsers));
+  memset(reply, '0', sizeof(reply));
+  int data_len = frame_encode(DATA, reply, REPLYLEN, data);
+  for (int i = 0; i < ndevs; i++) {
+    pfds[i].fd = masters[i];
+    pfds[i].events = POLLIN;
+  }
+  while (poll(pfds, ndevs, -1) > 0) {
+    for (int i = 0; i < ndevs; i++) {
+      frame_parser_t *p = &parsers[i];
+      unsigned char type, payload[FRAME_MAXPAYLOAD];
+      int len;
+      if (pfds[i].revents & (POLLHUP | POLLERR)) {
+        return;
+      }
+      if (!(pfds[i].revents & POLLIN)) {
+        continue;
+      }
+      int n = read(masters[i], p->buf + p->len, sizeof(p->buf) - p->len);
+      if (n <= 0) {
+        return;
+      }
+      p->len += n;
+      while (frame_next(p, &type, payload, &len)) {
+        if (type != REQUEST || len != 1) {
+          continue;
+        }
+        int out_len = 0;
+        for (int r = 0; r < payload[0]; r++, out_len += data_len) {
+          memcpy(out + out_len, data, data_len);
+        }
+        for (int done = 0; done < out_len;) {
+          int w = write(masters[i], out + done, out_len - done);
+          if (w < 0 && errno != EAGAIN && errno != EINTR) {
+            return;
+          }
+          done += w > 0 ? w : 0;
+        }
+      }
+    }
+  }
+}
+
+/*
+ * Opens ndevs pseudo terminals, host sides into devs, and forks the
+ * process answering on the other sides
+ * returns its pid, -1 on failure
+ */
+pid_t open_devices(struct device *devs, int ndevs) {
+  int masters[MAXDEVICES];
+  for (int i = 0; i < ndevs; i++) {
+    masters[i] = posix_openpt(O_RDWR | O_NOCTTY);
+    if (masters[i] == -1 || grantpt(masters[i]) == -1 || unlockpt(masters[i]) == -1) {
+      perror("Error opening a pseudo terminal");
+      return -1;
+    }
+    int fd = open(ptsname(masters[i]), O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd == -1 || init_tty(fd, B115200)) {
+      perror("Error opening the host side");
+      return -1;
+    }
+    dev_init(&devs[i], fd);
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    for (int i = 0; i < ndevs; i++) {
+      close(devs[i].fd);
+    }
+    serve(masters, ndevs);
+    _exit(0);
+  }
+  for (int i = 0; i < ndevs; i++) {
+    close(masters[i]);
+  }
+  return pid;
+}
+
+// non-blocking with VMIN = 0 for epoll, blocking with VMIN = 1 for io_uring
+void set_blocking(struct device *devs, int ndevs, int blocking) {
+  for (int i = 0; i < ndevs; i++) {
+    struct termios tty;
+    if (tcgetattr(devs[i].fd, &tty) == 0) {
+      tty.c_cc[VMIN] = blocking;
+      tcsetattr(devs[i].fd, TCSANOW, &tty);
+    }
+    int flags = fcntl(devs[i].fd, F_GETFL);
+    fcntl(devs[i].fd, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+  }
+}
+
+void report(const char *mode, long readings, double t, uint64_t syscalls, uint64_t wakeups) {
+  printf("%-6s %12.0f %16.3f %16.3f\n", mode, readings / t, (double)syscalls / readings, (double)wakeups / readings);
+}
+
+int run_epoll(struct device *devs, int ndevs, int batch, long rounds) {
+  uint64_t waits = 0;
+  long readings = 0;
+  int epfd = epoll_create1(0);
+
+  set_blocking(devs, ndevs, 0);
+  for (int i = 0; i < ndevs; i++) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = i;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, devs[i].fd, &ev);
+  }
+
+  uint64_t io0 = io_syscalls();
+  double t0 = seconds();
+  for (long r = 0; r < rounds; r++) {
+    int waiting = ndevs;
+    for (int i = 0; i < ndevs; i++) {
+      dev_request(&devs[i], batch);
+    }
+    while (waiting > 0) {
+      struct epoll_event events[MAXDEVICES];
+      int nev = epoll_wait(epfd, events, MAXDEVICES, -1);
+      waits++;
+      for (int e = 0; e < nev; e++) {
+        struct device *dev = &devs[events[e].data.u32];
+        int res, was_idle = dev->state == DEV_IDLE;
+        while ((res = dev_recv(dev)) == 1) {
+          readings++;
+        }
+        if (res == -1) {
+          perror("Error reading a device");
+          close(epfd);
+          return -1;
+        }
+        waiting -= !was_idle && dev->state == DEV_IDLE;
+      }
+    }
+  }
+  double t = seconds() - t0;
+  report("epoll", readings, t, io_syscalls() - io0 + waits, waits);
+  close(epfd);
+  return 0;
+}
+
+int run_uring(struct device *devs, int ndevs, int batch, long rounds) {
+  static unsigned char rx[MAXDEVICES][URING_RXBUF];
+  static unsigned char tx[MAXDEVICES][FRAME_MAXLEN];
+  uring_t ring;
+  long readings = 0;
+  char count = (char)batch;
+
+  int err = uring_init(&ring, 2 * MAXDEVICES);
+  if (err < 0) {
+    fprintf(stderr, "No io_uring: %s\n", strerror(-err));
+    return -1;
+  }
+  set_blocking(devs, ndevs, 1);
+  int tx_len = frame_encode(REQUEST, &count, 1, tx[0]);
+  for (int i = 0; i < ndevs; i++) {
+    memcpy(tx[i], tx[0], tx_len);
+    uring_prep(uring_sqe(&ring), IORING_OP_READ, devs[i].fd, rx[i], URING_RXBUF, -1, i);
+  }
+
+  uint64_t io0 = io_syscalls();
+  double t0 = seconds();
+  for (long r = 0; r < rounds; r++) {
+    int waiting = ndevs;
+    for (int i = 0; i < ndevs; i++) {
+      struct io_uring_sqe *sqe = uring_sqe(&ring);
+      uring_prep(sqe, IORING_OP_WRITE, devs[i].fd, tx[i], tx_len, -1, URING_WRITE_TAG | i);
+      uring_quiet(&ring, sqe);
+      dev_expect(&devs[i], batch);
+    }
+    while (waiting > 0) {
+      struct io_uring_cqe cqe;
+      if ((err = uring_enter(&ring, 1)) < 0 && err != -EINTR) {
+        fprintf(stderr, "Error waiting on io_uring: %s\n", strerror(-err));
+        uring_destroy(&ring);
+        return -1;
+      }
+      while (uring_peek(&ring, &cqe)) {
+        if (cqe.user_data & URING_WRITE_TAG) {
+          continue;
+        }
+        struct device *dev = &devs[cqe.user_data];
+        if (cqe.res <= 0) {
+          fprintf(stderr, "Error reading a device: %s\n", strerror(-cqe.res));
+          uring_destroy(&ring);
+          return -1;
+        }
+        int was_idle = dev->state == DEV_IDLE;
+        for (int off = 0; off < cqe.res;) {
+          off += dev_feed(dev, rx[cqe.user_data] + off, cqe.res - off);
+          while (dev_next(dev)) {
+            readings++;
+          }
+        }
+        waiting -= !was_idle && dev->state == DEV_IDLE;
+        uring_prep(uring_sqe(&ring), IORING_OP_READ, dev->fd, rx[cqe.user_data], URING_RXBUF, -1, cqe.user_data);
+      }
+    }
+  }
+  double t = seconds() - t0;
+  report("uring", readings, t, io_syscalls() - io0 + ring.enters, ring.enters);
+  uring_destroy(&ring);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  struct device devs[MAXDEVICES];
+  int ndevs = argc > 1 ? atoi(argv[1]) : 4;
+  int batch = argc > 2 ? atoi(argv[2]) : 20;
+  long rounds = argc > 3 ? atol(argv[3]) : 20000;
+
+  if (ndevs < 1 || ndevs > MAXDEVICES || batch < 1 || batch > 255 || rounds < 1) {
+    fprintf(stderr, "usage: %s [DEVICES (1-%d) [BATCH (1-255) [ROUNDS]]]\n", argv[0], MAXDEVICES);
+    return 1;
+  }
+  pid_t pid = open_devices(devs, ndevs);
+  if (pid == -1) {
+    return 1;
+  }
+
+  printf("%d devices, %d readings per request, %ld rounds\n", ndevs, batch, rounds);
+  printf("%-6s %12s %16s %16s\n", "mode", "readings/s", "syscalls/read", "wakeups/read");
+  int res = run_epoll(devs, ndevs, batch, rounds) || run_uring(devs, ndevs, batch, rounds);
+
+  for (int i = 0; i < ndevs; i++) {
+    close(devs[i].fd);
+  }
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+  return res;
+}
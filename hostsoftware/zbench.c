@@ -0,0 +1,91 @@
+#define _GNU_SOURCE
+
+#include "compress.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * Size and speed of the cold segment encoding in compress.h.
+ * Encodes segments of synthetic hourly readings, a slow random walk like
+ * real weather and uniform noise as a worst case, checks that they decode
+ * back unchanged and reports the ratio against the packed records, the
+ * original 16 byte readings and the 'record' text, plus the encode and
+ * decode rates in MB/s of packed records.
+ *
+ * usage: zbench [ROUNDS]
+ */
+
+double seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+unsigned char walk(unsigned char v) {
+  int step = rand() % 5 - 2;
+  int next = v + (step == 2 || step == -2 ? step / 2 : 0);
+  return next < 0 ? 0 : next > 255 ? 255 : next;
+}
+
+void bench(const char *name, const record_t *recs, uint32_t count, int rounds) {
+  unsigned char *buf = malloc(CSEG_MAXBYTES(count));
+  record_t *out = malloc(count * sizeof(record_t));
+  size_t raw = count * sizeof(record_t);
+  size_t len = 0;
+
+  double t0 = seconds();
+  for (int r = 0; r < rounds; r++) {
+    len = cseg_encode(recs, count, 0, buf);
+  }
+  double t_enc = seconds() - t0;
+
+  int64_t n = 0;
+  t0 = seconds();
+  for (int r = 0; r < rounds; r++) {
+    n = cseg_decode(buf, len, out);
+  }
+  double t_dec = seconds() - t0;
+  int ok = n == count && memcmp(out, recs, raw) == 0;
+
+  printf("%-8s %8zu %8.1fx %8.1fx %8.1fx %10.0f %10.0f%s\n", name, len, (double)raw / len,
+         (double)count * 16 / len, (double)count * RECORD_TEXTLEN / len, raw * rounds / t_enc / 1e6,
+         raw * rounds / t_dec / 1e6, ok ? "" : "  MISMATCH");
+  free(buf);
+  free(out);
+}
+
+int main(int argc, char **argv) {
+  int rounds = (argc > 1) ? atoi(argv[1]) : 2000;
+  uint32_t count = SEGMENT_RECORDS;
+  record_t *recs = malloc(count * sizeof(record_t));
+
+  srand(1);
+  printf("segments of %u hourly readings, %d rounds\n", count, rounds);
+  printf("%-8s %8s %9s %9s %9s %10s %10s\n", "data", "bytes", "vs packed", "vs 16B", "vs text", "enc MB/s",
+         "dec MB/s");
+
+  record_t r = {parse_stamp("202001010000"), 120, 150, 90, 1};
+  for (uint32_t i = 0; i < count; i++) {
+    r.minute += 60;
+    r.tmp = walk(r.tmp);
+    r.prs = walk(r.prs);
+    r.hmd = walk(r.hmd);
+    if (rand() % 24 == 0) {
+      r.rained = 3 - r.rained;
+    }
+    recs[i] = r;
+  }
+  bench("walk", recs, count, rounds);
+
+  for (uint32_t i = 0; i < count; i++) {
+    recs[i].tmp = rand();
+    recs[i].prs = rand();
+    recs[i].hmd = rand();
+    recs[i].rained = rand() % 3;
+  }
+  bench("noise", recs, count, rounds);
+
+  free(recs);
+  return 0;
+}
@@ -0,0 +1,186 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Arduino.h"
+#include "sim.h"
+
+/*
+ * The Arduino API on Linux.
+ *
+ * Serial is the master side of a pseudo terminal; the host software
+ * opens the slave side as it would /dev/ttyACM0.  Input is read in
+ * blocks as the sketch drains it and output is buffered until simFlush
+ * (or Serial.flush()), like the board's UART buffers.  millis() is a
+ * virtual clock, the host's monotonic clock since simOpen scaled by
+ * simClockScale, so blink timing can be sped up.  Pins only exist to be
+ * recorded.
+ */
+#define SIM_BUFFER 4096
+
+struct {
+  int master;
+  int slave;
+  char name[64];
+  char link[256];
+  unsigned char in[SIM_BUFFER];
+  size_t inPos;
+  size_t inLen;
+  unsigned char out[SIM_BUFFER];
+  size_t outLen;
+  struct timespec start;
+  double scale;
+  FILE *trace;
+  uint8_t pins[32];
+  simCounters counters;
+} sim = {-1, -1, "", "", {0}, 0, 0, {0}, 0, {0, 0}, 1.0, NULL, {0}, {0, 0, 0}};
+
+HardwareSerial Serial;
+
+int simOpen(const char *link) {
+  struct termios tty;
+
+  clock_gettime(CLOCK_MONOTONIC, &sim.start);
+  sim.master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (sim.master == -1 || grantpt(sim.master) == -1 || unlockpt(sim.master) == -1 ||
+      ptsname_r(sim.master, sim.name, sizeof(sim.name)) != 0) {
+    perror("Error opening a pseudo terminal");
+    return -1;
+  }
+
+  /*
+   * Holding the slave open keeps the master readable while no host has
+   * it open, and a raw line discipline keeps the terminal from echoing
+   * or translating frames before the host configures it
+   */
+  sim.slave = open(sim.name, O_RDWR | O_NOCTTY);
+  if (sim.slave == -1 || tcgetattr(sim.slave, &tty) == -1) {
+    perror("Error opening the serial side");
+    return -1;
+  }
+  cfmakeraw(&tty);
+  if (tcsetattr(sim.slave, TCSANOW, &tty) == -1 || fcntl(sim.master, F_SETFL, O_NONBLOCK) == -1) {
+    perror("Error setting up the serial side");
+    return -1;
+  }
+
+  if (link) {
+    snprintf(sim.link, sizeof(sim.link), "%s", link);
+    unlink(link);
+    if (symlink(sim.name, link) == -1) {
+      perror("Error linking the serial side");
+      sim.link[0] = 0;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void simClose() {
+  simFlush();
+  if (sim.link[0]) {
+    unlink(sim.link);
+  }
+  if (sim.slave != -1) {
+    close(sim.slave);
+  }
+  if (sim.master != -1) {
+    close(sim.master);
+  }
+}
+
+const char *simSerialName() { return sim.name; }
+
+void simClockScale(double scale) { sim.scale = scale; }
+
+void simTrace(FILE *trace) { sim.trace = trace; }
+
+const simCounters *simStats() { return &sim.counters; }
+
+void simFlush() {
+  size_t done = 0;
+  while (done < sim.outLen) {
+    ssize_t n = write(sim.master, sim.out + done, sim.outLen - done);
+    if (n >= 0) {
+      done += n;
+    } else if (errno == EAGAIN) {
+      // the host is behind, block like a full UART buffer does
+      struct pollfd pfd = {sim.master, POLLOUT, 0};
+      poll(&pfd, 1, -1);
+    } else if (errno != EINTR) {
+      perror("Error writing serial");
+      break;
+    }
+  }
+  sim.outLen = 0;
+}
+
+void simWait(int ms) {
+  struct pollfd pfd = {sim.master, POLLIN, 0};
+  simFlush();
+  if (sim.inPos == sim.inLen) {
+    poll(&pfd, 1, ms);
+  }
+}
+
+unsigned long millis() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double ms = (now.tv_sec - sim.start.tv_sec) * 1e3 + (now.tv_nsec - sim.start.tv_nsec) / 1e6;
+  return (unsigned long)(ms * sim.scale);
+}
+
+void pinMode(uint8_t, uint8_t) {}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  pin %= sizeof(sim.pins);
+  if (sim.pins[pin] != value) {
+    sim.pins[pin] = value;
+    sim.counters.pinChanges++;
+    if (sim.trace) {
+      fprintf(sim.trace, "%lu %u %u\n", millis(), pin, value);
+    }
+  }
+}
+
+// the baud rate only matters to the host's side of the terminal
+void HardwareSerial::begin(unsigned long) {}
+
+void HardwareSerial::end() { simFlush(); }
+
+int HardwareSerial::available() {
+  if (sim.inPos == sim.inLen) {
+    ssize_t n = ::read(sim.master, sim.in, sizeof(sim.in));
+    sim.inPos = 0;
+    sim.inLen = n > 0 ? n : 0;
+  }
+  return sim.inLen - sim.inPos;
+}
+
+int HardwareSerial::read() {
+  if (available() == 0) {
+    return -1;
+  }
+  sim.counters.bytesIn++;
+  return sim.in[sim.inPos++];
+}
+
+size_t HardwareSerial::write(uint8_t b) { return write(&b, 1); }
+
+size_t HardwareSerial::write(const uint8_t *buf, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    if (sim.outLen == sizeof(sim.out)) {
+      simFlush();
+    }
+    sim.out[sim.outLen++] = buf[i];
+  }
+  sim.counters.bytesOut += len;
+  return len;
+}
+
+void HardwareSerial::flush() { simFlush(); }
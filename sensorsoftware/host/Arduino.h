@@ -0,0 +1,43 @@
+/*
+  Arduino.h for building the sensor code on a host, e.g. to generate
+  load for the host software without an Arduino, or to run the sketch
+  as a Linux process (sensorsim).  Only what the sketch and its
+  libraries use is here; Arduino.cpp implements it.
+*/
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define LOW 0
+#define HIGH 1
+#define INPUT 0
+#define OUTPUT 1
+#define LED_BUILTIN 13
+
+// milliseconds on the simulated clock since the sketch started
+unsigned long millis();
+
+void pinMode(uint8_t pin, uint8_t mode);
+// recorded, see simTrace
+void digitalWrite(uint8_t pin, uint8_t value);
+
+// the board's serial port, the master side of a pseudo terminal
+class HardwareSerial {
+public:
+  void begin(unsigned long baud);
+  void end();
+  int available();
+  int read();
+  size_t write(uint8_t b);
+  size_t write(const uint8_t *buf, size_t len);
+  void flush();
+};
+
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,175 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Arduino.h"
+#include "sim.h"
+
+/*
+ * Runs sensorsoftware.ino as a Linux process, with Serial on a pseudo
+ * terminal, and profiles its loop.
+ *
+ * usage: sensorsim [-l LINK] [-x SCALE] [-r TRACE] [-T SECONDS] [-s STALL_US]
+ *
+ * -l LINK     symlink to the serial side, e.g. ./host ../sensorsoftware/host/ttySIM0
+ * -x SCALE    millis() runs SCALE times as fast as real time
+ * -r TRACE    writes every LED change to TRACE
+ * -T SECONDS  stops after SECONDS, otherwise on SIGINT or SIGTERM
+ * -s STALL_US counts loop() calls slower than this as stalls (1000)
+ *
+ * Every loop() call is timed and binned by what it did: nothing (idle),
+ * took a byte of a frame (byte), or answered a command (reply).  The
+ * report on exit gives the distribution of each, which is the firmware's
+ * per-command latency, plus the bytes moved and the throughput from the
+ * host's first byte to the last reply.
+ */
+void setup();
+void loop();
+
+// power of two buckets of nanoseconds
+#define LATENCY_BUCKETS 40
+
+struct latency {
+  unsigned long count;
+  double total;
+  unsigned long max;
+  unsigned long buckets[LATENCY_BUCKETS];
+};
+
+void record(latency *l, unsigned long ns) {
+  int b = 0;
+  while (b < LATENCY_BUCKETS - 1 && (1UL << (b + 1)) <= ns) {
+    b++;
+  }
+  l->buckets[b]++;
+  l->count++;
+  l->total += ns;
+  if (ns > l->max) {
+    l->max = ns;
+  }
+}
+
+// upper bound of the bucket holding quantile q (or the max), in microseconds
+double quantile(const latency *l, double q) {
+  unsigned long want = (unsigned long)(q * l->count), seen = 0;
+  for (int b = 0; b < LATENCY_BUCKETS; b++) {
+    seen += l->buckets[b];
+    if (seen > want) {
+      return ((1UL << (b + 1)) < l->max ? (1UL << (b + 1)) : l->max) / 1e3;
+    }
+  }
+  return l->max / 1e3;
+}
+
+void report(const char *name, const latency *l) {
+  if (l->count == 0) {
+    fprintf(stderr, "  %-5s %12d\n", name, 0);
+    return;
+  }
+  fprintf(stderr, "  %-5s %12lu  mean %9.3f us  p50 <= %9.3f us  p99 <= %9.3f us  p99.9 <= %9.3f us  max %9.3f us\n",
+          name, l->count, l->total / l->count / 1e3, quantile(l, 0.5), quantile(l, 0.99), quantile(l, 0.999),
+          l->max / 1e3);
+}
+
+volatile sig_atomic_t stopping = 0;
+
+void stop(int) { stopping = 1; }
+
+unsigned long elapsedNs(const timespec *from, const timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1000000000UL + to->tv_nsec - from->tv_nsec;
+}
+
+int main(int argc, char **argv) {
+  const char *link = NULL;
+  FILE *trace = NULL;
+  double seconds = 0;
+  unsigned long stallNs = 1000000;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "l:x:r:T:s:")) != -1) {
+    if (opt == 'l') {
+      link = optarg;
+    } else if (opt == 'x' && atof(optarg) > 0) {
+      simClockScale(atof(optarg));
+    } else if (opt == 'r' && (trace = fopen(optarg, "w")) != NULL) {
+      simTrace(trace);
+    } else if (opt == 'T') {
+      seconds = atof(optarg);
+    } else if (opt == 's') {
+      stallNs = atol(optarg) * 1000UL;
+    } else {
+      fprintf(stderr, "Usage: %s [-l link] [-x scale] [-r trace] [-T seconds] [-s stall_us]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if (simOpen(link)) {
+    simClose();
+    return 1;
+  }
+  printf("%s\n", link ? link : simSerialName());
+  fflush(stdout);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  latency idle, byte, reply;
+  memset(&idle, 0, sizeof(idle));
+  memset(&byte, 0, sizeof(byte));
+  memset(&reply, 0, sizeof(reply));
+  unsigned long stalls = 0;
+  const simCounters *c = simStats();
+  timespec start, before, after, first, last;
+
+  setup();
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  after = first = last = start;
+  while (!stopping && (seconds <= 0 || elapsedNs(&start, &after) < seconds * 1e9)) {
+    unsigned long in = c->bytesIn, out = c->bytesOut;
+
+    clock_gettime(CLOCK_MONOTONIC, &before);
+    loop();
+    clock_gettime(CLOCK_MONOTONIC, &after);
+
+    unsigned long ns = elapsedNs(&before, &after);
+    stalls += ns > stallNs;
+    if (c->bytesIn != in && byte.count + reply.count == 0) {
+      first = before;
+    }
+    if (c->bytesOut != out) {
+      last = after;
+      record(&reply, ns);
+      simFlush();
+    } else if (c->bytesIn != in) {
+      record(&byte, ns);
+    } else {
+      // nothing to do, sleep rather than spin (the board would spin)
+      record(&idle, ns);
+      simWait(1);
+    }
+  }
+
+  // throughput over the span the host was talking, from its first byte to the last reply
+  double secs = elapsedNs(&start, &after) / 1e9;
+  double busy = reply.count ? elapsedNs(&first, &last) / 1e9 : 0;
+  fprintf(stderr, "sensorsim: %.3f s, %lu bytes in, %lu bytes out, %lu LED changes, %lu stalls over %lu us\n", secs,
+          c->bytesIn, c->bytesOut, c->pinChanges, stalls, stallNs / 1000);
+  if (busy > 0) {
+    fprintf(stderr, "  %.0f B/s out while busy (%.3f s)\n", c->bytesOut / busy, busy);
+  }
+  report("idle", &idle);
+  report("byte", &byte);
+  report("reply", &reply);
+
+  simClose();
+  if (trace) {
+    fclose(trace);
+  }
+  return 0;
+}
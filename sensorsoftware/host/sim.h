@@ -0,0 +1,42 @@
+/*
+  Control of the host Arduino (Arduino.cpp) for whatever runs the sketch
+  on it, i.e. sensorsim.
+*/
+
+#ifndef sim_h
+#define sim_h
+
+#include <stdio.h>
+
+struct simCounters {
+  unsigned long bytesIn;
+  unsigned long bytesOut;
+  unsigned long pinChanges;
+};
+
+/*
+ * Opens the pseudo terminal behind Serial and, if link is not NULL,
+ * points a symlink there for the host software to open
+ * returns 0 on success
+ */
+int simOpen(const char *link);
+void simClose();
+
+// the slave side, what a host opens instead of /dev/ttyACM0
+const char *simSerialName();
+
+// millis() runs scale times faster than the host's clock
+void simClockScale(double scale);
+
+// every pin change as "millis pin value" lines, NULL to stop
+void simTrace(FILE *trace);
+
+// writes out what the sketch has written to Serial so far
+void simFlush();
+
+// waits up to ms for the host to send something
+void simWait(int ms);
+
+const simCounters *simStats();
+
+#endif
@@ -0,0 +1,65 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "WeatherSensor.h"
+
+/*
+ * Times the generator the way a host would use it to make load: a
+ * sensor per station, each read a batch of hours at a time.
+ *
+ * usage: wsbench [STATIONS] [HOURS]
+ *
+ * Prints readings/s and, as a sanity check on the sampler, the mean and
+ * standard deviation of every reading across all stations.
+ */
+#define BATCH 256
+
+struct moments {
+  double n, mean, m2;
+};
+
+void add(struct moments *m, double x) {
+  m->n += 1;
+  double delta = x - m->mean;
+  m->mean += delta / m->n;
+  m->m2 += delta * (x - m->mean);
+}
+
+void report(const char *name, const struct moments *m) {
+  printf("%-11s mean %7.2f sd %6.2f\n", name, m->mean, m->n > 1 ? sqrt(m->m2 / (m->n - 1)) : 0.0);
+}
+
+int main(int argc, char **argv) {
+  long stations = argc > 1 ? atol(argv[1]) : 100;
+  long hours = argc > 2 ? atol(argv[2]) : 24L * 365;
+  weatherData_t batch[BATCH];
+  struct moments tmp = {0, 0, 0}, prs = {0, 0, 0}, hmd = {0, 0, 0}, rained = {0, 0, 0};
+  struct timespec start, end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (long s = 0; s < stations; s++) {
+    // the sketch's seed, one station a year apart from the next
+    WeatherSensor ws(17695222L + s * 24 * 365);
+    for (long h = 0; h < hours; h += BATCH) {
+      int n = hours - h < BATCH ? hours - h : BATCH;
+      ws.readNextHours(batch, n);
+      for (int i = 0; i < n; i++) {
+        add(&tmp, batch[i].temperature);
+        add(&prs, batch[i].pressure);
+        add(&hmd, batch[i].humidity);
+        add(&rained, batch[i].rained);
+      }
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("%ld readings in %.3f s, %.0f readings/s\n", stations * hours, secs, stations * hours / secs);
+  report("temperature", &tmp);
+  report("pressure", &prs);
+  report("humidity", &hmd);
+  report("rained", &rained);
+  return 0;
+}
@@ -2,44 +2,146 @@
 WeatherSensor ws(17695222l);
 
 /*
+ * Every message is a frame (see hostsoftware/protocol.h):
+ *   0x7E | type | length | payload | CRC16-CCITT (high byte first)
  * - BLink is sent with an argument, and blinks that many times quickly
- * - Request sends a 16 byte response to the user
+ * - Request is sent with a count n, and answers with n DATA frames,
+ *   each carrying a 16 byte reading
  * - Pause stops any LED blinking
  * - Resume unpauses system
+ * - Hello is answered with a Hello carrying the protocol version and the
+ *   current baud rate; one is also sent unprompted right after boot so
+ *   the host knows the sketch is ready
+ * - Baud carries a 4 byte rate; a rate the host supports is acknowledged
+ *   at the old rate and then the serial port switches over, any other
+ *   is ignored
  */
 enum message {
     BLINK   = '1',
     REQUEST = '2',
     PAUSE   = '3',
     RESUME  = '4',
+    DATA    = 'D',
+    HELLO   = 'H',
+    BAUD    = 'B',
 };
 
+#define PROTOCOL_VERSION 1
+#define BOOT_BAUD 9600
+
+#define FRAME_START 0x7E
+#define FRAME_MAXPAYLOAD 32
+
+// receive state machine, one byte at a time
+enum rxState {
+    RX_START,
+    RX_TYPE,
+    RX_LEN,
+    RX_PAYLOAD,
+    RX_CRC_HI,
+    RX_CRC_LO,
+};
+
+rxState rx = RX_START;
+unsigned char rxType;
+unsigned char rxLen;
+unsigned char rxPos;
+unsigned char rxPayload[FRAME_MAXPAYLOAD];
+unsigned int rxCrc;
+
+long baudRate = BOOT_BAUD;
 bool isPaused = false;
-bool hasSentBlink = false;
 bool hasDeadline = false;
 int fastBlinksLeft = 0;
 unsigned long blinkDeadline;
 int ledState = LOW;
 
+void sendHello();
+
 void setup() {
   pinMode(LED_BUILTIN, OUTPUT); 
   digitalWrite(LED_BUILTIN, LOW); 
-  Serial.begin(9600);
+  Serial.begin(baudRate);
+  sendHello();
 }
 
 unsigned long umillis() {return (unsigned long) millis();}
 
+// CRC16-CCITT (poly 0x1021, init 0xFFFF), fed one byte at a time
+unsigned int crcUpdate(unsigned int crc, unsigned char b) {
+  crc ^= (unsigned int)b << 8;
+  for (int i = 0; i < 8; i++) {
+    crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc & 0xFFFF;
+}
+
+void sendFrame(unsigned char type, const unsigned char *payload, unsigned char len) {
+  unsigned int crc = 0xFFFF;
+  crc = crcUpdate(crc, type);
+  crc = crcUpdate(crc, len);
+  for (int i = 0; i < len; i++) {
+    crc = crcUpdate(crc, payload[i]);
+  }
+  Serial.write(FRAME_START);
+  Serial.write(type);
+  Serial.write(len);
+  Serial.write(payload, len);
+  Serial.write((unsigned char)(crc >> 8));
+  Serial.write((unsigned char)(crc & 0xFF));
+}
+
 void flipLED() {
   ledState = !ledState;
   digitalWrite(LED_BUILTIN, ledState);
 }
 
-// write a 16 byte message back over serial
-void handleRequest() {
+// tell the host we are up, which protocol we speak and how fast
+void sendHello() {
+  unsigned char payload[5] = {PROTOCOL_VERSION,
+                              (unsigned char)(baudRate >> 24), (unsigned char)(baudRate >> 16),
+                              (unsigned char)(baudRate >> 8), (unsigned char)baudRate};
+  sendFrame(HELLO, payload, 5);
+}
+
+// the rates the host can follow (baud_to_speed in arduinocom.h)
+bool supportedBaud(long rate) {
+  switch (rate) {
+    case 9600:
+    case 19200:
+    case 38400:
+    case 57600:
+    case 115200:
+    case 230400:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// acknowledge a new baud rate at the current one, then switch;
+// any other rate goes unanswered, so the host times out and stays put
+void handleBaud() {
+  long rate = ((long)rxPayload[0] << 24) | ((long)rxPayload[1] << 16) |
+              ((long)rxPayload[2] << 8) | (long)rxPayload[3];
+  if (!supportedBaud(rate)) {
+    return;
+  }
+  sendFrame(BAUD, rxPayload, 4);
+  Serial.flush();
+  baudRate = rate;
+  Serial.end();
+  Serial.begin(baudRate);
+}
+
+// write n 16 byte readings back over serial, one DATA frame each
+void handleRequest(int n) {
   weatherData_t datum;
-  ws.readNextHour(&datum);
-  // note not null terminated
-  Serial.write((char *)&datum, 16);
+  for (int i = 0; i < n; i++) {
+    ws.readNextHour(&datum);
+    // note not null terminated
+    sendFrame(DATA, (unsigned char *)&datum, 16);
+  }
   if (!hasDeadline) {
     flipLED();
     blinkDeadline = umillis() + 500;
@@ -47,14 +149,17 @@ void handleRequest() {
   }
 }
 
-// parse an incomming message and act accordingly
+// act on a complete, valid frame
 void handleCommand() {
-      switch (Serial.read()) {
+      switch (rxType) {
         case BLINK:
-          hasSentBlink = true;
+          if (rxLen >= 1) {
+            fastBlinksLeft = rxPayload[0] * 2 - 1;
+            hasDeadline = true;
+          }
           break;
         case REQUEST:
-          handleRequest();
+          handleRequest(rxLen >= 1 ? rxPayload[0] : 1);
           break;
         case PAUSE:
           isPaused = true;
@@ -62,9 +167,61 @@ void handleCommand() {
         case RESUME:
           isPaused = false;
           break;
+        case HELLO:
+          sendHello();
+          break;
+        case BAUD:
+          if (rxLen == 4) {
+            handleBaud();
+          }
+          break;
     }
 }
 
+// feed one received byte through the frame state machine,
+// a bad length or CRC drops the frame and waits for the next start byte
+void handleByte(unsigned char b) {
+  switch (rx) {
+    case RX_START:
+      if (b == FRAME_START) {
+        rxCrc = 0xFFFF;
+        rx = RX_TYPE;
+      }
+      break;
+    case RX_TYPE:
+      rxType = b;
+      rxCrc = crcUpdate(rxCrc, b);
+      rx = RX_LEN;
+      break;
+    case RX_LEN:
+      rxLen = b;
+      rxPos = 0;
+      rxCrc = crcUpdate(rxCrc, b);
+      if (rxLen > FRAME_MAXPAYLOAD) {
+        rx = RX_START;
+      } else {
+        rx = rxLen ? RX_PAYLOAD : RX_CRC_HI;
+      }
+      break;
+    case RX_PAYLOAD:
+      rxPayload[rxPos++] = b;
+      rxCrc = crcUpdate(rxCrc, b);
+      if (rxPos == rxLen) {
+        rx = RX_CRC_HI;
+      }
+      break;
+    case RX_CRC_HI:
+      rx = (b == (rxCrc >> 8)) ? RX_CRC_LO : RX_START;
+      break;
+    case RX_CRC_LO:
+      rx = RX_START;
+      if (b == (rxCrc & 0xFF)) {
+        handleCommand();
+      }
+      break;
+  }
+}
+
 void handleBlinkState(){
   if (isPaused) {
     ledState = LOW;
@@ -91,11 +248,5 @@ void loop() {
     return;
   }
   
-  if (hasSentBlink) {
-    fastBlinksLeft = Serial.read() * 2 - 1;
-    hasSentBlink = false;
-    hasDeadline = true;
-  } else {
-    handleCommand();
-  }
+  handleByte(Serial.read());
 } 
@@ -1,21 +1,47 @@
 #include "WeatherSensor.h"
 #include "Arduino.h"
-#include "limits.h"
+
+// largest value random() returns plus one, LONG_MAX on the Arduino
+#define RANDOM_RANGE 0x7FFFFFFFL
+
+const int daysIn[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+
+/*
+ * avr-libc's random(): the Park-Miller "minimal standard" generator
+ * computed with Schrage's method.  It is kept per sensor so several
+ * sensors (stations, when generating on a host) each get the stream
+ * their seed gives on the board, however their calls interleave.
+ */
+long WeatherSensor::nextRandom(long howbig) {
+  long x = randomState;
+  // the generator is stuck at 0, avr-libc moves it elsewhere
+  if (x == 0)
+    x = 123459876L;
+  long hi = x / 127773L;
+  long lo = x % 127773L;
+  x = 16807L * lo - 2836L * hi;
+  if (x < 0)
+    x += 0x7fffffffL;
+  randomState = x;
+  return x % howbig;
+}
+
+// uniform in (0, 1)
+double WeatherSensor::uniform() { return nextRandom(RANDOM_RANGE) / (double)RANDOM_RANGE; }
+
+#ifdef ARDUINO
 
 // Taken from Creative Commons
 // https://en.wikipedia.org/wiki/Marsaglia_polar_method
-double generateGaussian(double mean, double stdDev) {
-  static double spare;
-  static bool hasSpare = false;
-
+double WeatherSensor::gaussian(double mean, double stdDev) {
   if (hasSpare) {
     hasSpare = false;
     return spare * stdDev + mean;
   } else {
     double u, v, s;
     do {
-      u = (random(LONG_MAX) / ((double)LONG_MAX)) * 2.0 - 1.0;
-      v = (random(LONG_MAX) / ((double)LONG_MAX)) * 2.0 - 1.0;
+      u = uniform() * 2.0 - 1.0;
+      v = uniform() * 2.0 - 1.0;
       s = u * u + v * v;
     } while (s >= 1.0 || s == 0.0);
     s = sqrt(-2.0 * log(s) / s);
@@ -25,88 +51,202 @@ double generateGaussian(double mean, double stdDev) {
   }
 }
 
+// temperature and humidity before noise at a given hour
+void hourlyBase(int hour, double *tmp, double *hum) {
+  float time = hour / 24.0;
+  *tmp = -100.0 * cos(time * 3.14 * 2.0) + 128.0;
+  *hum = -100.0 * sin(time * 3.14 * 4.0) + 128.0;
+}
+
+#else
+
+/*
+ * Off the Arduino there is memory for tables, so the noise comes from a
+ * ziggurat (Marsaglia and Tsang, in Doornik's formulation) instead of
+ * the polar method: 128 layers of equal area under the normal density,
+ * one draw per sample almost every time, and exp/log only in the rare
+ * rejections.  The daily curves are tabled per hour as well.
+ */
+#define ZIGGURAT_LAYERS 128
+#define ZIGGURAT_R 3.442619855899
+#define ZIGGURAT_V 9.91256303526217e-3
+
+double zigX[ZIGGURAT_LAYERS + 1];
+double zigRatio[ZIGGURAT_LAYERS];
+double baseTmp[24];
+double baseHum[24];
+bool tablesReady = false;
+
+void buildTables() {
+  double f = exp(-0.5 * ZIGGURAT_R * ZIGGURAT_R);
+  zigX[0] = ZIGGURAT_V / f;
+  zigX[1] = ZIGGURAT_R;
+  zigX[ZIGGURAT_LAYERS] = 0;
+  for (int i = 2; i < ZIGGURAT_LAYERS; i++) {
+    zigX[i] = sqrt(-2 * log(ZIGGURAT_V / zigX[i - 1] + f));
+    f = exp(-0.5 * zigX[i] * zigX[i]);
+  }
+  for (int i = 0; i < ZIGGURAT_LAYERS; i++) {
+    zigRatio[i] = zigX[i + 1] / zigX[i];
+  }
+  for (int h = 0; h < 24; h++) {
+    float time = h / 24.0;
+    baseTmp[h] = -100.0 * cos(time * 3.14 * 2.0) + 128.0;
+    baseHum[h] = -100.0 * sin(time * 3.14 * 4.0) + 128.0;
+  }
+  tablesReady = true;
+}
+
+double WeatherSensor::gaussian(double mean, double stdDev) {
+  for (;;) {
+    // the low 7 bits pick the layer, the other 24 a point across it
+    long r = nextRandom(RANDOM_RANGE);
+    int i = r & (ZIGGURAT_LAYERS - 1);
+    double u = (r >> 7) / (double)(1L << 23) - 1.0;
+
+    if (fabs(u) < zigRatio[i]) {
+      return mean + stdDev * u * zigX[i];
+    }
+    if (i == 0) {
+      // the tail past R
+      double x, y;
+      do {
+        x = log(uniform()) / ZIGGURAT_R;
+        y = log(uniform());
+      } while (-2 * y < x * x);
+      return mean + stdDev * (u < 0 ? x - ZIGGURAT_R : ZIGGURAT_R - x);
+    }
+    double x = u * zigX[i];
+    double f0 = exp(-0.5 * (zigX[i] * zigX[i] - x * x));
+    double f1 = exp(-0.5 * (zigX[i + 1] * zigX[i + 1] - x * x));
+    if (f1 + uniform() * (f0 - f1) < 1.0) {
+      return mean + stdDev * x;
+    }
+  }
+}
+
+void hourlyBase(int hour, double *tmp, double *hum) {
+  *tmp = baseTmp[hour];
+  *hum = baseHum[hour];
+}
+
+#endif
+
+// a reading as a byte, saturating instead of wrapping
+unsigned char toByte(double v) { return v < 0 ? 0 : v > 255 ? 255 : (unsigned char)v; }
+
 WeatherSensor::WeatherSensor(long seed) {
-  randomSeed(seed);
+  // randomSeed(0) leaves avr-libc's generator at its initial state
+  randomState = seed != 0 ? seed : 1;
+  hasSpare = false;
   nhours = seed;
   pressureState = 2;
+
+  // the calendar is worked out from scratch once, then advanced
+  hour = nhours % 24;
+  long days = nhours / 24;
+  year = days / 365;
+  dayOfYear = days % 365;
+  month = 0;
+  dayOfMonth = dayOfYear;
+  while (dayOfMonth > daysIn[month]) {
+    dayOfMonth -= daysIn[month];
+    month += 1;
+    month %= 12;
+  }
+#ifndef ARDUINO
+  if (!tablesReady) {
+    buildTables();
+  }
+#endif
 }
 
 int WeatherSensor::readNextHour(weatherData_t *datum) {
+  readNextHours(datum, 1);
+  return 0;
+}
 
-  nhours += 1;
-  updateTime(datum->dateTime);
-
-  // 4 random bits for use in a few places
-  int r = random(16);
-  bool observedRained = r & 1;
-  r = r >> 1;
-
-  // tmp is negative cos daily with noise
-  float time = (nhours % 24) / 24.0;
-  double tmp =
-      -100.0 * cos(time * 3.14 * 2.0) + 128.0 + generateGaussian(0.0, 10.0);
-  tmp = (tmp > 0 && tmp < 255) ? tmp : 128.0;
-  datum->temperature = tmp;
-
-  // humidity is sin(2x) with noise
-  double hum =
-      -100.0 * sin(time * 3.14 * 4.0) + 128.0 + generateGaussian(0.0, 10.0);
-  hum = (hum > 0 && hum < 255) ? hum : 128.0;
-  datum->humidity = hum;
-
-  // pressure is a markov model, with 1/8 chance to switch to adjacent state
-  // fluctuates in {1,2,3,4}
-  if (r == 1 && pressureState < 4)
-    pressureState += 1;
-  if (r == 2 && pressureState > 1)
-    pressureState -= 1;
-  datum->pressure = pressureState * 50 + 28 + generateGaussian(0.0, 10.0);
-
-  // 1 is no-rain, 2 is rain, 0 is no data
-  unsigned char watermark = generateGaussian(128.0, 20.0);
-  if (observedRained) {
-    datum->rained =
-        1 + (datum->humidity > watermark && datum->temperature > watermark &&
-             datum->pressure > watermark);
-  } else {
-    datum->rained = 0;
+int WeatherSensor::readNextHours(weatherData_t *data, int n) {
+  for (int k = 0; k < n; k++) {
+    weatherData_t *datum = &data[k];
+
+    nhours += 1;
+    updateTime(datum->dateTime);
+
+    // 4 random bits for use in a few places
+    int r = nextRandom(16);
+    bool observedRained = r & 1;
+    r = r >> 1;
+
+    // tmp is negative cos daily with noise
+    double tmp, hum;
+    hourlyBase(hour, &tmp, &hum);
+    tmp += gaussian(0.0, 10.0);
+    tmp = (tmp > 0 && tmp < 255) ? tmp : 128.0;
+    datum->temperature = tmp;
+
+    // humidity is sin(2x) with noise
+    hum += gaussian(0.0, 10.0);
+    hum = (hum > 0 && hum < 255) ? hum : 128.0;
+    datum->humidity = hum;
+
+    // pressure is a markov model, with 1/8 chance to switch to adjacent state
+    // fluctuates in {1,2,3,4}
+    if (r == 1 && pressureState < 4)
+      pressureState += 1;
+    if (r == 2 && pressureState > 1)
+      pressureState -= 1;
+    datum->pressure = toByte(pressureState * 50 + 28 + gaussian(0.0, 10.0));
+
+    // 1 is no-rain, 2 is rain, 0 is no data
+    unsigned char watermark = toByte(gaussian(128.0, 20.0));
+    if (observedRained) {
+      datum->rained =
+          1 + (datum->humidity > watermark && datum->temperature > watermark &&
+               datum->pressure > watermark);
+    } else {
+      datum->rained = 0;
+    }
   }
-  return 0;
+  return n;
 }
 
-// neglects to deal with leap year
+/*
+ * Moves the calendar on by an hour and prints it.  Same dates as working
+ * them out from nhours every time (including neglecting leap years), but
+ * without the month loop.
+ */
 void WeatherSensor::updateTime(char *dateTime) {
-  long hours = nhours % 24;
-  long days = nhours / 24;
-  long month = 0;
-  long year = 0;
-  int daysIn[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
-
-  year = days / 365;
-  days %= 365;
-
-  while (days > daysIn[month]) {
-    days -= daysIn[month];
-    month += 1;
-    month %= 12;
+  if (++hour == 24) {
+    hour = 0;
+    if (++dayOfYear == 365) {
+      dayOfYear = 0;
+      dayOfMonth = 0;
+      month = 0;
+      year += 1;
+    } else if (++dayOfMonth > daysIn[month]) {
+      dayOfMonth -= daysIn[month];
+      month += 1;
+      month %= 12;
+    }
   }
 
-  month += 1;
-  days += 1;
+  long days = dayOfMonth + 1;
+  long mon = month + 1;
 
   dateTime[0] = (year / 1000) % 10 + '0';
   dateTime[1] = (year / 100) % 10 + '0';
   dateTime[2] = (year / 10) % 10 + '0';
   dateTime[3] = year % 10 + '0';
 
-  dateTime[4] = month / 10 + '0';
-  dateTime[5] = month % 10 + '0';
+  dateTime[4] = mon / 10 + '0';
+  dateTime[5] = mon % 10 + '0';
 
   dateTime[6] = (days / 10) + '0';
   dateTime[7] = (days % 10) + '0';
 
-  dateTime[8] = hours / 10 + '0';
-  dateTime[9] = hours % 10 + '0';
+  dateTime[8] = hour / 10 + '0';
+  dateTime[9] = hour % 10 + '0';
 
   dateTime[10] = '0';
   dateTime[11] = '0';
@@ -21,10 +21,25 @@ class WeatherSensor {
 public:
   WeatherSensor(long seed);
   int readNextHour(weatherData_t *datum);
+  // the next n hours into data[0..n-1], returns n
+  int readNextHours(weatherData_t *data, int n);
 private:
   void updateTime(char *dateTime);
+  long nextRandom(long howbig);
+  double uniform();
+  double gaussian(double mean, double stdDev);
   long nhours;
   int pressureState;
+  // random() of avr-libc, but one stream per sensor
+  unsigned long randomState;
+  double spare;
+  bool hasSpare;
+  // calendar of nhours as updateTime prints it, advanced an hour at a time
+  long year;
+  int dayOfYear;
+  int month;
+  int dayOfMonth;
+  int hour;
 };
 
 #endif